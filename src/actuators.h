@@ -0,0 +1,75 @@
+#ifndef ACTUATORS_H
+#define ACTUATORS_H
+
+#include <stdint.h>
+
+//Actuator table. One row per relay channel, the actuator type is the row index + 1. Pins, topics, NVS
+//keys and the per-channel state are generated from it, another zone is another row:
+//  control topics doa/<id>/control/<name>, <name>_calendar, <name>_calendar_bin
+//  monitor topics doa/<id>/monitor/<name>, <name>_calendar_version
+//  NVS keys       <name>H0, <name>H1, <name>P<n>a, <name>P<n>b (calendar_store.h)
+#define ACTUATOR_PUMP 0x01 //switched through the low water interlock (halPumpOpen), every such row
+
+#define ACTUATOR_PUMPS_MAX 4 //rows the float switch interlocks
+
+#define ACTUATOR_NAME_MAX 9 //NVS keys are limited to 15 characters, "<name>Length" is the longest
+
+typedef struct
+{
+  const char *name;
+  uint8_t pin;   //relay, active LOW
+  uint8_t flags; //ACTUATOR_*
+} actuatorConfig;
+
+static constexpr actuatorConfig actuatorTable[] = {
+    {"water", 5, ACTUATOR_PUMP},
+    {"fan", 18, 0},
+    {"led", 17, 0},
+    {"lamp", 23, 0},
+};
+
+#define ACTUATOR_COUNT ((uint8_t)(sizeof(actuatorTable) / sizeof(actuatorTable[0])))
+
+//Compile time checks of the table (C++11 constexpr, one return statement each)
+static constexpr uint8_t actuatorNameLength(const char *name)
+{
+  return *name ? 1 + actuatorNameLength(name + 1) : 0;
+}
+
+static constexpr bool actuatorNamesFit(uint8_t i = 0)
+{
+  return i == ACTUATOR_COUNT || (actuatorNameLength(actuatorTable[i].name) > 0 &&
+                                 actuatorNameLength(actuatorTable[i].name) <= ACTUATOR_NAME_MAX && actuatorNamesFit(i + 1));
+}
+
+static constexpr bool actuatorPinUnique(uint8_t i, uint8_t j)
+{
+  return j == ACTUATOR_COUNT || (actuatorTable[i].pin != actuatorTable[j].pin && actuatorPinUnique(i, j + 1));
+}
+
+static constexpr bool actuatorPinsUnique(uint8_t i = 0)
+{
+  return i == ACTUATOR_COUNT || (actuatorPinUnique(i, i + 1) && actuatorPinsUnique(i + 1));
+}
+
+static constexpr uint8_t actuatorPumpCount(uint8_t i = 0)
+{
+  return i == ACTUATOR_COUNT ? 0 : ((actuatorTable[i].flags & ACTUATOR_PUMP) ? 1 : 0) + actuatorPumpCount(i + 1);
+}
+
+//Actuator type of an ACTUATOR_PUMP row
+static constexpr bool actuatorIsPump(uint8_t type)
+{
+  return type > 0 && type <= ACTUATOR_COUNT && (actuatorTable[type - 1].flags & ACTUATOR_PUMP) != 0;
+}
+
+static_assert(ACTUATOR_COUNT > 0 && ACTUATOR_COUNT < 0xFF, "types 1 ... 254, 0xFF is CALENDAR_ALL");
+static_assert(actuatorNamesFit(), "actuator names are 1 to ACTUATOR_NAME_MAX characters");
+static_assert(actuatorPinsUnique(), "one relay per pin");
+static_assert(actuatorPumpCount() > 0 && actuatorPumpCount() <= ACTUATOR_PUMPS_MAX,
+              "the float switch interlocks 1 to ACTUATOR_PUMPS_MAX pumps");
+
+//Type of the actuator called name, 0 if there is none
+uint8_t actuatorType(const char *name);
+
+#endif
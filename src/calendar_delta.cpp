@@ -0,0 +1,151 @@
+#include "calendar_delta.h"
+#include <stdlib.h>
+#include <string.h>
+
+static uint16_t readU16(const uint8_t *p)
+{
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static calendarRule readRecord(const calendarDelta *delta, uint16_t i)
+{
+  const uint8_t *p = delta->records + i * CALENDAR_BIN_RECORD;
+  calendarRule rule;
+
+  rule.minute = readU16(p);
+  rule.days = p[2];
+  rule.action = p[3];
+  return rule;
+}
+
+static bool sameRule(const calendarRule *a, const calendarRule *b)
+{
+  return a->minute == b->minute && a->days == b->days && a->action == b->action;
+}
+
+uint8_t calendarDeltaDecode(const uint8_t *data, unsigned int length, calendarDelta *delta)
+{
+  if (length < CALENDAR_BIN_HEADER || data[0] != CALENDAR_BIN_FORMAT)
+  {
+    return CALENDAR_DELTA_BAD_FORMAT;
+  }
+
+  delta->op = data[1];
+  delta->baseVersion = readU16(data + 2);
+  delta->newVersion = readU16(data + 4);
+  delta->rangeStart = readU16(data + 6);
+  delta->rangeEnd = readU16(data + 8);
+  delta->count = readU16(data + 10);
+  delta->records = data + CALENDAR_BIN_HEADER;
+
+  if (delta->op < CALENDAR_OP_REPLACE_ALL || delta->op > CALENDAR_OP_REPLACE_RANGE ||
+      length != CALENDAR_BIN_HEADER + (unsigned int)delta->count * CALENDAR_BIN_RECORD)
+  {
+    return CALENDAR_DELTA_BAD_FORMAT;
+  }
+  if (delta->op == CALENDAR_OP_REPLACE_RANGE &&
+      (delta->rangeStart >= delta->rangeEnd || delta->rangeEnd > MINUTES_PER_DAY))
+  {
+    return CALENDAR_DELTA_BAD_FORMAT;
+  }
+
+  for (uint16_t i = 0; i < delta->count; i++)
+  {
+    calendarRule rule = readRecord(delta, i);
+    if (rule.minute >= MINUTES_PER_DAY || rule.days == 0 || rule.days > DAYS_ALL || rule.action > 1)
+    {
+      return CALENDAR_DELTA_BAD_FORMAT;
+    }
+    if (delta->op == CALENDAR_OP_REPLACE_RANGE && (rule.minute < delta->rangeStart || rule.minute >= delta->rangeEnd))
+    {
+      return CALENDAR_DELTA_BAD_FORMAT;
+    }
+  }
+  return CALENDAR_DELTA_OK;
+}
+
+uint8_t calendarDeltaApply(const calendarDelta *delta, const calendarRule *rules, uint16_t length, uint16_t version,
+                           calendarRule **newRules, uint16_t *newLength)
+{
+  uint32_t capacity;
+  uint16_t count = 0;
+
+  if (delta->op != CALENDAR_OP_REPLACE_ALL && delta->baseVersion != version)
+  {
+    return CALENDAR_DELTA_VERSION;
+  }
+
+  capacity = (delta->op == CALENDAR_OP_REPLACE_ALL) ? delta->count : (uint32_t)length + delta->count;
+  if (delta->op == CALENDAR_OP_DELETE)
+  {
+    capacity = length;
+  }
+  if (capacity > CALENDAR_MAX_RULES)
+  {
+    return CALENDAR_DELTA_TOO_LARGE;
+  }
+
+  calendarRule *result = NULL;
+  if (capacity > 0)
+  {
+    result = (calendarRule *)malloc(capacity * sizeof(calendarRule));
+    if (result == NULL)
+    {
+      return CALENDAR_DELTA_NO_MEMORY;
+    }
+  }
+
+  //Current rules that survive the operation
+  if (delta->op == CALENDAR_OP_INSERT || delta->op == CALENDAR_OP_DELETE)
+  {
+    memcpy(result, rules, length * sizeof(calendarRule));
+    count = length;
+  }
+  else if (delta->op == CALENDAR_OP_REPLACE_RANGE)
+  {
+    for (uint16_t i = 0; i < length; i++)
+    {
+      if (rules[i].minute < delta->rangeStart || rules[i].minute >= delta->rangeEnd)
+      {
+        result[count++] = rules[i];
+      }
+    }
+  }
+
+  if (delta->op == CALENDAR_OP_DELETE)
+  {
+    for (uint16_t r = 0; r < delta->count; r++)
+    {
+      calendarRule rule = readRecord(delta, r);
+      uint16_t i = 0;
+      while (i < count && !sameRule(&result[i], &rule))
+      {
+        i++;
+      }
+      if (i == count)
+      {
+        free(result);
+        return CALENDAR_DELTA_NOT_FOUND;
+      }
+      memmove(&result[i], &result[i + 1], (count - i - 1) * sizeof(calendarRule)); //Keeps the order
+      count--;
+    }
+  }
+  else
+  {
+    for (uint16_t r = 0; r < delta->count; r++)
+    {
+      result[count++] = readRecord(delta, r);
+    }
+  }
+  count = calendarNormalize(result, count);
+
+  if (count == 0)
+  {
+    free(result);
+    result = NULL;
+  }
+  *newRules = result;
+  *newLength = count;
+  return CALENDAR_DELTA_OK;
+}
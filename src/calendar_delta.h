@@ -0,0 +1,51 @@
+#ifndef CALENDAR_DELTA_H
+#define CALENDAR_DELTA_H
+
+#include <stdint.h>
+#include "calendar_engine.h"
+
+//Binary calendar message on .../control/<x>_calendar_bin, all fields little endian
+//  0 uint8  format, CALENDAR_BIN_FORMAT
+//  1 uint8  op, CALENDAR_OP_*
+//  2 uint16 baseVersion, version the delta was made against (ignored by REPLACE_ALL)
+//  4 uint16 newVersion, version of the calendar after the operation
+//  6 uint16 rangeStart, minute of day (REPLACE_RANGE only)
+//  8 uint16 rangeEnd, minute of day, exclusive (REPLACE_RANGE only)
+// 10 uint16 count, number of records
+// 12 count * {uint16 minute, uint8 days, uint8 action}, same layout as calendarRule
+#define CALENDAR_BIN_FORMAT 1
+#define CALENDAR_BIN_HEADER 12
+#define CALENDAR_BIN_RECORD 4
+
+#define CALENDAR_OP_REPLACE_ALL 1   //records are the new calendar
+#define CALENDAR_OP_INSERT 2        //records are added
+#define CALENDAR_OP_DELETE 3        //one equal rule is removed per record, rules as uploaded
+#define CALENDAR_OP_REPLACE_RANGE 4 //rules in [rangeStart, rangeEnd) are replaced by the records
+
+#define CALENDAR_DELTA_OK 0
+#define CALENDAR_DELTA_BAD_FORMAT 1
+#define CALENDAR_DELTA_VERSION 2   //baseVersion does not match, send REPLACE_ALL
+#define CALENDAR_DELTA_NOT_FOUND 3 //DELETE of a rule the calendar does not have
+#define CALENDAR_DELTA_TOO_LARGE 4
+#define CALENDAR_DELTA_NO_MEMORY 5
+
+typedef struct
+{
+  uint8_t op;
+  uint16_t baseVersion;
+  uint16_t newVersion;
+  uint16_t rangeStart;
+  uint16_t rangeEnd;
+  uint16_t count;
+  const uint8_t *records; //points into the message
+} calendarDelta;
+
+//Checks the header, the message length and every record
+uint8_t calendarDeltaDecode(const uint8_t *data, unsigned int length, calendarDelta *delta);
+
+//Builds the calendar after the delta into a new allocation (*newRules, NULL when empty), normalized.
+//rules/length/version describe the current uploaded calendar (calendarInfo.source) and are not modified.
+uint8_t calendarDeltaApply(const calendarDelta *delta, const calendarRule *rules, uint16_t length, uint16_t version,
+                           calendarRule **newRules, uint16_t *newLength);
+
+#endif
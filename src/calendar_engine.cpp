@@ -0,0 +1,278 @@
+#include "calendar_engine.h"
+#include <stdlib.h>
+
+#define DAY_BIT(day) (1 << ((day) % 7))
+
+//Number of rules at or before minuteOfDay
+static int upperBound(const calendarRule *rules, uint16_t length, uint16_t minuteOfDay)
+{
+  int low = 0, high = length;
+
+  while (low < high)
+  {
+    int mid = (low + high) / 2;
+    if (rules[mid].minute <= minuteOfDay)
+    {
+      low = mid + 1;
+    }
+    else
+    {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+uint8_t calendarRepeatToDays(uint16_t repeat, uint16_t dayofweek)
+{
+  switch (repeat)
+  {
+  case 0: //0: Haftanın bir günü
+    return (dayofweek < 7) ? DAY_BIT(dayofweek) : 0;
+  case 1: //1: haftanın her günü
+    return DAYS_ALL;
+  case 2: //2:Hafta içi günler
+    return DAYS_WEEKDAYS;
+  case 3: //3:Hafta sonu günler, 0 Pazar, 6 Cumartesi
+    return DAYS_WEEKEND;
+  default:
+    return 0;
+  }
+}
+
+//Stable insertion sort, only used when there is no memory for the radix buffer
+static void insertionSort(calendarRule *rules, uint16_t length)
+{
+  for (int i = 1; i < length; i++)
+  {
+    calendarRule temp = rules[i];
+    int j = i - 1;
+    while (j >= 0 && rules[j].minute > temp.minute)
+    {
+      rules[j + 1] = rules[j];
+      j--;
+    }
+    rules[j + 1] = temp;
+  }
+}
+
+//One counting pass on the minute bits selected by shift, from src into dst
+static void radixPass(const calendarRule *src, calendarRule *dst, uint16_t length, uint8_t shift)
+{
+  uint16_t count[256] = {0};
+
+  for (uint16_t i = 0; i < length; i++)
+  {
+    count[(src[i].minute >> shift) & 0xFF]++;
+  }
+  for (uint16_t k = 0, sum = 0; k < 256; k++)
+  {
+    uint16_t c = count[k];
+    count[k] = sum;
+    sum += c;
+  }
+  for (uint16_t i = 0; i < length; i++)
+  {
+    dst[count[(src[i].minute >> shift) & 0xFF]++] = src[i];
+  }
+}
+
+void sort_calendar(calendarRule *rules, uint16_t length)
+{
+  //minute < 2048: two stable counting passes, low byte then high byte
+  if (length < 2)
+  {
+    return;
+  }
+  calendarRule *buffer = (calendarRule *)malloc(length * sizeof(calendarRule));
+  if (buffer == NULL)
+  {
+    insertionSort(rules, length);
+    return;
+  }
+  radixPass(rules, buffer, length, 0);
+  radixPass(buffer, rules, length, 8);
+  free(buffer);
+}
+
+//Rules of one minute in upload order -> at most one "on" and one "off" rule, the last rule wins on each day
+static uint16_t mergeMinute(calendarRule *rules, uint16_t first, uint16_t last, uint16_t out)
+{
+  uint16_t minute = rules[first].minute;
+  uint8_t onDays = 0, offDays = 0;
+
+  for (uint16_t i = first; i < last; i++)
+  {
+    if (rules[i].action)
+    {
+      onDays |= rules[i].days;
+      offDays &= ~rules[i].days;
+    }
+    else
+    {
+      offDays |= rules[i].days;
+      onDays &= ~rules[i].days;
+    }
+  }
+  if (offDays)
+  {
+    rules[out++] = {minute, offDays, 0};
+  }
+  if (onDays)
+  {
+    rules[out++] = {minute, onDays, 1};
+  }
+  return out;
+}
+
+//First transition of the week, false if there is none
+static bool firstTransition(const calendarRule *rules, uint16_t length, uint16_t *index, uint8_t *day)
+{
+  for (*day = 0; *day < 7; (*day)++)
+  {
+    for (*index = 0; *index < length; (*index)++)
+    {
+      if (rules[*index].days & DAY_BIT(*day))
+      {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+uint16_t calendarNormalize(calendarRule *rules, uint16_t length)
+{
+  uint16_t count = 0;
+
+  for (uint16_t i = 0; i < length; i++)
+  {
+    rules[i].days &= DAYS_ALL;
+    if (rules[i].minute < MINUTES_PER_DAY && rules[i].days && rules[i].action < 2)
+    {
+      rules[count++] = rules[i];
+    }
+  }
+  sort_calendar(rules, count);
+  return count;
+}
+
+uint16_t calendarCompile(calendarRule *rules, uint16_t length)
+{
+  uint16_t count = 0, first;
+  uint8_t state, day;
+  bool constant = true;
+
+  //One rule per minute and action
+  length = calendarNormalize(rules, length);
+  for (uint16_t begin = 0, end; begin < length; begin = end)
+  {
+    end = begin + 1;
+    while (end < length && rules[end].minute == rules[begin].minute)
+    {
+      end++;
+    }
+    count = mergeMinute(rules, begin, end, count);
+  }
+  length = count;
+
+  if (!calendarStateAt(rules, length, MINUTES_PER_WEEK - 1, &state) || !firstTransition(rules, length, &first, &day))
+  {
+    return 0;
+  }
+  for (uint16_t i = 0; i < length; i++)
+  {
+    constant = constant && rules[i].action == state;
+  }
+  if (constant)
+  {
+    //Always the same state, a single transition a week keeps it
+    rules[0] = {rules[first].minute, (uint8_t)DAY_BIT(day), state};
+    return 1;
+  }
+
+  //Drop transitions to the state already in effect. state is the end of the week, in effect before the first one.
+  for (day = 0; day < 7; day++)
+  {
+    for (uint16_t i = 0; i < length; i++)
+    {
+      if (rules[i].days & DAY_BIT(day))
+      {
+        if (rules[i].action == state)
+        {
+          rules[i].days &= ~DAY_BIT(day);
+        }
+        else
+        {
+          state = rules[i].action;
+        }
+      }
+    }
+  }
+
+  count = 0;
+  for (uint16_t i = 0; i < length; i++)
+  {
+    if (rules[i].days)
+    {
+      rules[count++] = rules[i];
+    }
+  }
+  return count;
+}
+
+bool calendarStateAt(const calendarRule *rules, uint16_t length, uint16_t minuteOfWeek, uint8_t *action)
+{
+  uint16_t day = minuteOfWeek / MINUTES_PER_DAY;
+  int bound = upperBound(rules, length, minuteOfWeek % MINUTES_PER_DAY);
+
+  //Walk back in time: today up to now, the six previous days, then today one week ago
+  for (uint16_t back = 0; back <= 7; back++)
+  {
+    uint8_t bit = DAY_BIT(day + 7 - back);
+    int first = (back == 7) ? bound : 0;
+    int last = (back == 0) ? bound : length;
+
+    for (int i = last - 1; i >= first; i--)
+    {
+      if (rules[i].days & bit)
+      {
+        *action = rules[i].action;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+uint16_t calendarMinutesToNext(const calendarRule *rules, uint16_t length, uint16_t minuteOfWeek)
+{
+  uint16_t day = minuteOfWeek / MINUTES_PER_DAY;
+  uint16_t minuteOfDay = minuteOfWeek % MINUTES_PER_DAY;
+  int bound = upperBound(rules, length, minuteOfDay);
+
+  //Walk forward in time: rest of today, the six following days, then today next week
+  for (uint16_t ahead = 0; ahead <= 7; ahead++)
+  {
+    uint8_t bit = DAY_BIT(day + ahead);
+    int first = (ahead == 0) ? bound : 0;
+    int last = (ahead == 7) ? bound : length;
+
+    for (int i = first; i < last; i++)
+    {
+      if (rules[i].days & bit)
+      {
+        return ahead * MINUTES_PER_DAY + rules[i].minute - minuteOfDay;
+      }
+    }
+  }
+  return 0;
+}
+
+bool calendarTransitionBetween(const calendarRule *rules, uint16_t length, uint16_t fromMinute, uint16_t toMinute)
+{
+  uint16_t elapsed = (toMinute + MINUTES_PER_WEEK - fromMinute) % MINUTES_PER_WEEK;
+  uint16_t next = calendarMinutesToNext(rules, length, fromMinute);
+
+  return elapsed > 0 && next > 0 && next <= elapsed;
+}
@@ -0,0 +1,56 @@
+#ifndef CALENDAR_ENGINE_H
+#define CALENDAR_ENGINE_H
+
+#include <stdint.h>
+
+#define MINUTES_PER_DAY 1440
+#define MINUTES_PER_WEEK 10080
+#define CALENDAR_MAX_RULES 1024 //per actuator, larger calendars are rejected
+
+//Weekday masks, bit 0: Sunday ... bit 6: Saturday
+#define DAYS_ALL 0x7F
+#define DAYS_WEEKDAYS 0x3E
+#define DAYS_WEEKEND 0x41
+
+//One on/off rule, repeated on every day set in days.
+//4 bytes regardless of how many days it covers; kept in RAM and NVS as is.
+typedef struct
+{
+  uint16_t minute; //minute of day, 0..1439
+  uint8_t days;
+  uint8_t action;
+} calendarRule;
+
+//repeat, 0: Haftanın bir günü, 1: Her gün, 2:Hafta içi, 3:Hafta sonu. 0 for an invalid repeat.
+uint8_t calendarRepeatToDays(uint16_t repeat, uint16_t dayofweek);
+
+//Sorts rules by minute of day in linear time. Stable, rules of the same minute keep their order.
+void sort_calendar(calendarRule *rules, uint16_t length);
+
+//Drops invalid rules and sorts the rest by minute, in place. Returns the new length. This is the
+//calendar as uploaded, stored in NVS and the base of binary deltas (calendar_delta.h).
+uint16_t calendarNormalize(calendarRule *rules, uint16_t length);
+
+//Turns uploaded rules into the minimal equivalent calendar, in place. Returns the new length.
+// - calendarNormalize()
+// - rules at the same minute are merged, on each day the last uploaded one wins
+// - transitions to the state already in effect are dropped (e.g. "on" while on)
+//A calendar that never changes state keeps a single transition. Only a lookup table: a later delta
+//must apply to the uploaded rules, the dropped ones may matter again after it.
+uint16_t calendarCompile(calendarRule *rules, uint16_t length);
+
+//All lookups expect rules[] sorted by minute. Rules are expanded lazily, only the days around
+//minuteOfWeek are looked at. Of two rules at the same minute and day the later one wins.
+
+//Action in effect at minuteOfWeek (0 = Sunday 00:00). Before the first transition of the week the
+//last transition of the previous week is still in effect. Returns false if no rule has any day set.
+bool calendarStateAt(const calendarRule *rules, uint16_t length, uint16_t minuteOfWeek, uint8_t *action);
+
+//Minutes from minuteOfWeek to the next transition strictly after it, 1..MINUTES_PER_WEEK.
+//0 if there is none.
+uint16_t calendarMinutesToNext(const calendarRule *rules, uint16_t length, uint16_t minuteOfWeek);
+
+//True if a transition lies in (fromMinute, toMinute], wrapping over the end of the week
+bool calendarTransitionBetween(const calendarRule *rules, uint16_t length, uint16_t fromMinute, uint16_t toMinute);
+
+#endif
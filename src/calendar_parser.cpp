@@ -0,0 +1,259 @@
+#include "calendar_parser.h"
+#include <string.h>
+
+#define LEX_NONE 0
+#define LEX_STRING 1
+#define LEX_NUMBER 2
+#define LEX_LITERAL 3
+
+#define FIELD_DOFW 0
+#define FIELD_HOUR 1
+#define FIELD_MINUTE 2
+#define FIELD_REPEAT 3
+#define FIELD_ACTION 4
+#define FIELD_INVALID 0xFFFF
+
+static const char *const fieldKeys[] = {"dofw", "h", "m", "r", "a"};
+
+static char top(const calendarParser *parser)
+{
+  return parser->depth > 0 ? parser->stack[parser->depth - 1] : 0;
+}
+
+static bool inItem(const calendarParser *parser)
+{
+  return parser->calendarDepth > 0 && parser->depth == parser->calendarDepth + 1;
+}
+
+static void fail(calendarParser *parser)
+{
+  parser->result = CALENDAR_PARSE_ERROR;
+}
+
+//A scalar value of the current key is complete
+static void onNumber(calendarParser *parser)
+{
+  if (parser->depth == 1 && parser->numberValid && strcmp(parser->key, "version") == 0)
+  {
+    parser->version = (uint16_t)parser->number;
+    return;
+  }
+  if (!inItem(parser) || top(parser) != '{')
+  {
+    return;
+  }
+  for (uint8_t i = 0; i < 5; i++)
+  {
+    if (strcmp(parser->key, fieldKeys[i]) == 0)
+    {
+      parser->fields[i] = parser->numberValid ? (uint16_t)parser->number : FIELD_INVALID;
+    }
+  }
+}
+
+static void onItemEnd(calendarParser *parser)
+{
+  uint16_t *f = parser->fields;
+  uint8_t days = calendarRepeatToDays(f[FIELD_REPEAT], f[FIELD_DOFW]);
+
+  parser->items++;
+  if (days == 0 || f[FIELD_HOUR] >= 24 || f[FIELD_MINUTE] >= 60 || f[FIELD_ACTION] >= 2)
+  {
+    return;
+  }
+
+  calendarRule rule;
+  rule.minute = 60 * f[FIELD_HOUR] + f[FIELD_MINUTE];
+  rule.days = days;
+  rule.action = (uint8_t)f[FIELD_ACTION];
+  if (!parser->sink(&rule, parser->sinkArg))
+  {
+    fail(parser);
+    return;
+  }
+  parser->rules++;
+}
+
+static void push(calendarParser *parser, char container)
+{
+  if (parser->depth >= CALENDAR_PARSER_DEPTH)
+  {
+    fail(parser);
+    return;
+  }
+  if (container == '[' && parser->depth == 1 && strcmp(parser->key, "calendar") == 0)
+  {
+    parser->calendarDepth = 2;
+  }
+  if (container == '{' && parser->calendarDepth > 0 && parser->depth == parser->calendarDepth)
+  {
+    memset(parser->fields, 0, sizeof(parser->fields)); //Missing fields are 0
+  }
+  parser->stack[parser->depth++] = container;
+  parser->expectKey = (container == '{');
+}
+
+static void pop(calendarParser *parser, char container)
+{
+  if (top(parser) != (container == '}' ? '{' : '['))
+  {
+    fail(parser);
+    return;
+  }
+  if (container == '}' && inItem(parser))
+  {
+    onItemEnd(parser);
+  }
+  if (container == ']' && parser->depth == parser->calendarDepth)
+  {
+    parser->calendarDepth = 0; //Later "calendar" keys are not looked at
+  }
+  parser->depth--;
+  if (parser->depth == 0 && parser->result == CALENDAR_PARSE_BUSY)
+  {
+    parser->result = CALENDAR_PARSE_DONE;
+  }
+}
+
+static void feedStructural(calendarParser *parser, char c)
+{
+  switch (c)
+  {
+  case ' ':
+  case '\t':
+  case '\r':
+  case '\n':
+    break;
+  case '{':
+  case '[':
+    if (parser->depth == 0 && c != '{')
+    {
+      fail(parser);
+      break;
+    }
+    push(parser, c);
+    break;
+  case '}':
+  case ']':
+    pop(parser, c);
+    break;
+  case ',':
+    parser->expectKey = (top(parser) == '{');
+    break;
+  case ':':
+    parser->expectKey = false;
+    break;
+  case '"':
+    parser->lexState = LEX_STRING;
+    parser->stringIsKey = (top(parser) == '{' && parser->expectKey);
+    parser->escape = false;
+    if (parser->stringIsKey)
+    {
+      parser->keyLength = 0;
+      parser->key[0] = 0;
+    }
+    break;
+  default:
+    if (parser->depth == 0)
+    {
+      fail(parser);
+    }
+    else if (c == '-' || (c >= '0' && c <= '9'))
+    {
+      parser->lexState = LEX_NUMBER;
+      parser->number = (c == '-') ? 0 : c - '0';
+      parser->numberValid = (c != '-'); //Only non-negative integers are valid fields
+    }
+    else if (c >= 'a' && c <= 'z')
+    {
+      parser->lexState = LEX_LITERAL; //true, false, null
+    }
+    else
+    {
+      fail(parser);
+    }
+    break;
+  }
+}
+
+void calendarParserBegin(calendarParser *parser, calendarRuleSink sink, void *arg)
+{
+  memset(parser, 0, sizeof(*parser));
+  parser->lexState = LEX_NONE;
+  parser->result = CALENDAR_PARSE_BUSY;
+  parser->sink = sink;
+  parser->sinkArg = arg;
+}
+
+uint8_t calendarParserFeed(calendarParser *parser, const char *data, unsigned int length)
+{
+  for (unsigned int i = 0; i < length && parser->result == CALENDAR_PARSE_BUSY; i++)
+  {
+    char c = data[i];
+
+    switch (parser->lexState)
+    {
+    case LEX_STRING:
+      if (parser->escape)
+      {
+        parser->escape = false;
+      }
+      else if (c == '\\')
+      {
+        parser->escape = true;
+        parser->keyLength = CALENDAR_PARSER_KEY_LEN; //Escaped keys never match
+      }
+      else if (c == '"')
+      {
+        parser->lexState = LEX_NONE;
+        if (parser->stringIsKey)
+        {
+          parser->key[parser->keyLength < CALENDAR_PARSER_KEY_LEN ? parser->keyLength : 0] = 0;
+        }
+      }
+      else if (parser->stringIsKey && parser->keyLength < CALENDAR_PARSER_KEY_LEN - 1)
+      {
+        parser->key[parser->keyLength++] = c;
+      }
+      else if (parser->stringIsKey)
+      {
+        parser->keyLength = CALENDAR_PARSER_KEY_LEN; //Too long, never matches
+      }
+      continue;
+
+    case LEX_NUMBER:
+      if (c >= '0' && c <= '9')
+      {
+        parser->number = parser->number * 10 + (c - '0');
+        if (parser->number > 0xFFFF)
+        {
+          parser->numberValid = false;
+          parser->number = 0;
+        }
+        continue;
+      }
+      if (c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-')
+      {
+        parser->numberValid = false;
+        continue;
+      }
+      parser->lexState = LEX_NONE;
+      onNumber(parser);
+      break; //c is structural, handled below
+
+    case LEX_LITERAL:
+      if (c >= 'a' && c <= 'z')
+      {
+        continue;
+      }
+      parser->lexState = LEX_NONE;
+      break;
+
+    default:
+      break;
+    }
+
+    feedStructural(parser, c);
+  }
+  return parser->result;
+}
@@ -0,0 +1,47 @@
+#ifndef CALENDAR_PARSER_H
+#define CALENDAR_PARSER_H
+
+#include <stdint.h>
+#include "calendar_engine.h"
+
+//Results of calendarParserFeed()
+#define CALENDAR_PARSE_BUSY 0  //document not complete yet, feed the next chunk
+#define CALENDAR_PARSE_DONE 1  //top level object closed
+#define CALENDAR_PARSE_ERROR 2 //malformed JSON or the sink aborted
+
+#define CALENDAR_PARSER_DEPTH 8
+#define CALENDAR_PARSER_KEY_LEN 10
+
+//Called for every valid {dofw,h,m,r,a} item as soon as its object closes. Return false to abort.
+typedef bool (*calendarRuleSink)(const calendarRule *rule, void *arg);
+
+//SAX style parser for {"version":7,"calendar":[{"dofw":1,"h":22,"m":26,"r":0,"a":1},...]}, "version" is
+//optional.
+//Works byte by byte with a fixed size state, so a document may be split at any byte across
+//any number of chunks. Unknown keys and values of any type are skipped.
+typedef struct
+{
+  uint8_t lexState;
+  uint8_t depth;
+  char stack[CALENDAR_PARSER_DEPTH]; //'{' or '['
+  bool expectKey;
+  bool stringIsKey;
+  bool escape;
+  char key[CALENDAR_PARSER_KEY_LEN];
+  uint8_t keyLength;
+  uint32_t number;
+  bool numberValid;
+  uint8_t calendarDepth; //depth inside the "calendar" array, 0 until found
+  uint16_t fields[5];    //dofw, h, m, r, a
+  uint16_t items;        //items seen
+  uint16_t rules;        //items passed to the sink
+  uint16_t version;      //top level "version", 0 if none (yet)
+  uint8_t result;
+  calendarRuleSink sink;
+  void *sinkArg;
+} calendarParser;
+
+void calendarParserBegin(calendarParser *parser, calendarRuleSink sink, void *arg);
+uint8_t calendarParserFeed(calendarParser *parser, const char *data, unsigned int length);
+
+#endif
@@ -0,0 +1,415 @@
+#include "calendar_store.h"
+#include "crc32.h"
+#include "hal.h"
+#include "logger.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CALENDAR_STORE_PAGES ((CALENDAR_MAX_RULES + CALENDAR_PAGE_RULES - 1) / CALENDAR_PAGE_RULES)
+
+static_assert(sizeof(calendarStoreHeader) == 32, "stored as is");
+static_assert(CALENDAR_STORE_PAGES <= 64, "one slot bit per page");
+
+static void headerKey(char *key, const char *name, uint8_t index)
+{
+  snprintf(key, 16, "%sH%u", name, index);
+}
+
+static void pageKey(char *key, const char *name, uint16_t page, uint8_t slot)
+{
+  snprintf(key, 16, "%sP%u%c", name, page, slot ? 'b' : 'a');
+}
+
+static uint16_t pageCount(uint16_t length)
+{
+  return (length + CALENDAR_PAGE_RULES - 1) / CALENDAR_PAGE_RULES;
+}
+
+//Rules on page of a calendar of length rules, 0 past the end
+static uint16_t pageLength(uint16_t length, uint16_t page)
+{
+  uint16_t first = page * CALENDAR_PAGE_RULES;
+
+  if (length <= first)
+  {
+    return 0;
+  }
+  return (length - first < CALENDAR_PAGE_RULES) ? length - first : CALENDAR_PAGE_RULES;
+}
+
+static uint8_t pageSlot(const calendarStoreHeader *header, uint16_t page)
+{
+  return (header->slots >> page) & 1;
+}
+
+static uint32_t headerCrc(const calendarStoreHeader *header)
+{
+  return crc32Update(0, header, offsetof(calendarStoreHeader, crc));
+}
+
+static bool readHeader(const char *name, uint8_t index, calendarStoreHeader *header)
+{
+  char key[16];
+
+  headerKey(key, name, index);
+  return halNvsRead(key, header, sizeof(*header)) == sizeof(*header) && header->format == CALENDAR_STORE_FORMAT &&
+         header->length <= CALENDAR_MAX_RULES && header->crc == headerCrc(header);
+}
+
+//Valid headers, newest first. Returns how many there are.
+static uint8_t readHeaders(const char *name, calendarStoreHeader headers[2], uint8_t indexes[2])
+{
+  uint8_t count = 0;
+
+  for (uint8_t i = 0; i < 2; i++)
+  {
+    if (readHeader(name, i, &headers[count]))
+    {
+      indexes[count++] = i;
+    }
+  }
+  if (count == 2 && headers[1].sequence > headers[0].sequence)
+  {
+    calendarStoreHeader header = headers[0];
+    uint8_t index = indexes[0];
+    headers[0] = headers[1];
+    indexes[0] = indexes[1];
+    headers[1] = header;
+    indexes[1] = index;
+  }
+  return count;
+}
+
+//Reads the pages of header into a new allocation and checks them against rulesCrc
+static bool loadPages(const char *name, const calendarStoreHeader *header, calendarRule **rules)
+{
+  char key[16];
+  calendarRule *loaded;
+
+  *rules = NULL;
+  if (header->length == 0)
+  {
+    return header->rulesCrc == 0;
+  }
+  loaded = (calendarRule *)malloc(header->length * sizeof(calendarRule));
+  if (loaded == NULL)
+  {
+    return false;
+  }
+  for (uint16_t page = 0; page < pageCount(header->length); page++)
+  {
+    uint16_t first = page * CALENDAR_PAGE_RULES;
+    uint16_t count = pageLength(header->length, page);
+    pageKey(key, name, page, pageSlot(header, page));
+    if (halNvsRead(key, &loaded[first], count * sizeof(calendarRule)) != count * sizeof(calendarRule))
+    {
+      LOG_E("%s calendar page %d missing", name, page);
+      free(loaded);
+      return false;
+    }
+  }
+  if (crc32Update(0, loaded, header->length * sizeof(calendarRule)) != header->rulesCrc)
+  {
+    LOG_E("%s calendar rules fail their CRC", name);
+    free(loaded);
+    return false;
+  }
+  *rules = loaded;
+  return true;
+}
+
+//The header calendarStoreLoad restores, the newest one with intact pages. Returns -1 if none is.
+static int8_t loadedHeader(const char *name, const calendarStoreHeader headers[2], uint8_t count)
+{
+  calendarRule *rules;
+
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (loadPages(name, &headers[i], &rules))
+    {
+      free(rules);
+      return i;
+    }
+  }
+  return -1;
+}
+
+//Paged format without slots and CRCs: "<name>Hdr" {uint16 version, uint16 length}, "<name>P<n>"
+static bool loadPaged(const char *name, calendarRule **rules, uint16_t *length, uint16_t *version)
+{
+  struct
+  {
+    uint16_t version;
+    uint16_t length;
+  } header;
+  char key[16];
+  calendarRule *loaded = NULL;
+
+  snprintf(key, sizeof(key), "%sHdr", name);
+  if (halNvsRead(key, &header, sizeof(header)) != sizeof(header))
+  {
+    return false;
+  }
+  halNvsRemove(key);
+  if (header.length > 0 && header.length <= CALENDAR_MAX_RULES)
+  {
+    loaded = (calendarRule *)malloc(header.length * sizeof(calendarRule));
+  }
+  for (uint16_t page = 0; page < pageCount(header.length) && page < CALENDAR_STORE_PAGES; page++)
+  {
+    uint16_t count = pageLength(header.length, page);
+    snprintf(key, sizeof(key), "%sP%u", name, page);
+    if (loaded != NULL &&
+        halNvsRead(key, &loaded[page * CALENDAR_PAGE_RULES], count * sizeof(calendarRule)) != count * sizeof(calendarRule))
+    {
+      free(loaded);
+      loaded = NULL;
+    }
+    halNvsRemove(key);
+  }
+  *rules = loaded;
+  *length = (loaded != NULL) ? header.length : 0;
+  *version = (loaded != NULL) ? header.version : 0;
+  LOG_I("%s calendar v%u converted from the paged format, %d rules", name, *version, *length);
+  return true;
+}
+
+//"<name>Rules" blob of the first rule based firmware, or v1.0 expanded {dayofmin, action} entries
+//under "<name>" and "<name>Length". Converted rules are compiled.
+static bool loadLegacy(const char *name, calendarRule **rules, uint16_t *length)
+{
+  typedef struct
+  {
+    uint16_t dayofmin;
+    uint16_t action;
+  } legacyEntry;
+
+  char key[16], lengthKey[16];
+  calendarRule *loaded;
+  uint16_t count = 0;
+
+  snprintf(key, sizeof(key), "%sRules", name);
+  size_t size = halNvsLength(key);
+  if (size >= sizeof(calendarRule) && size <= CALENDAR_MAX_RULES * sizeof(calendarRule))
+  {
+    loaded = (calendarRule *)malloc(size);
+    if (loaded == NULL)
+    {
+      return false;
+    }
+    *rules = loaded;
+    *length = halNvsRead(key, loaded, size) / sizeof(calendarRule);
+    halNvsRemove(key);
+    return true;
+  }
+
+  snprintf(lengthKey, sizeof(lengthKey), "%sLength", name);
+  uint16_t legacyLength = halNvsReadU16(lengthKey, 0);
+  if (legacyLength == 0 || legacyLength > CALENDAR_MAX_RULES)
+  {
+    return false;
+  }
+
+  //Same 4 byte size, converted in place
+  static_assert(sizeof(legacyEntry) == sizeof(calendarRule), "in place conversion");
+  loaded = (calendarRule *)malloc(legacyLength * sizeof(calendarRule));
+  if (loaded == NULL)
+  {
+    return false;
+  }
+  halNvsRead(name, loaded, legacyLength * sizeof(legacyEntry));
+  for (uint16_t i = 0; i < legacyLength; i++)
+  {
+    legacyEntry entry;
+    memcpy(&entry, &loaded[i], sizeof(entry));
+    if (entry.dayofmin < MINUTES_PER_WEEK && entry.action < 2)
+    {
+      loaded[count].minute = entry.dayofmin % MINUTES_PER_DAY;
+      loaded[count].days = 1 << (entry.dayofmin / MINUTES_PER_DAY);
+      loaded[count].action = entry.action;
+      count++;
+    }
+  }
+  count = calendarNormalize(loaded, count);
+  if (count == 0)
+  {
+    free(loaded);
+    loaded = NULL;
+  }
+  halNvsRemove(name);
+  halNvsRemove(lengthKey);
+  LOG_I("%s calendar converted from v1.0, %d rules", name, count);
+
+  *rules = loaded;
+  *length = count;
+  return true;
+}
+
+void calendarStoreLoad(const char *name, calendarRule **rules, uint16_t *length, uint16_t *version, uint8_t *flags)
+{
+  calendarStoreHeader headers[2];
+  uint8_t indexes[2];
+  uint8_t count = readHeaders(name, headers, indexes);
+
+  *rules = NULL;
+  *length = 0;
+  *version = 0;
+  *flags = 0;
+
+  for (uint8_t i = 0; i < count; i++)
+  {
+    if (loadPages(name, &headers[i], rules))
+    {
+      if (i > 0)
+      {
+        LOG_W("%s calendar restored from the previous save", name);
+      }
+      *length = headers[i].length;
+      *version = headers[i].version;
+      *flags = headers[i].flags;
+      return;
+    }
+  }
+  if (count > 0)
+  {
+    LOG_E("%s calendar lost, no valid copy", name);
+    return; //Version 0 makes the backend send it again
+  }
+
+  if (loadPaged(name, rules, length, version) || loadLegacy(name, rules, length))
+  {
+    calendarStoreSave(name, *version, 0, *rules, *length, NULL, 0);
+  }
+}
+
+bool calendarStoreSave(const char *name, uint16_t version, uint8_t flags, const calendarRule *rules, uint16_t length,
+                       const calendarRule *oldRules, uint16_t oldLength)
+{
+  char key[16];
+  calendarStoreHeader headers[2], header;
+  uint8_t indexes[2];
+  uint8_t count = readHeaders(name, headers, indexes);
+  int8_t loaded = loadedHeader(name, headers, count);
+  //A newer header with broken pages is overwritten, never the copy that loads
+  const calendarStoreHeader *current = (loaded >= 0) ? &headers[loaded] : NULL;
+  uint16_t currentPages = (current != NULL) ? pageCount(current->length) : 0;
+  uint16_t written = 0;
+
+  //Pages are only compared against what is really stored
+  bool diff = current != NULL && oldLength == current->length &&
+              (oldLength == 0 || crc32Update(0, oldRules, oldLength * sizeof(calendarRule)) == current->rulesCrc);
+
+  memset(&header, 0, sizeof(header));
+  header.sequence = (count > 0) ? headers[0].sequence + 1 : 1;
+  header.slots = (current != NULL) ? current->slots : 0;
+  header.rulesCrc = crc32Update(0, rules, length * sizeof(calendarRule));
+  header.version = version;
+  header.length = length;
+  header.format = CALENDAR_STORE_FORMAT;
+  header.flags = flags;
+
+  //New pages go into the slots the current header does not use
+  for (uint16_t page = 0; page < pageCount(length); page++)
+  {
+    uint16_t first = page * CALENDAR_PAGE_RULES;
+    uint16_t pageRules = pageLength(length, page);
+
+    if (diff && pageRules == pageLength(oldLength, page) &&
+        memcmp(&rules[first], &oldRules[first], pageRules * sizeof(calendarRule)) == 0)
+    {
+      continue; //Unchanged page
+    }
+    uint8_t slot = (page < currentPages) ? !pageSlot(current, page) : 0;
+    pageKey(key, name, page, slot);
+    if (halNvsWrite(key, &rules[first], pageRules * sizeof(calendarRule)) != pageRules * sizeof(calendarRule))
+    {
+      LOG_E("%s calendar not saved, NVS write failed", name);
+      return false;
+    }
+    header.slots = (header.slots & ~(1ULL << page)) | ((uint64_t)slot << page);
+    written++;
+  }
+
+  //Commit, the current header stays as the fallback
+  header.crc = headerCrc(&header);
+  headerKey(key, name, (current != NULL) ? !indexes[loaded] : 0);
+  if (halNvsWrite(key, &header, sizeof(header)) != sizeof(header))
+  {
+    LOG_E("%s calendar not saved, NVS write failed", name);
+    return false;
+  }
+
+  //Drop page slots neither the new nor the fallback header refers to
+  for (uint16_t page = 0; page < CALENDAR_STORE_PAGES; page++)
+  {
+    bool usedNew = page < pageCount(length);
+    bool usedCurrent = page < currentPages;
+    bool found = false;
+
+    for (uint8_t slot = 0; slot < 2; slot++)
+    {
+      if ((usedNew && pageSlot(&header, page) == slot) || (usedCurrent && pageSlot(current, page) == slot))
+      {
+        continue;
+      }
+      pageKey(key, name, page, slot);
+      if (halNvsLength(key) > 0)
+      {
+        halNvsRemove(key);
+        found = true;
+      }
+    }
+    if (!usedNew && !usedCurrent && !found)
+    {
+      break; //Pages are stored from 0 up
+    }
+  }
+
+  LOG_I("%s calendar v%u saved, %u of %u pages written", name, version, written, pageCount(length));
+  return true;
+}
+
+void calendarStoreRemove(const char *name)
+{
+  char key[16];
+
+  for (uint8_t index = 0; index < 2; index++)
+  {
+    headerKey(key, name, index);
+    halNvsRemove(key);
+  }
+  for (uint16_t page = 0; page < CALENDAR_STORE_PAGES; page++)
+  {
+    bool found = false;
+
+    for (uint8_t slot = 0; slot < 3; slot++)
+    {
+      if (slot < 2)
+      {
+        pageKey(key, name, page, slot);
+      }
+      else
+      {
+        snprintf(key, sizeof(key), "%sP%u", name, page); //paged format
+      }
+      if (halNvsLength(key) > 0)
+      {
+        halNvsRemove(key);
+        found = true;
+      }
+    }
+    if (!found)
+    {
+      break; //Pages are stored from 0 up
+    }
+  }
+  snprintf(key, sizeof(key), "%sHdr", name);
+  halNvsRemove(key);
+  snprintf(key, sizeof(key), "%sRules", name);
+  halNvsRemove(key);
+  snprintf(key, sizeof(key), "%sLength", name);
+  halNvsRemove(key);
+  halNvsRemove(name);
+}
@@ -0,0 +1,47 @@
+#ifndef CALENDAR_STORE_H
+#define CALENDAR_STORE_H
+
+#include <stdint.h>
+#include "calendar_engine.h"
+
+//A calendar is kept in NVS as two alternating headers and two slots for every page of rules:
+//  "<name>H0", "<name>H1"        calendarStoreHeader, the valid one with the higher sequence is current
+//  "<name>P<n>a", "<name>P<n>b"  rules n*CALENDAR_PAGE_RULES ... (n+1)*CALENDAR_PAGE_RULES-1, the
+//                                header tells which slot holds the page
+//A save writes the changed pages into the slots the current header does not use, then the older
+//header. Nothing the current calendar needs is touched before that last write, so a power loss at
+//any point leaves the old or the new calendar loadable. A header that fails its CRC, or whose rules
+//fail rulesCrc, falls back to the other one.
+#define CALENDAR_PAGE_RULES 16
+#define CALENDAR_STORE_FORMAT 2
+
+#define CALENDAR_STORE_OVERRIDE 0x01 //installed from the device topic, see controllerAcceptsCalendar
+
+typedef struct
+{
+  uint32_t sequence; //save counter
+  uint64_t slots;    //bit n set: page n is in slot b
+  uint32_t rulesCrc; //CRC-32 of all rules
+  uint16_t version;  //calendar version of the backend
+  uint16_t length;   //rules
+  uint8_t format;    //CALENDAR_STORE_FORMAT
+  uint8_t flags;     //CALENDAR_STORE_OVERRIDE
+  uint8_t reserved[2];
+  uint32_t crc;      //CRC-32 of the header up to here
+} calendarStoreHeader;
+
+//Loads the calendar of name into a new allocation (*rules, NULL when empty). Older formats are
+//converted once, without flags. NVS must be open (halNvsOpen).
+void calendarStoreLoad(const char *name, calendarRule **rules, uint16_t *length, uint16_t *version, uint8_t *flags);
+
+//Writes the pages that differ from oldRules, then commits them with a new header. oldRules should be
+//what is stored now, otherwise every page is written. False if NVS refused a write, the stored
+//calendar is then still the previous one. NVS must be open.
+bool calendarStoreSave(const char *name, uint16_t version, uint8_t flags, const calendarRule *rules, uint16_t length,
+                       const calendarRule *oldRules, uint16_t oldLength);
+
+//Removes every key of the calendar of name, older formats included. The other keys of the namespace
+//are kept. NVS must be open.
+void calendarStoreRemove(const char *name);
+
+#endif
@@ -0,0 +1,69 @@
+#include "calendar_upload.h"
+#include "hal.h"
+#include "logger.h"
+#include <stdlib.h>
+
+//Parser sink, grows the upload buffer in CALENDAR_RULE_CHUNK steps
+static bool collectCalendarRule(const calendarRule *rule, void *arg)
+{
+  calendarUpload *upload = (calendarUpload *)arg;
+
+  if (upload->length >= CALENDAR_MAX_RULES)
+  {
+    LOG_W("Calendar rejected, more than %d rules", CALENDAR_MAX_RULES);
+    return false;
+  }
+  if (upload->length == upload->capacity)
+  {
+    calendarRule *grown = (calendarRule *)realloc(upload->rules, (upload->capacity + CALENDAR_RULE_CHUNK) * sizeof(calendarRule));
+    if (grown == NULL)
+    {
+      LOG_E("Calendar rejected, out of memory");
+      return false;
+    }
+    upload->rules = grown;
+    upload->capacity += CALENDAR_RULE_CHUNK;
+  }
+  upload->rules[upload->length++] = *rule;
+  LOG_T(" =>Index:%d, Minute:%d, Days:%02X, action:%d", upload->length - 1, rule->minute, rule->days, rule->action);
+  return true;
+}
+
+void calendarUploadBegin(calendarUpload *upload)
+{
+  calendarParserBegin(&upload->parser, collectCalendarRule, upload);
+  upload->rules = NULL;
+  upload->length = 0;
+  upload->capacity = 0;
+}
+
+uint8_t calendarUploadFeed(calendarUpload *upload, const char *input, unsigned int inputLength)
+{
+  uint8_t result = calendarParserFeed(&upload->parser, input, inputLength);
+
+  if (result == CALENDAR_PARSE_DONE)
+  {
+    uint16_t parsed = upload->length;
+    upload->length = calendarNormalize(upload->rules, upload->length);
+    LOG_I("Calendar parsed, %d items -> %d rules", parsed, upload->length);
+#if LOG_LEVEL >= LOG_LEVEL_TRACE
+    for (uint16_t i = 0; i < upload->length; i++)
+    {
+      LOG_T(" ==>Index:%d, Minute:%d, Days:%02X, action:%d", i, upload->rules[i].minute, upload->rules[i].days, upload->rules[i].action);
+    }
+#endif
+  }
+  else if (result == CALENDAR_PARSE_ERROR)
+  {
+    LOG_W("Calendar parse failed after %d items", upload->parser.items);
+  }
+  return result;
+}
+
+void calendarUploadAbort(calendarUpload *upload)
+{
+  free(upload->rules);
+  upload->rules = NULL;
+  upload->length = 0;
+  upload->capacity = 0;
+}
@@ -0,0 +1,32 @@
+#ifndef CALENDAR_UPLOAD_H
+#define CALENDAR_UPLOAD_H
+
+#include <stdint.h>
+#include "calendar_engine.h"
+#include "calendar_parser.h"
+
+#define CALENDAR_RULE_CHUNK 32 //upload buffer grows by this many rules
+
+//Calendar upload in progress, may span several MQTT messages
+typedef struct
+{
+  calendarParser parser;
+  calendarRule *rules;
+  uint16_t length;
+  uint16_t capacity;
+  unsigned long lastChunk;
+  uint8_t source; //set by the caller, e.g. device or group topic
+} calendarUpload;
+
+void calendarUploadBegin(calendarUpload *upload);
+
+//Streams one chunk of a calendar document into upload->rules. Each item becomes one rule as soon as
+//its object closes, a repeat is kept as a weekday mask instead of being expanded. Working memory is
+//the fixed size parser state, whatever the document size. The rules are normalized once the document
+//is complete (calendarNormalize). Returns CALENDAR_PARSE_*.
+uint8_t calendarUploadFeed(calendarUpload *upload, const char *input, unsigned int inputLength);
+
+//Frees the rules collected so far
+void calendarUploadAbort(calendarUpload *upload);
+
+#endif
@@ -0,0 +1,322 @@
+#include "controller.h"
+#include "calendar_store.h"
+#include "hal.h"
+#include "logger.h"
+#include "diag.h"
+#include <stdlib.h>
+#include <string.h>
+
+static calendarInfo actuators[ACTUATOR_COUNT]; //type order
+static controllerStatusCallback statusCallback;
+
+static void publishStatus(calendarInfo *itemInfo)
+{
+  statusCallback(itemInfo->type, itemInfo->status);
+}
+
+static bool openWaterPump(calendarInfo *itemInfo)
+{
+  if (!halPumpOpen(itemInfo->actionPin))
+  {
+    LOG_W("  Low water alarm. Not starting %s", actuatorName(itemInfo->type));
+    itemInfo->status = 0;
+    return false;
+  }
+  LOG_I("%s pump on", actuatorName(itemInfo->type));
+  itemInfo->status = 1;
+  return true;
+}
+
+static void setActuator(calendarInfo *itemInfo, uint8_t action)
+{
+  bool pump = actuatorIsPump(itemInfo->type);
+
+  if (pump && action == 1)
+  {
+    //Sulama komutu geldi ve yeterli su var ise
+    if (!openWaterPump(itemInfo))
+    {
+      statusCallback(WATERLEVEL, 0);
+    }
+  }
+  else if (pump)
+  {
+    halPumpClose(itemInfo->actionPin);
+    itemInfo->status = 0;
+  }
+  else
+  {
+    halPinWrite(itemInfo->actionPin, (action > 0) ? 0 : 1); //LOW: Open, HIGH:Close
+    itemInfo->status = (action > 0) ? 1 : 0;
+  }
+  publishStatus(itemInfo);
+}
+
+//ms since the minute of the latest transition at or before minuteOfWeek, looked back at most an hour
+static uint32_t transitionAge(calendarInfo *itemInfo, uint16_t minuteOfWeek, uint64_t nowMs)
+{
+  uint16_t back = 0;
+  uint16_t minute = minuteOfWeek;
+  uint16_t previous = (minute + MINUTES_PER_WEEK - 1) % MINUTES_PER_WEEK;
+
+  while (back < 60 && !calendarTransitionBetween(itemInfo->rules, itemInfo->length, previous, minute))
+  {
+    back++;
+    minute = previous;
+    previous = (minute + MINUTES_PER_WEEK - 1) % MINUTES_PER_WEEK;
+  }
+  return back * 60000UL + (uint32_t)(nowMs % 60000);
+}
+
+//Applies the calendar state if a transition fell between the last evaluation and minuteOfWeek, or if forced.
+//Returns the minutes until the next transition, 0 for an empty calendar.
+static uint32_t calendarPerformAction(calendarInfo *itemInfo, uint16_t minuteOfWeek, uint64_t nowMs, bool force)
+{
+  uint8_t action;
+  bool due = force || calendarTransitionBetween(itemInfo->rules, itemInfo->length, itemInfo->lastMinute, minuteOfWeek);
+
+  itemInfo->lastMinute = minuteOfWeek;
+  if (due && calendarStateAt(itemInfo->rules, itemInfo->length, minuteOfWeek, &action) && action != itemInfo->status)
+  {
+    setActuator(itemInfo, action);
+    LOG_I("  *Action performed. %s, Action:%d, Pin:%d", actuatorName(itemInfo->type), action, itemInfo->actionPin);
+    if (!force)
+    {
+      //Forced evaluations catch up after boot or a clock step, they are late by design
+      uint32_t age = transitionAge(itemInfo, minuteOfWeek, nowMs);
+      if (age > CALENDAR_TIMER_GUARD + 1000)
+      {
+        diagCalendarLate(age / 1000);
+      }
+    }
+  }
+  return calendarMinutesToNext(itemInfo->rules, itemInfo->length, minuteOfWeek);
+}
+
+uint16_t minuteOfWeek(uint32_t unixtime)
+{
+  //1970-01-01 was a Thursday
+  return ((unixtime / 86400 + 4) % 7) * MINUTES_PER_DAY + (unixtime % 86400) / 60;
+}
+
+//Lookup table of source, source itself if there is no memory for a copy (the lookups work on any
+//normalized rules, just slower)
+static calendarRule *compileRules(calendarRule *source, uint16_t sourceLength, uint16_t *length)
+{
+  calendarRule *rules = (sourceLength > 0) ? (calendarRule *)malloc(sourceLength * sizeof(calendarRule)) : NULL;
+
+  if (rules == NULL)
+  {
+    *length = sourceLength;
+    return source;
+  }
+  memcpy(rules, source, sourceLength * sizeof(calendarRule));
+  *length = calendarCompile(rules, sourceLength);
+  return rules;
+}
+
+static void freeRules(calendarRule *rules, calendarRule *source)
+{
+  if (rules != source)
+  {
+    free(rules);
+  }
+  free(source);
+}
+
+void controllerBegin(controllerStatusCallback onStatus)
+{
+  uint8_t flags;
+
+  statusCallback = onStatus;
+
+  halNvsOpen();
+  LOG_D("=== Read stored calendar values ===");
+  for (uint8_t i = 0; i < ACTUATOR_COUNT; i++)
+  {
+    calendarInfo *itemInfo = &actuators[i];
+    itemInfo->type = i + 1;
+    itemInfo->actionPin = actuatorTable[i].pin;
+    itemInfo->version = 0;
+    itemInfo->lastMinute = 0;
+    itemInfo->status = 0;
+    calendarStoreLoad(actuatorName(itemInfo->type), &itemInfo->source, &itemInfo->sourceLength, &itemInfo->version,
+                      &flags);
+    itemInfo->deviceOverride = (flags & CALENDAR_STORE_OVERRIDE) != 0;
+    itemInfo->rules = compileRules(itemInfo->source, itemInfo->sourceLength, &itemInfo->length);
+
+    LOG_I(" =>%s calendar v%u%s, %d rules, %d transitions ===", actuatorName(itemInfo->type), itemInfo->version,
+          itemInfo->deviceOverride ? " (device)" : "", itemInfo->sourceLength, itemInfo->length);
+#if LOG_LEVEL >= LOG_LEVEL_TRACE
+    for (int r = 0; r < itemInfo->length; r++)
+    {
+      LOG_T("  %d, %02X, %d", itemInfo->rules[r].minute, itemInfo->rules[r].days, itemInfo->rules[r].action);
+    }
+#endif
+  }
+  halNvsClose();
+}
+
+uint32_t controllerEvaluate(uint8_t forceType, uint64_t nowMs)
+{
+  uint16_t mOfWeek = minuteOfWeek((uint32_t)(nowMs / 1000));
+  uint32_t waitMs = CALENDAR_MAX_WAIT;
+
+  LOG_D("#=== TAKVIM KONTROLLERI ====");
+  LOG_D("minuteOfWeek: %d", mOfWeek);
+
+  halLock();
+  for (calendarInfo &item : actuators)
+  {
+    calendarInfo *itemInfo = &item;
+    bool force = (forceType == CALENDAR_ALL || forceType == itemInfo->type);
+    uint32_t minutes = calendarPerformAction(itemInfo, mOfWeek, nowMs, force);
+    if (minutes > 0)
+    {
+      uint32_t ms = minutes * 60000UL - (uint32_t)(nowMs % 60000) + CALENDAR_TIMER_GUARD;
+      if (ms < waitMs)
+      {
+        waitMs = ms;
+      }
+    }
+  }
+  halUnlock();
+
+  LOG_D("Next calendar check in %lu s", (unsigned long)(waitMs / 1000));
+  return waitMs;
+}
+
+void controllerSetActuator(uint8_t type, uint8_t action)
+{
+  calendarInfo *itemInfo = controllerCalendar(type);
+
+  if (itemInfo != NULL)
+  {
+    setActuator(itemInfo, action);
+  }
+}
+
+void controllerWaterLevel(bool lowWater)
+{
+  for (calendarInfo &item : actuators)
+  {
+    if (lowWater && item.status && actuatorIsPump(item.type))
+    {
+      LOG_W("Low water alarm. %s closed", actuatorName(item.type));
+      item.status = 0;
+      publishStatus(&item);
+    }
+  }
+  statusCallback(WATERLEVEL, !lowWater);
+}
+
+void controllerPublishAll()
+{
+  for (calendarInfo &item : actuators)
+  {
+    publishStatus(&item);
+  }
+}
+
+void controllerSetCalendar(uint8_t type, calendarRule *rules, uint16_t length, uint16_t version, bool deviceOverride)
+{
+  calendarInfo *itemInfo = controllerCalendar(type);
+  calendarRule *oldRules = itemInfo->rules;
+  calendarRule *oldSource = itemInfo->source;
+  uint16_t compiledLength;
+
+  //Only the pages that changed are written, the old rules are still what NVS holds.
+  //Only this task replaces rules, reading them without the lock is safe.
+  diagEnter(DIAG_LOOP_NETWORK);
+  halNvsOpen();
+  calendarStoreSave(actuatorName(type), version, deviceOverride ? CALENDAR_STORE_OVERRIDE : 0, rules, length, oldSource,
+                    itemInfo->sourceLength);
+  halNvsClose();
+  diagLeave(DIAG_LOOP_NETWORK, DIAG_CAUSE_NVS);
+  calendarRule *compiled = compileRules(rules, length, &compiledLength);
+
+  halLock();
+  itemInfo->rules = compiled;
+  itemInfo->length = compiledLength;
+  itemInfo->source = rules;
+  itemInfo->sourceLength = length;
+  itemInfo->version = version;
+  itemInfo->deviceOverride = deviceOverride;
+  halUnlock();
+  freeRules(oldRules, oldSource);
+}
+
+void controllerResetCalendars()
+{
+  calendarRule *rules, *source;
+
+  LOG_I("Reseting calendars:");
+  for (calendarInfo &item : actuators)
+  {
+    halLock();
+    rules = item.rules;
+    source = item.source;
+    item.rules = item.source = NULL;
+    item.length = item.sourceLength = 0;
+    item.version = 0;
+    item.deviceOverride = false;
+    halUnlock();
+    freeRules(rules, source);
+  }
+  diagEnter(DIAG_LOOP_NETWORK);
+  halNvsOpen();
+  for (calendarInfo &item : actuators)
+  {
+    calendarStoreRemove(actuatorName(item.type));
+  }
+  halNvsClose();
+  diagLeave(DIAG_LOOP_NETWORK, DIAG_CAUSE_NVS);
+}
+
+void controllerReleaseCalendars()
+{
+  diagEnter(DIAG_LOOP_NETWORK);
+  halNvsOpen();
+  for (calendarInfo &item : actuators)
+  {
+    if (item.deviceOverride)
+    {
+      //Same rules, only the header is written
+      calendarStoreSave(actuatorName(item.type), item.version, 0, item.source, item.sourceLength, item.source,
+                        item.sourceLength);
+      item.deviceOverride = false;
+      LOG_I("%s calendar released to the groups", actuatorName(item.type));
+    }
+  }
+  halNvsClose();
+  diagLeave(DIAG_LOOP_NETWORK, DIAG_CAUSE_NVS);
+}
+
+bool controllerAcceptsCalendar(uint8_t type, uint16_t version, bool fromGroup)
+{
+  calendarInfo *itemInfo = controllerCalendar(type);
+
+  return itemInfo != NULL && (!fromGroup || (!itemInfo->deviceOverride && version > itemInfo->version));
+}
+
+calendarInfo *controllerCalendar(uint8_t type)
+{
+  return (type >= 1 && type <= ACTUATOR_COUNT) ? &actuators[type - 1] : NULL;
+}
+
+const char *actuatorName(uint8_t type)
+{
+  return (type >= 1 && type <= ACTUATOR_COUNT) ? actuatorTable[type - 1].name : "";
+}
+
+uint8_t actuatorType(const char *name)
+{
+  for (uint8_t i = 0; i < ACTUATOR_COUNT; i++)
+  {
+    if (strcmp(actuatorTable[i].name, name) == 0)
+    {
+      return i + 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,71 @@
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#include <stdint.h>
+#include "calendar_engine.h"
+#include "actuators.h"
+
+#define WATERLEVEL 0 //status event type of the float switch, actuators report under their own type
+
+#define CALENDAR_ALL 0xFF
+#define CALENDAR_TIMER_GUARD 500 //ms after the minute starts, margin for the timer and clock corrections
+#define CALENDAR_MAX_WAIT 3600000 //ms, re-read the RTC at least once an hour
+
+typedef struct
+{
+  calendarRule *rules;  //lookup table compiled from source (calendarCompile), source itself without memory
+  calendarRule *source; //heap, as uploaded (calendarNormalize): stored in NVS, the base of deltas
+  uint16_t lastMinute;  //minute of week the calendar was last evaluated at
+  uint16_t length;
+  uint16_t sourceLength;
+  uint16_t version;    //set by the backend, 0 after an upload without one
+  bool deviceOverride; //installed from the device topic, kept in NVS with the calendar
+  uint8_t actionPin;
+  uint8_t type;
+  uint8_t status;
+} calendarInfo;
+
+//Actuator state changes and water level alarms (type WATERLEVEL, status 1: water ok)
+typedef void (*controllerStatusCallback)(uint8_t type, uint8_t status);
+
+//Everything but controllerSetCalendar/controllerResetCalendars belongs to one task (the control task).
+
+//One channel per row of actuatorTable. Loads the stored calendars.
+void controllerBegin(controllerStatusCallback onStatus);
+
+//Applies due transitions at nowMs (unix ms, timeNowMs()). forceType: actuator type whose current calendar
+//state is applied unconditionally, CALENDAR_ALL after boot and clock steps, 0 for none. Transitions missed
+//since the last call are caught up, only the latest state counts. Returns ms until the next call is due.
+uint32_t controllerEvaluate(uint8_t forceType, uint64_t nowMs);
+
+//action 1: open, 0: close
+void controllerSetActuator(uint8_t type, uint8_t action);
+
+//Float switch settled. On low water the pumps (ACTUATOR_PUMP) have already been cut by the interlock.
+//When the water is back, force each pump's calendar state again (controllerEvaluate): the interlock
+//may have refused it, also at boot before the first debounced sample.
+void controllerWaterLevel(bool lowWater);
+
+//Reports the state of every actuator
+void controllerPublishAll();
+
+//Network task. Swaps the normalized rules in (takes ownership), persists them and compiles the lookup
+//table. Re-evaluate afterwards. deviceOverride: the calendar came from the device topic.
+void controllerSetCalendar(uint8_t type, calendarRule *rules, uint16_t length, uint16_t version, bool deviceOverride);
+void controllerResetCalendars();
+
+//Network task. Group calendars apply again, the installed calendars stay.
+void controllerReleaseCalendars();
+
+//Network task. A calendar addressed to this device always applies and overrides the groups. One
+//published to a group only if no device calendar is installed and its version is newer than the
+//installed one, until controllerResetCalendars or controllerReleaseCalendars.
+bool controllerAcceptsCalendar(uint8_t type, uint16_t version, bool fromGroup);
+
+calendarInfo *controllerCalendar(uint8_t type); //NULL for an unknown type
+const char *actuatorName(uint8_t type);
+
+//Minute of week (0 = Sunday 00:00) of a unix time
+uint16_t minuteOfWeek(uint32_t unixtime);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//CRC-32 (IEEE 802.3, same as zlib). Start with 0, pass the previous result to continue over
+//several buffers.
+uint32_t crc32Update(uint32_t crc, const void *data, size_t length);
+
+#endif
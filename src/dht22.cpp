@@ -0,0 +1,127 @@
+#include "dht22.h"
+#include "logger.h"
+#include "driver/gpio.h"
+#include "freertos/ringbuf.h"
+
+#define DHT22_BIT_THRESHOLD 48 //us, a 0 bit is high for ~27 us, a 1 bit for ~70 us
+#define DHT22_IDLE_THRESHOLD 200 //us without an edge ends the frame
+#define DHT22_START_LOW 2 //ms, host start signal, at least 1 ms
+#define DHT22_TIMEOUT 20 //ms to wait for the frame
+
+static gpio_num_t dhtPin;
+static rmt_channel_t rxChannel;
+static RingbufHandle_t rxBuffer;
+static unsigned long lastTransaction;
+static float lastHumidity = NAN, lastTemperature = NAN;
+
+bool dht22Decode(const uint8_t frame[5], float *humidity, float *temperature)
+{
+  if ((uint8_t)(frame[0] + frame[1] + frame[2] + frame[3]) != frame[4])
+  {
+    return false;
+  }
+  *humidity = ((frame[0] << 8) | frame[1]) / 10.0f;
+  *temperature = (((frame[2] & 0x7F) << 8) | frame[3]) / 10.0f;
+  if (frame[2] & 0x80)
+  {
+    *temperature = -*temperature;
+  }
+  return true;
+}
+
+//The data bits are the last 40 high pulses of the capture, each one preceded by a ~50 us low.
+//Before them come the response (80 us low, 80 us high) and the host release.
+static bool decodeItems(const rmt_item32_t *items, size_t count, uint8_t frame[5])
+{
+  uint16_t highs[96];
+  int total = 0;
+
+  for (size_t i = 0; i < count; i++)
+  {
+    if (items[i].level0 && items[i].duration0 && total < 96)
+    {
+      highs[total++] = items[i].duration0;
+    }
+    if (items[i].level1 && items[i].duration1 && total < 96)
+    {
+      highs[total++] = items[i].duration1;
+    }
+  }
+  if (total < 41) //response + 40 bits
+  {
+    return false;
+  }
+
+  memset(frame, 0, 5);
+  for (int bit = 0; bit < 40; bit++)
+  {
+    if (highs[total - 40 + bit] > DHT22_BIT_THRESHOLD)
+    {
+      frame[bit / 8] |= 0x80 >> (bit % 8);
+    }
+  }
+  return true;
+}
+
+bool dht22Begin(uint8_t pin, rmt_channel_t channel)
+{
+  rmt_config_t config = RMT_DEFAULT_CONFIG_RX((gpio_num_t)pin, channel);
+
+  config.clk_div = 80; //1 us per tick
+  config.rx_config.filter_en = true;
+  config.rx_config.filter_ticks_thresh = 200; //APB cycles, ignores glitches below 2.5 us
+  config.rx_config.idle_threshold = DHT22_IDLE_THRESHOLD;
+  if (rmt_config(&config) != ESP_OK || rmt_driver_install(channel, 512, 0) != ESP_OK ||
+      rmt_get_ringbuf_handle(channel, &rxBuffer) != ESP_OK)
+  {
+    LOG_E("DHT22 RMT init failed");
+    return false;
+  }
+
+  //Open drain with pull-up, the RMT keeps reading the pin through the GPIO matrix
+  dhtPin = (gpio_num_t)pin;
+  rxChannel = channel;
+  gpio_set_pull_mode(dhtPin, GPIO_PULLUP_ONLY);
+  gpio_set_direction(dhtPin, GPIO_MODE_INPUT_OUTPUT_OD);
+  gpio_set_level(dhtPin, 1);
+  lastTransaction = millis() - DHT22_MIN_INTERVAL;
+  return true;
+}
+
+void dht22Read(dht22Reading *reading)
+{
+  uint8_t frame[5];
+  size_t size = 0;
+  bool ok = false;
+
+  reading->valid = false;
+  if (rxBuffer != NULL && millis() - lastTransaction >= DHT22_MIN_INTERVAL)
+  {
+    lastTransaction = millis();
+
+    gpio_set_level(dhtPin, 0);
+    vTaskDelay(pdMS_TO_TICKS(DHT22_START_LOW) + 1);
+    rmt_rx_start(rxChannel, true);
+    gpio_set_level(dhtPin, 1); //The sensor answers after 20-40 us
+
+    rmt_item32_t *items = (rmt_item32_t *)xRingbufferReceive(rxBuffer, &size, pdMS_TO_TICKS(DHT22_TIMEOUT));
+    rmt_rx_stop(rxChannel);
+    if (items != NULL)
+    {
+      ok = decodeItems(items, size / sizeof(rmt_item32_t), frame) && dht22Decode(frame, &reading->humidity, &reading->temperature);
+      vRingbufferReturnItem(rxBuffer, items);
+    }
+  }
+
+  if (ok)
+  {
+    lastHumidity = reading->humidity;
+    lastTemperature = reading->temperature;
+    reading->valid = true;
+  }
+  else
+  {
+    reading->humidity = lastHumidity;
+    reading->temperature = lastTemperature;
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef DHT22_H
+#define DHT22_H
+
+#include <Arduino.h>
+#include "driver/rmt.h"
+
+#define DHT22_MIN_INTERVAL 2000 //ms, the sensor needs this long between two transactions
+#define DHT22_RMT_CHANNEL RMT_CHANNEL_0
+
+typedef struct
+{
+  float humidity;    //%RH, NaN until the first good transaction
+  float temperature; //°C
+  bool valid;        //false: this transaction failed, the values are the last good ones
+} dht22Reading;
+
+//DHT22 on pin, the response is captured by the RMT receiver. Interrupts stay enabled, the caller
+//only blocks on the RMT ring buffer for the ~5 ms of the transaction.
+bool dht22Begin(uint8_t pin, rmt_channel_t channel);
+
+//One transaction, humidity and temperature come from the same frame. Keeps the last good values.
+void dht22Read(dht22Reading *reading);
+
+//5 byte frame -> values, false if the checksum does not match
+bool dht22Decode(const uint8_t frame[5], float *humidity, float *temperature);
+
+#endif
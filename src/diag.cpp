@@ -0,0 +1,192 @@
+#include "diag.h"
+#include "hal.h"
+#include "logger.h"
+#include <stdio.h>
+#include <string.h>
+
+//Stats are only written by the task that records them, which also clears them when it sees a new
+//interval. The network task only reads them and moves diagWindow, no lock is needed. A message may
+//mix values of two intervals if it races a writer, fine for diagnostics.
+typedef struct
+{
+  uint32_t window;
+  uint32_t count;
+  uint32_t maxUs;
+  uint32_t buckets[DIAG_BUCKETS];
+  uint32_t stallUs;
+  uint8_t stallCause;
+} diagLoopStats;
+
+typedef struct
+{
+  uint32_t window;
+  uint32_t count;
+  uint32_t maxSeconds;
+} diagLateStats;
+
+typedef struct
+{
+  uint32_t window;
+  uint32_t minFree;
+  uint32_t minLargest;
+} diagHeapStats;
+
+//Open sections of a loop, the time of nested sections is taken off their parent
+typedef struct
+{
+  uint32_t loopStart;
+  uint8_t depth;
+  uint32_t start[DIAG_MAX_NESTING];
+  uint32_t nestedUs[DIAG_MAX_NESTING];
+} diagStack;
+
+static const char *const loopNames[DIAG_LOOP_COUNT] = {"ctl", "sns", "net"};
+static const char *const causeNames[DIAG_CAUSE_COUNT] = {"", "wifi", "mqtt_link", "mqtt_in", "publish", "dht", "nvs", "calendar"};
+
+static volatile uint32_t diagWindow = 1; //0 is never current, zeroed stats start out stale
+static diagLoopStats loops[DIAG_LOOP_COUNT];
+static diagStack stacks[DIAG_LOOP_COUNT];
+static diagLateStats late;
+static diagHeapStats heap;
+
+//Clears stats of an older interval, window must be the first member
+static void enterWindow(uint32_t *window, size_t size)
+{
+  uint32_t current = diagWindow;
+
+  if (*window != current)
+  {
+    memset(window, 0, size);
+    *window = current;
+  }
+}
+
+static uint8_t bucketOf(uint32_t us)
+{
+  uint8_t bucket = 0;
+
+  for (uint32_t limit = 100; bucket < DIAG_BUCKETS - 1 && us >= limit; limit *= 10)
+  {
+    bucket++;
+  }
+  return bucket;
+}
+
+void diagLoopBegin(uint8_t loop)
+{
+  stacks[loop].loopStart = halMicros();
+  stacks[loop].depth = 0;
+}
+
+void diagLoopEnd(uint8_t loop)
+{
+  diagLoopStats *stats = &loops[loop];
+  uint32_t us = halMicros() - stacks[loop].loopStart;
+
+  enterWindow(&stats->window, sizeof(*stats));
+  stats->count++;
+  stats->buckets[bucketOf(us)]++;
+  stats->maxUs = (us > stats->maxUs) ? us : stats->maxUs;
+}
+
+void diagEnter(uint8_t loop)
+{
+  diagStack *stack = &stacks[loop];
+
+  if (stack->depth < DIAG_MAX_NESTING)
+  {
+    stack->start[stack->depth] = halMicros();
+    stack->nestedUs[stack->depth] = 0;
+  }
+  stack->depth++;
+}
+
+void diagLeave(uint8_t loop, uint8_t cause)
+{
+  diagStack *stack = &stacks[loop];
+  diagLoopStats *stats = &loops[loop];
+
+  if (stack->depth == 0)
+  {
+    return;
+  }
+  stack->depth--;
+  if (stack->depth >= DIAG_MAX_NESTING)
+  {
+    return; //Too deep, charged to the parent
+  }
+  uint32_t us = halMicros() - stack->start[stack->depth];
+  uint32_t own = us - stack->nestedUs[stack->depth];
+  if (stack->depth > 0)
+  {
+    stack->nestedUs[stack->depth - 1] += us;
+  }
+
+  enterWindow(&stats->window, sizeof(*stats));
+  if (own > stats->stallUs)
+  {
+    stats->stallUs = own;
+    stats->stallCause = cause;
+  }
+}
+
+void diagCalendarLate(uint32_t seconds)
+{
+  enterWindow(&late.window, sizeof(late));
+  late.count++;
+  late.maxSeconds = (seconds > late.maxSeconds) ? seconds : late.maxSeconds;
+}
+
+void diagSampleHeap()
+{
+  uint32_t freeBytes = halHeapFree();
+  uint32_t largest = halHeapLargestBlock();
+
+  enterWindow(&heap.window, sizeof(heap));
+  heap.minFree = (heap.minFree == 0 || freeBytes < heap.minFree) ? freeBytes : heap.minFree;
+  heap.minLargest = (heap.minLargest == 0 || largest < heap.minLargest) ? largest : heap.minLargest;
+}
+
+//{"up":s,"heap":[free,minFree,largest,minLargest],"ctl":[n,maxUs,[histogram],stallUs,"cause"],...,
+// "mqtt":reconnects,"late":[count,maxSeconds],"logdrop":dropped}
+size_t diagFormat(char *payload, size_t size, uint32_t mqttReconnects)
+{
+  uint32_t current = diagWindow;
+  uint32_t freeBytes = halHeapFree();
+  uint32_t largest = halHeapLargestBlock();
+  bool heapCurrent = (heap.window == current);
+  size_t length;
+
+  length = snprintf(payload, size, "{\"up\":%lu,\"heap\":[%lu,%lu,%lu,%lu]", (unsigned long)(halMillis() / 1000),
+                    (unsigned long)freeBytes, (unsigned long)(heapCurrent && heap.minFree < freeBytes ? heap.minFree : freeBytes),
+                    (unsigned long)largest, (unsigned long)(heapCurrent && heap.minLargest < largest ? heap.minLargest : largest));
+  for (uint8_t i = 0; i < DIAG_LOOP_COUNT && length < size; i++)
+  {
+    diagLoopStats stats = loops[i];
+    if (stats.window != current)
+    {
+      memset(&stats, 0, sizeof(stats)); //Idle for the whole interval
+    }
+    length += snprintf(payload + length, size - length, ",\"%s\":[%lu,%lu,[", loopNames[i], (unsigned long)stats.count,
+                       (unsigned long)stats.maxUs);
+    for (uint8_t b = 0; b < DIAG_BUCKETS && length < size; b++)
+    {
+      length += snprintf(payload + length, size - length, b ? ",%lu" : "%lu", (unsigned long)stats.buckets[b]);
+    }
+    if (length < size)
+    {
+      length += snprintf(payload + length, size - length, "],%lu,\"%s\"]", (unsigned long)stats.stallUs,
+                         causeNames[stats.stallCause < DIAG_CAUSE_COUNT ? stats.stallCause : 0]);
+    }
+  }
+  if (length < size)
+  {
+    bool lateCurrent = (late.window == current);
+    length += snprintf(payload + length, size - length, ",\"mqtt\":%lu,\"late\":[%lu,%lu],\"logdrop\":%lu}",
+                       (unsigned long)mqttReconnects, (unsigned long)(lateCurrent ? late.count : 0),
+                       (unsigned long)(lateCurrent ? late.maxSeconds : 0), (unsigned long)loggerDropped());
+  }
+
+  diagWindow = current + 1; //Each task clears its stats when it records next
+  return (length < size) ? length : size - 1;
+}
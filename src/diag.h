@@ -0,0 +1,51 @@
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Runtime metrics, published as one compact JSON message on monitor/diag every DIAG_INTERVAL.
+//Cheap enough to stay on: a section costs two halMicros() calls and a few compares.
+
+#define DIAG_INTERVAL 300000 //ms
+
+//Loops, each one is recorded by its own task only
+#define DIAG_LOOP_CONTROL 0
+#define DIAG_LOOP_SENSOR 1
+#define DIAG_LOOP_NETWORK 2
+#define DIAG_LOOP_COUNT 3
+
+//Stall causes, sections inside a loop iteration
+#define DIAG_CAUSE_NONE 0
+#define DIAG_CAUSE_WIFI 1      //WiFiManager, WiFi reconnect
+#define DIAG_CAUSE_MQTT_LINK 2 //mqttLinkProcess: connecting, receiving, sending the outbox
+#define DIAG_CAUSE_MQTT_IN 3   //handlers of incoming messages
+#define DIAG_CAUSE_PUBLISH 4
+#define DIAG_CAUSE_DHT 5
+#define DIAG_CAUSE_NVS 6
+#define DIAG_CAUSE_CALENDAR 7
+#define DIAG_CAUSE_COUNT 8
+
+//Loop iteration time histogram: <100us, <1ms, <10ms, <100ms, <1s, >=1s
+#define DIAG_BUCKETS 6
+#define DIAG_MAX_NESTING 4
+
+//Iteration of loop, excluding the time it sleeps waiting for work
+void diagLoopBegin(uint8_t loop);
+void diagLoopEnd(uint8_t loop);
+
+//Section of a loop iteration that may stall it. Sections nest, a section is charged its own time
+//only, so an NVS write inside a message handler is reported as NVS.
+void diagEnter(uint8_t loop);
+void diagLeave(uint8_t loop, uint8_t cause);
+
+//Control task. A calendar action ran seconds after the start of its minute.
+void diagCalendarLate(uint32_t seconds);
+
+//Sensor task. Tracks the lowest free heap and largest free block of the interval.
+void diagSampleHeap();
+
+//Network task. Formats the interval into payload and starts a new one. Returns the length.
+size_t diagFormat(char *payload, size_t size, uint32_t mqttReconnects);
+
+#endif
@@ -0,0 +1,168 @@
+#include "groups.h"
+#include "hal.h"
+#include "logger.h"
+#include <stdio.h>
+#include <string.h>
+
+#define GROUP_LIST_MAX (GROUPS_MAX * GROUP_NAME_MAX) //names and commas
+#define GROUP_FILTER_MAX (sizeof(GROUP_TOPIC_PREFIX) + GROUP_NAME_MAX + sizeof("/control/#"))
+
+static char names[GROUPS_MAX][GROUP_NAME_MAX];
+static char filters[GROUPS_MAX][GROUP_FILTER_MAX];
+static uint8_t count;
+
+static bool validChar(char c)
+{
+  return c != '/' && c != '+' && c != '#' && c != ',' && c > ' ' && c < 0x7F;
+}
+
+//Splits list into parsed, returns the name count or -1 if the list is invalid
+static int parseList(const char *list, size_t length, char parsed[GROUPS_MAX][GROUP_NAME_MAX])
+{
+  int found = 0;
+  size_t start = 0;
+
+  if (length == 0)
+  {
+    return 0;
+  }
+  for (size_t i = 0; i <= length; i++)
+  {
+    if (i < length && list[i] != ',')
+    {
+      if (!validChar(list[i]) || i - start >= GROUP_NAME_MAX - 1)
+      {
+        return -1;
+      }
+      continue;
+    }
+    if (i == start || found == GROUPS_MAX)
+    {
+      return -1;
+    }
+    memcpy(parsed[found], list + start, i - start);
+    parsed[found][i - start] = '\0';
+    for (int j = 0; j < found; j++)
+    {
+      if (strcmp(parsed[j], parsed[found]) == 0)
+      {
+        return -1;
+      }
+    }
+    found++;
+    start = i + 1;
+  }
+  return found;
+}
+
+static void apply(char parsed[GROUPS_MAX][GROUP_NAME_MAX], uint8_t parsedCount)
+{
+  count = parsedCount;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    memcpy(names[i], parsed[i], GROUP_NAME_MAX);
+    snprintf(filters[i], sizeof(filters[i]), GROUP_TOPIC_PREFIX "%s/control/#", names[i]);
+  }
+}
+
+void groupsBegin()
+{
+  char list[GROUP_LIST_MAX];
+  char parsed[GROUPS_MAX][GROUP_NAME_MAX];
+
+  halNvsOpen();
+  size_t length = halNvsRead(GROUPS_NVS_KEY, list, sizeof(list));
+  halNvsClose();
+
+  int found = parseList(list, length, parsed);
+  if (found < 0)
+  {
+    LOG_W("Stored groups invalid, none joined");
+    found = 0;
+  }
+  apply(parsed, (uint8_t)found);
+  groupsFormat(list, sizeof(list));
+  LOG_I("Groups: %s", count ? list : "none");
+}
+
+static void save()
+{
+  char list[GROUP_LIST_MAX];
+  size_t length = groupsFormat(list, sizeof(list));
+
+  halNvsOpen();
+  if (length == 0)
+  {
+    halNvsRemove(GROUPS_NVS_KEY);
+  }
+  else
+  {
+    halNvsWrite(GROUPS_NVS_KEY, list, length);
+  }
+  halNvsClose();
+}
+
+bool groupsSet(const char *list, size_t length)
+{
+  char parsed[GROUPS_MAX][GROUP_NAME_MAX];
+  int found = parseList(list, length, parsed);
+
+  if (found < 0)
+  {
+    return false;
+  }
+  bool changed = (found != count);
+  for (int i = 0; i < found && !changed; i++)
+  {
+    changed = strcmp(parsed[i], names[i]) != 0;
+  }
+  if (changed)
+  {
+    apply(parsed, (uint8_t)found);
+    save();
+  }
+  return true;
+}
+
+uint8_t groupCount()
+{
+  return count;
+}
+
+const char *groupFilter(uint8_t index)
+{
+  return filters[index];
+}
+
+const char *groupTopicSuffix(const char *topic, uint8_t *index)
+{
+  static const size_t prefixLength = sizeof(GROUP_TOPIC_PREFIX) - 1;
+
+  if (count == 0 || strncmp(topic, GROUP_TOPIC_PREFIX, prefixLength) != 0)
+  {
+    return NULL;
+  }
+  topic += prefixLength;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    size_t nameLength = strlen(names[i]);
+    if (strncmp(topic, names[i], nameLength) == 0 && strncmp(topic + nameLength, "/control/", 9) == 0)
+    {
+      *index = i;
+      return topic + nameLength + 9;
+    }
+  }
+  return NULL;
+}
+
+size_t groupsFormat(char *buffer, size_t size)
+{
+  size_t length = 0;
+
+  buffer[0] = '\0';
+  for (uint8_t i = 0; i < count && length < size; i++)
+  {
+    length += snprintf(buffer + length, size - length, "%s%s", i ? "," : "", names[i]);
+  }
+  return length < size ? length : size - 1;
+}
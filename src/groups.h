@@ -0,0 +1,38 @@
+#ifndef GROUPS_H
+#define GROUPS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Group membership, e.g. site, wall and zone. A message published once on
+//doa/group/<name>/control/<suffix> reaches every member, the suffixes are the device control topics.
+//Messages to doa/<id>/control/ take precedence: a group calendar only replaces an older version, and
+//none while a device calendar is installed (controllerAcceptsCalendar). Kept in NVS under
+//GROUPS_NVS_KEY as the comma separated list.
+#define GROUPS_MAX 3
+#define GROUP_NAME_MAX 16 //with the terminator
+#define GROUPS_NVS_KEY "groups"
+#define GROUP_TOPIC_PREFIX "doa/group/"
+
+//Loads the groups from NVS
+void groupsBegin();
+
+//Replaces the groups with a comma separated list of names ("site1,wall3", "" for none) and saves it
+//if it changed.
+//Names are 1 to GROUP_NAME_MAX - 1 characters without '/', '+', '#' and ','. False if the list is
+//invalid, the groups are then unchanged.
+bool groupsSet(const char *list, size_t length);
+
+uint8_t groupCount();
+
+//doa/group/<name>/control/# of group index
+const char *groupFilter(uint8_t index);
+
+//Control topic suffix of a message published to one of the groups, NULL if topic is not a group
+//control topic of this device. *index is the group.
+const char *groupTopicSuffix(const char *topic, uint8_t *index);
+
+//Comma separated list, as given to groupsSet()
+size_t groupsFormat(char *buffer, size_t size);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Hardware used by the portable modules (controller, telemetry, calendar_store).
+//hal_esp32.cpp implements it on the board, native/hal_native.cpp in the simulator.
+
+//Before any other call. Sensor drivers are started by the firmware, see setup().
+void halBegin();
+
+//GPIO, level 0: LOW, 1: HIGH
+void halPinWrite(uint8_t pin, uint8_t level);
+
+//Clock. RTC time is unix seconds, millis a free running ms counter. The RTC is the time service's,
+//everything else reads timeNowMs() (time_service.h).
+uint32_t halRtcNow();
+void halRtcAdjust(uint32_t unixtime);
+uint32_t halMillis();
+uint32_t halMicros();
+int64_t halUptimeUs(); //since boot, does not wrap
+uint32_t halAwakeMs();  //since boot without light sleep, see power.h. From the sensor task only.
+
+//Sensors. halReadClimate returns false if this reading failed, the values are the last good ones.
+bool halReadClimate(float *humidity, float *temperature);
+uint32_t halReadSoilMoisture(uint8_t channel); //mV
+bool halWaterIsLow();
+
+//Relay of an ACTUATOR_PUMP row, with the low water interlock. halPumpOpen fails while the tank is empty.
+bool halPumpOpen(uint8_t pin);
+void halPumpClose(uint8_t pin);
+
+//Non volatile storage, keys up to 15 characters. Calls go between halNvsOpen and halNvsClose, which
+//hold the store for the calling task: any task may use it, but not nested.
+void halNvsOpen();
+void halNvsClose();
+size_t halNvsLength(const char *key); //0 if missing
+size_t halNvsRead(const char *key, void *data, size_t length);
+size_t halNvsWrite(const char *key, const void *data, size_t length);
+uint16_t halNvsReadU16(const char *key, uint16_t defaultValue);
+void halNvsRemove(const char *key);
+void halNvsClear();
+
+//Flat region of HISTORY_REGION_SIZE bytes for history_store.cpp, never written before reads 0.
+//False if the flash access failed.
+bool halHistoryRead(uint32_t offset, void *data, size_t length);
+bool halHistoryWrite(uint32_t offset, const void *data, size_t length);
+
+//Heap, 8 bit capable memory
+uint32_t halHeapFree();
+uint32_t halHeapLargestBlock();
+
+//MQTT monitor state, retained and QoS1. Queued while the link is down, a newer value replaces one still
+//waiting on the same topic (mqtt_outbox.h). topic must stay valid, false if the outbox is full.
+bool halMqttPublish(const char *topic, const char *payload);
+
+//Calendar data lock, shared by the control and network tasks
+void halLock();
+void halUnlock();
+
+#endif
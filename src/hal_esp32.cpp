@@ -0,0 +1,195 @@
+#include <Arduino.h>
+#include <Wire.h>
+#include <RTClib.h>
+#include <Preferences.h>
+#include <LittleFS.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include "hal.h"
+#include "dht22.h"
+#include "soil_sensor.h"
+#include "water_level.h"
+#include "mqtt_link.h"
+#include "power.h"
+#include "history_store.h"
+
+#define NVS_NAMESPACE "doa"
+#define HISTORY_FILE "/history"
+
+static RTC_DS1307 rtc;
+static Preferences preferences;
+static SemaphoreHandle_t calendarMutex; //calendar arrays and calendarInfo length/lastMinute
+static SemaphoreHandle_t nvsMutex;      //preferences is one handle for both tasks
+static File historyFile;                //open from halBegin() on, network task only
+
+void halBegin()
+{
+  calendarMutex = xSemaphoreCreateMutex();
+  nvsMutex = xSemaphoreCreateMutex();
+  Wire.begin();
+  rtc.begin();
+
+  //The default partition table's "spiffs" partition, formatted on first use
+  if (!LittleFS.begin(true))
+  {
+    return;
+  }
+  historyFile = LittleFS.open(HISTORY_FILE, LittleFS.exists(HISTORY_FILE) ? "r+" : "w+");
+  if (historyFile && historyFile.size() < HISTORY_REGION_SIZE)
+  {
+    historyFile.seek(HISTORY_REGION_SIZE - 1); //LittleFS fills the gap with zeros
+    historyFile.write((uint8_t)0);
+    historyFile.flush();
+  }
+}
+
+void halPinWrite(uint8_t pin, uint8_t level)
+{
+  digitalWrite(pin, level ? HIGH : LOW);
+}
+
+uint32_t halRtcNow()
+{
+  return rtc.now().unixtime();
+}
+
+void halRtcAdjust(uint32_t unixtime)
+{
+  rtc.adjust(DateTime(unixtime));
+}
+
+uint32_t halMillis()
+{
+  return millis();
+}
+
+int64_t halUptimeUs()
+{
+  return esp_timer_get_time();
+}
+
+uint32_t halAwakeMs()
+{
+#ifdef POWER_SAVE
+  return powerAwakeMs();
+#else
+  return millis(); //Never sleeps
+#endif
+}
+
+uint32_t halMicros()
+{
+  return micros();
+}
+
+bool halReadClimate(float *humidity, float *temperature)
+{
+  dht22Reading reading;
+
+  dht22Read(&reading);
+  *humidity = reading.humidity;
+  *temperature = reading.temperature;
+  return reading.valid;
+}
+
+uint32_t halReadSoilMoisture(uint8_t channel)
+{
+  return soilSensorRead(channel);
+}
+
+bool halWaterIsLow()
+{
+  return waterLevelIsLow();
+}
+
+bool halPumpOpen(uint8_t pin)
+{
+  return waterLevelOpenPump(pin);
+}
+
+void halPumpClose(uint8_t pin)
+{
+  waterLevelClosePump(pin);
+}
+
+void halNvsOpen()
+{
+  xSemaphoreTake(nvsMutex, portMAX_DELAY);
+  preferences.begin(NVS_NAMESPACE, false);
+}
+
+void halNvsClose()
+{
+  preferences.end();
+  xSemaphoreGive(nvsMutex);
+}
+
+size_t halNvsLength(const char *key)
+{
+  return preferences.getBytesLength(key);
+}
+
+size_t halNvsRead(const char *key, void *data, size_t length)
+{
+  return preferences.getBytes(key, data, length);
+}
+
+size_t halNvsWrite(const char *key, const void *data, size_t length)
+{
+  return preferences.putBytes(key, data, length);
+}
+
+uint16_t halNvsReadU16(const char *key, uint16_t defaultValue)
+{
+  return preferences.getUShort(key, defaultValue);
+}
+
+void halNvsRemove(const char *key)
+{
+  preferences.remove(key);
+}
+
+void halNvsClear()
+{
+  preferences.clear();
+}
+
+bool halHistoryRead(uint32_t offset, void *data, size_t length)
+{
+  return historyFile && historyFile.seek(offset) && historyFile.read((uint8_t *)data, length) == length;
+}
+
+bool halHistoryWrite(uint32_t offset, const void *data, size_t length)
+{
+  if (!historyFile || !historyFile.seek(offset) || historyFile.write((const uint8_t *)data, length) != length)
+  {
+    return false;
+  }
+  historyFile.flush();
+  return true;
+}
+
+uint32_t halHeapFree()
+{
+  return heap_caps_get_free_size(MALLOC_CAP_8BIT);
+}
+
+uint32_t halHeapLargestBlock()
+{
+  return heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+}
+
+bool halMqttPublish(const char *topic, const char *payload)
+{
+  return mqttLinkPublish(topic, payload, MQTT_QOS1 | MQTT_RETAIN);
+}
+
+void halLock()
+{
+  xSemaphoreTake(calendarMutex, portMAX_DELAY);
+}
+
+void halUnlock()
+{
+  xSemaphoreGive(calendarMutex);
+}
@@ -0,0 +1,380 @@
+#include "history_codec.h"
+#include "crc32.h"
+#include <string.h>
+
+#define HEADER_SIZE sizeof(historyBlockHeader)
+
+static uint8_t *data(historyCoder *coder)
+{
+  return coder->block + HEADER_SIZE;
+}
+
+//Past the end only the position moves, the caller restores the coder
+static void writeBits(historyCoder *coder, uint32_t value, uint8_t count)
+{
+  while (count > 0)
+  {
+    count--;
+    if (coder->bits < HISTORY_DATA_BITS)
+    {
+      uint8_t *byte = data(coder) + coder->bits / 8;
+      uint8_t mask = 0x80 >> (coder->bits % 8);
+      *byte = ((value >> count) & 1) ? (*byte | mask) : (*byte & ~mask);
+    }
+    coder->bits++;
+  }
+}
+
+//0 past the end of the data
+static uint32_t readBits(historyCoder *coder, uint8_t count)
+{
+  uint32_t value = 0;
+
+  while (count > 0)
+  {
+    count--;
+    uint32_t bit = 0;
+    if (coder->bits < HISTORY_DATA_BITS)
+    {
+      bit = (data(coder)[coder->bits / 8] >> (7 - coder->bits % 8)) & 1;
+    }
+    value |= bit << count;
+    coder->bits++;
+  }
+  return value;
+}
+
+//Number of leading 1 bits before a 0, at most max
+static uint8_t readPrefix(historyCoder *coder, uint8_t max)
+{
+  uint8_t ones = 0;
+
+  while (ones < max && readBits(coder, 1))
+  {
+    ones++;
+  }
+  return ones;
+}
+
+static uint32_t floatBits(float value)
+{
+  uint32_t bits;
+
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static float bitsFloat(uint32_t bits)
+{
+  float value;
+
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+//Signed value in an n bit field, biased by 2^(n-1) - 1
+static bool fits(int32_t value, uint8_t n)
+{
+  return value >= -((1 << (n - 1)) - 1) && value <= (1 << (n - 1));
+}
+
+static void writeBiased(historyCoder *coder, int32_t value, uint8_t n)
+{
+  writeBits(coder, (uint32_t)(value + (1 << (n - 1)) - 1), n);
+}
+
+static int32_t readBiased(historyCoder *coder, uint8_t n)
+{
+  return (int32_t)readBits(coder, n) - ((1 << (n - 1)) - 1);
+}
+
+//Delta of delta, mod 2^32 so a clock set backwards still round trips
+static void encodeTime(historyCoder *coder, uint32_t time)
+{
+  static const uint8_t widths[] = {7, 9, 12};
+
+  if (coder->count == 0)
+  {
+    writeBits(coder, time, 32);
+    coder->lastDelta = 0;
+    coder->lastTime = time;
+    return;
+  }
+  uint32_t delta = time - coder->lastTime;
+  int32_t dod = (int32_t)(delta - (uint32_t)coder->lastDelta);
+  coder->lastDelta = (int32_t)delta;
+  coder->lastTime = time;
+  if (dod == 0)
+  {
+    writeBits(coder, 0, 1);
+    return;
+  }
+  for (uint8_t i = 0; i < sizeof(widths); i++)
+  {
+    if (fits(dod, widths[i]))
+    {
+      writeBits(coder, (1u << (i + 2)) - 2, i + 2); //10, 110, 1110
+      writeBiased(coder, dod, widths[i]);
+      return;
+    }
+  }
+  writeBits(coder, 0xF, 4);
+  writeBits(coder, (uint32_t)dod, 32);
+}
+
+static uint32_t decodeTime(historyCoder *coder)
+{
+  static const uint8_t widths[] = {7, 9, 12};
+
+  if (coder->count == 0)
+  {
+    coder->lastDelta = 0;
+    coder->lastTime = readBits(coder, 32);
+    return coder->lastTime;
+  }
+  uint8_t prefix = readPrefix(coder, 4);
+  uint32_t dod = (prefix == 0) ? 0 : (prefix < 4) ? (uint32_t)readBiased(coder, widths[prefix - 1]) : readBits(coder, 32);
+  coder->lastDelta = (int32_t)((uint32_t)coder->lastDelta + dod);
+  coder->lastTime += (uint32_t)coder->lastDelta;
+  return coder->lastTime;
+}
+
+static void encodeFloat(historyCoder *coder, uint8_t i, uint32_t value)
+{
+  uint32_t x = value ^ coder->lastValue[i];
+
+  coder->lastValue[i] = value;
+  if (coder->count == 0)
+  {
+    writeBits(coder, value, 32);
+    return;
+  }
+  if (x == 0)
+  {
+    writeBits(coder, 0, 1);
+    return;
+  }
+  uint8_t leading = __builtin_clz(x);
+  uint8_t trailing = __builtin_ctz(x);
+  if (coder->leading[i] != 0xFF && leading >= coder->leading[i] && trailing >= coder->trailing[i])
+  {
+    writeBits(coder, 0x2, 2);
+    writeBits(coder, x >> coder->trailing[i], 32 - coder->leading[i] - coder->trailing[i]);
+    return;
+  }
+  uint8_t length = 32 - leading - trailing;
+  writeBits(coder, 0x3, 2);
+  writeBits(coder, leading, 5);
+  writeBits(coder, length - 1, 5);
+  writeBits(coder, x >> trailing, length);
+  coder->leading[i] = leading;
+  coder->trailing[i] = trailing;
+}
+
+static uint32_t decodeFloat(historyCoder *coder, uint8_t i)
+{
+  if (coder->count == 0)
+  {
+    coder->lastValue[i] = readBits(coder, 32);
+    return coder->lastValue[i];
+  }
+  uint8_t prefix = readPrefix(coder, 2);
+  if (prefix == 1)
+  {
+    coder->lastValue[i] ^= readBits(coder, 32 - coder->leading[i] - coder->trailing[i]) << coder->trailing[i];
+  }
+  else if (prefix == 2)
+  {
+    uint8_t leading = readBits(coder, 5);
+    uint8_t length = readBits(coder, 5) + 1;
+    uint8_t trailing = (leading + length <= 32) ? 32 - leading - length : 0;
+    coder->lastValue[i] ^= readBits(coder, length) << trailing;
+    coder->leading[i] = leading;
+    coder->trailing[i] = trailing;
+  }
+  return coder->lastValue[i];
+}
+
+static void encodeSoil(historyCoder *coder, uint16_t value)
+{
+  int32_t delta = (int32_t)value - coder->lastSoil;
+
+  coder->lastSoil = value;
+  if (coder->count == 0)
+  {
+    writeBits(coder, value, 16);
+  }
+  else if (delta == 0)
+  {
+    writeBits(coder, 0, 1);
+  }
+  else if (fits(delta, 6))
+  {
+    writeBits(coder, 0x2, 2);
+    writeBiased(coder, delta, 6);
+  }
+  else if (fits(delta, 10))
+  {
+    writeBits(coder, 0x6, 3);
+    writeBiased(coder, delta, 10);
+  }
+  else
+  {
+    writeBits(coder, 0x7, 3);
+    writeBits(coder, value, 16);
+  }
+}
+
+static uint16_t decodeSoil(historyCoder *coder)
+{
+  if (coder->count == 0)
+  {
+    coder->lastSoil = readBits(coder, 16);
+    return coder->lastSoil;
+  }
+  uint8_t prefix = readPrefix(coder, 3);
+  if (prefix == 1)
+  {
+    coder->lastSoil += readBiased(coder, 6);
+  }
+  else if (prefix == 2)
+  {
+    coder->lastSoil += readBiased(coder, 10);
+  }
+  else if (prefix == 3)
+  {
+    coder->lastSoil = readBits(coder, 16);
+  }
+  return coder->lastSoil;
+}
+
+static void readHeader(const uint8_t *block, historyBlockHeader *header)
+{
+  memcpy(header, block, sizeof(*header));
+}
+
+//Keeps the record if it fitted, otherwise restores the coder from before it
+static bool commit(historyCoder *coder, const historyCoder *before, uint32_t time)
+{
+  historyBlockHeader header;
+
+  if (coder->bits > HISTORY_DATA_BITS)
+  {
+    *coder = *before;
+    return false;
+  }
+  readHeader(coder->block, &header);
+  if (coder->count == 0)
+  {
+    header.firstTime = time;
+  }
+  header.lastTime = time;
+  coder->count++;
+  header.count = coder->count;
+  header.bits = coder->bits;
+  memcpy(coder->block, &header, sizeof(header));
+  return true;
+}
+
+void historyEncoderBegin(historyCoder *coder, uint8_t *block, uint8_t kind, uint32_t sequence)
+{
+  historyBlockHeader header;
+
+  memset(coder, 0, sizeof(*coder));
+  memset(&header, 0, sizeof(header));
+  coder->block = block;
+  coder->leading[0] = coder->leading[1] = 0xFF;
+  header.sequence = sequence;
+  header.kind = kind;
+  header.format = HISTORY_FORMAT;
+  memcpy(block, &header, sizeof(header));
+}
+
+bool historyEncodeSample(historyCoder *coder, const historySample *sample)
+{
+  historyCoder before = *coder;
+
+  encodeTime(coder, sample->time);
+  encodeFloat(coder, 0, floatBits(sample->humidity));
+  encodeFloat(coder, 1, floatBits(sample->temperature));
+  encodeSoil(coder, sample->soilMoisture);
+  writeBits(coder, sample->lowWater ? 1 : 0, 1);
+  return commit(coder, &before, sample->time);
+}
+
+bool historyEncodeEvent(historyCoder *coder, const historyEvent *event)
+{
+  historyCoder before = *coder;
+
+  encodeTime(coder, event->time);
+  writeBits(coder, event->type, 8);
+  writeBits(coder, event->status ? 1 : 0, 1);
+  return commit(coder, &before, event->time);
+}
+
+size_t historyBlockLength(const uint8_t *block)
+{
+  historyBlockHeader header;
+
+  readHeader(block, &header);
+  return HEADER_SIZE + (header.bits + 7) / 8;
+}
+
+size_t historyEncoderFinish(historyCoder *coder)
+{
+  size_t length = historyBlockLength(coder->block);
+  uint32_t crc = crc32Update(0, coder->block + sizeof(uint32_t), length - sizeof(uint32_t));
+
+  memcpy(coder->block, &crc, sizeof(crc));
+  return length;
+}
+
+bool historyDecoderBegin(historyCoder *coder, const uint8_t *block, size_t length)
+{
+  historyBlockHeader header;
+
+  if (length < HEADER_SIZE)
+  {
+    return false;
+  }
+  readHeader(block, &header);
+  size_t used = HEADER_SIZE + (header.bits + 7) / 8;
+  if (header.format != HISTORY_FORMAT || header.bits > HISTORY_DATA_BITS || used > length ||
+      crc32Update(0, block + sizeof(uint32_t), used - sizeof(uint32_t)) != header.crc)
+  {
+    return false;
+  }
+  memset(coder, 0, sizeof(*coder));
+  coder->block = (uint8_t *)block; //Only read
+  coder->leading[0] = coder->leading[1] = 0xFF;
+  coder->records = header.count;
+  return true;
+}
+
+bool historyDecodeSample(historyCoder *coder, historySample *sample)
+{
+  if (coder->count >= coder->records)
+  {
+    return false;
+  }
+  sample->time = decodeTime(coder);
+  sample->humidity = bitsFloat(decodeFloat(coder, 0));
+  sample->temperature = bitsFloat(decodeFloat(coder, 1));
+  sample->soilMoisture = decodeSoil(coder);
+  sample->lowWater = readBits(coder, 1);
+  coder->count++;
+  return true;
+}
+
+bool historyDecodeEvent(historyCoder *coder, historyEvent *event)
+{
+  if (coder->count >= coder->records)
+  {
+    return false;
+  }
+  event->time = decodeTime(coder);
+  event->type = readBits(coder, 8);
+  event->status = readBits(coder, 1);
+  coder->count++;
+  return true;
+}
@@ -0,0 +1,95 @@
+#ifndef HISTORY_CODEC_H
+#define HISTORY_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Compressed block of sensor samples or actuator events, as stored (history_store.h) and as sent on
+//monitor/history: historyBlockHeader, then header.bits of data, all fields little endian.
+//Every block starts over, so it decodes on its own. Bits are written MSB first. Per record:
+//  time      first record 32 bits, then the delta of delta to the previous interval (Gorilla):
+//            '0' same interval, '10' + 7 bits, '110' + 9 bits, '1110' + 12 bits, '1111' + 32 bits,
+//            an n bit field holds dod + 2^(n-1) - 1
+//  sensor    humidity, temperature: float bits XOR the previous value (Gorilla): '0' equal,
+//            '10' + the bits inside the previous leading/trailing zero window,
+//            '11' + 5 bits leading zeros + 5 bits length - 1 + the bits. First record 32 bits each.
+//            soilMoisture: '0' equal, '10' + 6 bits or '110' + 10 bits delta (biased as above),
+//            '111' + 16 bits value. First record 16 bits.
+//            lowWater: 1 bit
+//  event     8 bits type, 1 bit status
+#define HISTORY_BLOCK_SIZE 512
+#define HISTORY_FORMAT 1
+
+//Block kinds
+#define HISTORY_SENSOR 1        //samples as recorded
+#define HISTORY_SENSOR_COARSE 2 //averages of HISTORY_DOWNSAMPLE samples
+#define HISTORY_EVENTS 3        //actuator and water level changes
+#define HISTORY_END 4           //header only, ends a query or replay (firstTime, lastTime: its range)
+
+typedef struct
+{
+  uint32_t crc;       //CRC-32 of the block after this field up to the last data byte
+  uint32_t sequence;  //block counter, the store keeps the newest
+  uint32_t firstTime; //unix s
+  uint32_t lastTime;
+  uint16_t count;     //records
+  uint16_t bits;      //data bits
+  uint8_t kind;       //HISTORY_*
+  uint8_t format;     //HISTORY_FORMAT
+  uint8_t reserved[2];
+} historyBlockHeader;
+
+#define HISTORY_DATA_BITS ((HISTORY_BLOCK_SIZE - sizeof(historyBlockHeader)) * 8)
+
+typedef struct
+{
+  uint32_t time;
+  float humidity;
+  float temperature;
+  uint16_t soilMoisture; //mV
+  uint8_t lowWater;
+} historySample;
+
+typedef struct
+{
+  uint32_t time;
+  uint8_t type; //actuator type or WATERLEVEL
+  uint8_t status;
+} historyEvent;
+
+//Encoder or decoder state, the previous record
+typedef struct
+{
+  uint8_t *block; //HISTORY_BLOCK_SIZE bytes, header first
+  uint16_t bits;    //position in the data
+  uint16_t count;   //records so far
+  uint16_t records; //decoder: records in the block
+  uint32_t lastTime;
+  int32_t lastDelta;
+  uint32_t lastValue[2]; //float bits
+  uint8_t leading[2];    //XOR window, 0xFF: none yet
+  uint8_t trailing[2];
+  uint16_t lastSoil;
+} historyCoder;
+
+//Starts an empty block of kind in block
+void historyEncoderBegin(historyCoder *coder, uint8_t *block, uint8_t kind, uint32_t sequence);
+
+//Append one record. False if it does not fit, the block is then unchanged and full.
+bool historyEncodeSample(historyCoder *coder, const historySample *sample);
+bool historyEncodeEvent(historyCoder *coder, const historyEvent *event);
+
+//Completes the header (CRC), returns the bytes to store or send
+size_t historyEncoderFinish(historyCoder *coder);
+
+//Bytes of a finished block in use, header included
+size_t historyBlockLength(const uint8_t *block);
+
+//False if block (length bytes available) is not a valid finished block
+bool historyDecoderBegin(historyCoder *coder, const uint8_t *block, size_t length);
+
+//Next record, false after the last one
+bool historyDecodeSample(historyCoder *coder, historySample *sample);
+bool historyDecodeEvent(historyCoder *coder, historyEvent *event);
+
+#endif
@@ -0,0 +1,381 @@
+#include "history_store.h"
+#include "crc32.h"
+#include "hal.h"
+#include "logger.h"
+#include <math.h>
+#include <string.h>
+
+#define HISTORY_COARSE_PERIOD 600 //s, longest span of one average
+#define HISTORY_SCAN_STEP 32      //blocks read per historyNextMessage() call at most
+#define NO_SLOT 0xFFFF
+
+//Query positions, oldest first
+#define POSITION_COARSE_OPEN HISTORY_COARSE_BLOCKS
+#define POSITION_RAW (POSITION_COARSE_OPEN + 1)
+#define POSITION_SENSOR_OPEN (POSITION_RAW + HISTORY_RAW_BLOCKS)
+#define POSITION_EVENTS_OPEN (POSITION_SENSOR_OPEN + 1)
+#define POSITION_END (POSITION_EVENTS_OPEN + 1)
+
+typedef struct
+{
+  uint8_t block[HISTORY_BLOCK_SIZE];
+  historyCoder coder;
+  uint16_t slot; //raw slots 0 ... HISTORY_RAW_BLOCKS - 1, then the coarse ones
+  bool dirty;    //records not written yet
+} openBlock;
+
+static openBlock sensor, events, coarse;
+static uint8_t scratch[HISTORY_BLOCK_SIZE]; //blocks read back, the end message
+static uint16_t rawHead, coarseHead;        //oldest slot, taken next
+static uint32_t sequence;
+static uint8_t unflushed;
+static uint32_t offlineSince; //0: link up
+
+static struct
+{
+  uint32_t firstTime;
+  float humidity; //sums
+  float temperature;
+  uint32_t soilMoisture;
+  uint8_t lowWater; //any
+  uint8_t count;
+} average;
+
+static struct
+{
+  uint32_t from;
+  uint32_t to;
+  uint16_t position;
+  bool active;
+  bool replay;
+} query;
+
+static void blockHeader(const uint8_t *block, historyBlockHeader *header)
+{
+  memcpy(header, block, sizeof(*header));
+}
+
+static bool readSlot(uint16_t slot, uint8_t *block)
+{
+  return halHistoryRead((uint32_t)slot * HISTORY_BLOCK_SIZE, block, HISTORY_BLOCK_SIZE);
+}
+
+static void writeBlock(openBlock *open)
+{
+  size_t length = historyEncoderFinish(&open->coder);
+
+  if (!halHistoryWrite((uint32_t)open->slot * HISTORY_BLOCK_SIZE, open->block, length))
+  {
+    LOG_W("History write failed");
+  }
+  open->dirty = false;
+}
+
+static void openCoarse()
+{
+  coarse.slot = HISTORY_RAW_BLOCKS + coarseHead;
+  coarseHead = (coarseHead + 1) % HISTORY_COARSE_BLOCKS;
+  historyEncoderBegin(&coarse.coder, coarse.block, HISTORY_SENSOR_COARSE, sequence++);
+}
+
+static void recordCoarse(const historySample *sample)
+{
+  if (!historyEncodeSample(&coarse.coder, sample))
+  {
+    writeBlock(&coarse);
+    openCoarse();
+    historyEncodeSample(&coarse.coder, sample);
+  }
+  coarse.dirty = true;
+}
+
+//Rounded to the sensor resolution, so the XOR coding stays compact
+static void emitAverage()
+{
+  historySample sample;
+
+  sample.time = average.firstTime;
+  sample.humidity = roundf(average.humidity / average.count * 10) / 10;
+  sample.temperature = roundf(average.temperature / average.count * 10) / 10;
+  sample.soilMoisture = (uint16_t)(average.soilMoisture / average.count);
+  sample.lowWater = average.lowWater;
+  recordCoarse(&sample);
+  memset(&average, 0, sizeof(average));
+}
+
+//Adds a sample of an overwritten raw block to the running average
+static void downsample(const historySample *sample)
+{
+  if (average.count > 0 && sample->time - average.firstTime >= HISTORY_COARSE_PERIOD)
+  {
+    emitAverage(); //Gap in the data
+  }
+  if (average.count == 0)
+  {
+    average.firstTime = sample->time;
+  }
+  average.humidity += sample->humidity;
+  average.temperature += sample->temperature;
+  average.soilMoisture += sample->soilMoisture;
+  average.lowWater |= sample->lowWater;
+  if (++average.count == HISTORY_DOWNSAMPLE)
+  {
+    emitAverage();
+  }
+}
+
+//Takes the oldest raw slot. A sensor block there is averaged into the coarse ring first. The slot of
+//an events block that stayed open for a whole round is skipped.
+static uint16_t takeRawSlot()
+{
+  uint16_t slot = rawHead;
+  historyCoder decoder;
+  historySample sample;
+
+  while (slot == sensor.slot || slot == events.slot)
+  {
+    slot = (slot + 1) % HISTORY_RAW_BLOCKS;
+  }
+  rawHead = (slot + 1) % HISTORY_RAW_BLOCKS;
+  if (readSlot(slot, scratch) && historyDecoderBegin(&decoder, scratch, HISTORY_BLOCK_SIZE) &&
+      scratch[offsetof(historyBlockHeader, kind)] == HISTORY_SENSOR)
+  {
+    while (historyDecodeSample(&decoder, &sample))
+    {
+      downsample(&sample);
+    }
+  }
+  return slot;
+}
+
+static void openRaw(openBlock *open, uint8_t kind)
+{
+  open->slot = takeRawSlot();
+  historyEncoderBegin(&open->coder, open->block, kind, sequence++);
+}
+
+static void flush()
+{
+  openBlock *const blocks[] = {&sensor, &events, &coarse};
+
+  for (openBlock *open : blocks)
+  {
+    if (open->dirty)
+    {
+      writeBlock(open);
+    }
+  }
+  unflushed = 0;
+}
+
+//After a record went into open
+static void recorded(openBlock *open)
+{
+  open->dirty = true;
+  if (++unflushed >= HISTORY_FLUSH)
+  {
+    flush();
+  }
+}
+
+void historyBegin()
+{
+  uint32_t newestRaw = 0, newestCoarse = 0;
+  historyCoder decoder;
+  historyBlockHeader header;
+
+  sequence = 1;
+  rawHead = coarseHead = 0;
+  for (uint16_t slot = 0; slot < HISTORY_RAW_BLOCKS + HISTORY_COARSE_BLOCKS; slot++)
+  {
+    if (!readSlot(slot, scratch) || !historyDecoderBegin(&decoder, scratch, HISTORY_BLOCK_SIZE))
+    {
+      continue;
+    }
+    blockHeader(scratch, &header);
+    if (header.sequence >= sequence)
+    {
+      sequence = header.sequence + 1;
+    }
+    if (slot < HISTORY_RAW_BLOCKS && header.sequence > newestRaw)
+    {
+      newestRaw = header.sequence;
+      rawHead = (slot + 1) % HISTORY_RAW_BLOCKS;
+    }
+    else if (slot >= HISTORY_RAW_BLOCKS && header.sequence > newestCoarse)
+    {
+      newestCoarse = header.sequence;
+      coarseHead = (slot - HISTORY_RAW_BLOCKS + 1) % HISTORY_COARSE_BLOCKS;
+    }
+  }
+  memset(&average, 0, sizeof(average));
+  memset(&query, 0, sizeof(query));
+  sensor.slot = events.slot = NO_SLOT;
+  openCoarse();
+  openRaw(&sensor, HISTORY_SENSOR);
+  openRaw(&events, HISTORY_EVENTS);
+  unflushed = 0;
+
+  halNvsOpen();
+  if (halNvsRead(HISTORY_NVS_KEY, &offlineSince, sizeof(offlineSince)) != sizeof(offlineSince))
+  {
+    offlineSince = 0;
+  }
+  halNvsClose();
+  LOG_I("History: block %lu", (unsigned long)sequence);
+}
+
+void historyRecordSample(const historySample *sample)
+{
+  if (!historyEncodeSample(&sensor.coder, sample))
+  {
+    writeBlock(&sensor);
+    openRaw(&sensor, HISTORY_SENSOR);
+    historyEncodeSample(&sensor.coder, sample);
+  }
+  recorded(&sensor);
+}
+
+void historyRecordEvent(const historyEvent *event)
+{
+  if (!historyEncodeEvent(&events.coder, event))
+  {
+    writeBlock(&events);
+    openRaw(&events, HISTORY_EVENTS);
+    historyEncodeEvent(&events.coder, event);
+  }
+  recorded(&events);
+}
+
+void historyQuery(uint32_t from, uint32_t to)
+{
+  query.from = from;
+  query.to = to;
+  query.position = 0;
+  query.active = true;
+  query.replay = false;
+}
+
+void historyOffline(uint32_t now)
+{
+  if (offlineSince != 0)
+  {
+    return;
+  }
+  //An unfinished replay starts over from its beginning
+  offlineSince = (query.active && query.replay) ? query.from : now;
+  halNvsOpen();
+  halNvsWrite(HISTORY_NVS_KEY, &offlineSince, sizeof(offlineSince));
+  halNvsClose();
+}
+
+void historyReplay(uint32_t now)
+{
+  if (offlineSince == 0)
+  {
+    return;
+  }
+  historyQuery(offlineSince, now);
+  query.replay = true;
+  offlineSince = 0;
+  halNvsOpen();
+  halNvsRemove(HISTORY_NVS_KEY);
+  halNvsClose();
+}
+
+static bool overlaps(const uint8_t *block)
+{
+  historyBlockHeader header;
+
+  blockHeader(block, &header);
+  return header.count > 0 && header.lastTime >= query.from && header.firstTime <= query.to;
+}
+
+//Open blocks are sent from RAM, their slot may hold an older write
+static const uint8_t *openMessage(openBlock *open, size_t *length)
+{
+  if (open->coder.count == 0 || !overlaps(open->block))
+  {
+    return NULL;
+  }
+  *length = historyEncoderFinish(&open->coder);
+  return open->block;
+}
+
+static const uint8_t *endMessage(size_t *length)
+{
+  historyBlockHeader header;
+
+  memset(&header, 0, sizeof(header));
+  header.firstTime = query.from;
+  header.lastTime = query.to;
+  header.kind = HISTORY_END;
+  header.format = HISTORY_FORMAT;
+  memcpy(scratch, &header, sizeof(header));
+  header.crc = crc32Update(0, scratch + sizeof(header.crc), sizeof(header) - sizeof(header.crc));
+  memcpy(scratch, &header, sizeof(header));
+  *length = sizeof(header);
+  return scratch;
+}
+
+//Message at position, NULL if there is none
+static const uint8_t *messageAt(uint16_t position, size_t *length)
+{
+  uint16_t slot;
+  historyCoder decoder;
+
+  if (position == POSITION_COARSE_OPEN)
+  {
+    return openMessage(&coarse, length);
+  }
+  if (position == POSITION_SENSOR_OPEN)
+  {
+    return openMessage(&sensor, length);
+  }
+  if (position == POSITION_EVENTS_OPEN)
+  {
+    return openMessage(&events, length);
+  }
+  if (position == POSITION_END)
+  {
+    return endMessage(length);
+  }
+  if (position < POSITION_COARSE_OPEN)
+  {
+    slot = HISTORY_RAW_BLOCKS + (coarseHead + position) % HISTORY_COARSE_BLOCKS;
+  }
+  else
+  {
+    slot = (rawHead + position - POSITION_RAW) % HISTORY_RAW_BLOCKS;
+  }
+  if (slot == coarse.slot || slot == sensor.slot || slot == events.slot || !readSlot(slot, scratch) ||
+      !historyDecoderBegin(&decoder, scratch, HISTORY_BLOCK_SIZE) || !overlaps(scratch))
+  {
+    return NULL;
+  }
+  *length = historyBlockLength(scratch);
+  return scratch;
+}
+
+const uint8_t *historyNextMessage(size_t *length)
+{
+  for (uint8_t i = 0; i < HISTORY_SCAN_STEP && query.active; i++)
+  {
+    const uint8_t *message = messageAt(query.position, length);
+    if (message != NULL)
+    {
+      return message;
+    }
+    query.position++;
+  }
+  return NULL;
+}
+
+void historyMessageSent()
+{
+  if (query.position == POSITION_END)
+  {
+    query.active = false;
+  }
+  query.position++;
+}
@@ -0,0 +1,45 @@
+#ifndef HISTORY_STORE_H
+#define HISTORY_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "history_codec.h"
+
+//Sensor samples and actuator events in flash (halHistoryRead/Write, a LittleFS file on the board), as
+//blocks of history_codec.h in two rings:
+//  raw     HISTORY_RAW_BLOCKS, samples as recorded and events. The oldest block is overwritten; a
+//          sensor block is first averaged down into the coarse ring, events are dropped.
+//  coarse  HISTORY_COARSE_BLOCKS of HISTORY_DOWNSAMPLE sample averages, the oldest is overwritten.
+//At one sample a minute a raw block holds about 1.5 h, so there are about 20 days raw and 2 months
+//coarse. The open blocks are written every HISTORY_FLUSH records, a power loss loses at most that many.
+//Network task only.
+#define HISTORY_RAW_BLOCKS 320
+#define HISTORY_COARSE_BLOCKS 64
+#define HISTORY_REGION_SIZE ((uint32_t)(HISTORY_RAW_BLOCKS + HISTORY_COARSE_BLOCKS) * HISTORY_BLOCK_SIZE)
+#define HISTORY_DOWNSAMPLE 10
+#define HISTORY_FLUSH 10
+#define HISTORY_NVS_KEY "histOffline"
+
+//Finds the newest blocks, starts new open ones after them
+void historyBegin();
+
+void historyRecordSample(const historySample *sample);
+void historyRecordEvent(const historyEvent *event);
+
+//Queries stream every block overlapping [from, to], oldest first: the coarse ring, the raw ring, the
+//open blocks, then a HISTORY_END header. A new query replaces a running one. Blocks are whole, the
+//receiver drops records outside the range.
+void historyQuery(uint32_t from, uint32_t to);
+
+//The link went down at now. Kept in NVS until historyReplay(), also across a reboot.
+void historyOffline(uint32_t now);
+
+//The link is back: queries what was recorded since historyOffline(), nothing if it was not down
+void historyReplay(uint32_t now);
+
+//Next message of the running query, NULL if there is none. Valid until the next history call,
+//historyMessageSent() moves on to the following one.
+const uint8_t *historyNextMessage(size_t *length);
+void historyMessageSent();
+
+#endif
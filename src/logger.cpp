@@ -0,0 +1,110 @@
+#include "logger.h"
+#include "hal.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+//Bounded multi producer queue (D. Vyukov): a slot's sequence tells whose turn it is. A writer claims
+//a slot by moving head with a compare and swap, formats into it and publishes it by advancing its
+//sequence. The drain task is the only reader. No locks, a writer never waits for another one.
+typedef struct
+{
+  uint32_t sequence;
+  uint16_t length;
+  char text[LOG_LINE_SIZE];
+} logSlot;
+
+static logSlot slots[LOG_SLOTS];
+static uint32_t head, tail;
+static uint32_t dropped, droppedReported;
+static bool ready;
+static const char levelNames[] = "-EWIDT";
+
+static_assert((LOG_SLOTS & (LOG_SLOTS - 1)) == 0, "LOG_SLOTS must be a power of two");
+
+void loggerBegin()
+{
+  for (uint32_t i = 0; i < LOG_SLOTS; i++)
+  {
+    slots[i].sequence = i;
+  }
+  head = tail = 0;
+  __atomic_store_n(&ready, true, __ATOMIC_RELEASE);
+}
+
+void loggerWrite(uint8_t level, const char *format, ...)
+{
+  uint32_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  logSlot *slot;
+  va_list args;
+
+  if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE))
+  {
+    return;
+  }
+  for (;;)
+  {
+    slot = &slots[pos & (LOG_SLOTS - 1)];
+    int32_t lag = (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+    if (lag == 0)
+    {
+      if (__atomic_compare_exchange_n(&head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+        break; //Slot claimed
+      }
+      //pos was reloaded by the failed exchange
+    }
+    else if (lag < 0)
+    {
+      __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED); //Full, the drain task is behind
+      return;
+    }
+    else
+    {
+      pos = __atomic_load_n(&head, __ATOMIC_RELAXED); //Another writer took it
+    }
+  }
+
+  int length = snprintf(slot->text, LOG_LINE_SIZE, "%lu %c ", (unsigned long)halMillis(), levelNames[level < 6 ? level : 0]);
+  va_start(args, format);
+  length += vsnprintf(slot->text + length, LOG_LINE_SIZE - length, format, args);
+  va_end(args);
+  slot->length = (length < LOG_LINE_SIZE) ? length : LOG_LINE_SIZE - 1;
+  __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+uint16_t loggerDrain(loggerSink sink)
+{
+  uint16_t lines = 0;
+
+  for (;;)
+  {
+    logSlot *slot = &slots[tail & (LOG_SLOTS - 1)];
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != tail + 1)
+    {
+      break; //Empty, or the next line is still being formatted
+    }
+    if (sink != NULL)
+    {
+      sink(slot->text, slot->length);
+    }
+    __atomic_store_n(&slot->sequence, tail + LOG_SLOTS, __ATOMIC_RELEASE);
+    tail++;
+    lines++;
+  }
+
+  uint32_t drops = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+  if (drops != droppedReported && sink != NULL)
+  {
+    char line[40];
+    int length = snprintf(line, sizeof(line), "%lu log lines dropped", (unsigned long)(drops - droppedReported));
+    sink(line, length);
+    lines++;
+  }
+  droppedReported = drops;
+  return lines;
+}
+
+uint32_t loggerDropped()
+{
+  return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
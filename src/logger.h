@@ -0,0 +1,66 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Leveled log. Lines are formatted into a ring of fixed size slots and written out by a low priority
+//task (loggerDrain), a full ring drops the line and counts it instead of blocking the caller.
+//Levels above LOG_LEVEL are compiled out: their arguments are never evaluated and no code is emitted,
+//formats are still checked. Task context only.
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4 //sensor dumps, calendar checks
+#define LOG_LEVEL_TRACE 5 //every calendar rule
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO //set with -DLOG_LEVEL=... in platformio.ini
+#endif
+
+#define LOG_SLOTS 32     //power of two
+#define LOG_LINE_SIZE 128 //with the "<ms> <level> " prefix, longer lines are cut
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_E(...) loggerWrite(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_E(...) do { if (0) loggerWrite(0, __VA_ARGS__); } while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_W(...) loggerWrite(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_W(...) do { if (0) loggerWrite(0, __VA_ARGS__); } while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_I(...) loggerWrite(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_I(...) do { if (0) loggerWrite(0, __VA_ARGS__); } while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_D(...) loggerWrite(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_D(...) do { if (0) loggerWrite(0, __VA_ARGS__); } while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_T(...) loggerWrite(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_T(...) do { if (0) loggerWrite(0, __VA_ARGS__); } while (0)
+#endif
+
+//Receives one line without the newline
+typedef void (*loggerSink)(const char *line, size_t length);
+
+//Before the first line, earlier lines are dropped
+void loggerBegin();
+
+//One line, format without a trailing newline. Never blocks, any number of tasks may write.
+void loggerWrite(uint8_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+//Single consumer. Passes every queued line to sink (NULL: discard), reports drops since the last call
+//as a line of its own. Returns the number of lines written.
+uint16_t loggerDrain(loggerSink sink);
+
+uint32_t loggerDropped(); //since boot
+
+#endif
@@ -1,68 +1,134 @@
 #include <Arduino.h>
 #include <WiFi.h>
-#include <PubSubClient.h>
-#include "DHT.h"
-#include "DHT_U.h"
-#include <Adafruit_Sensor.h>
-#include "esp_adc_cal.h"
-#include <ArduinoJson.h>
 #include <RTClib.h>
 #include <WiFiManager.h> // https://github.com/tzapu/WiFiManager
-#include <Preferences.h>
-
-#define SOIL_MOISTURE_PIN 33 //Adc Pin
+#include <esp_sntp.h>
+#include "mqtt_link.h"
+#include "water_level.h"
+#include "soil_sensor.h"
+#include "dht22.h"
+#include "calendar_engine.h"
+#include "calendar_upload.h"
+#include "calendar_delta.h"
+#include "hal.h"
+#include "time_service.h"
+#include "controller.h"
+#include "telemetry.h"
+#include "topic_route.h"
+#include "diag.h"
+#include "groups.h"
+#include "ota.h"
+#include "history_store.h"
+#include "logger.h"
+#include "power.h"
+
+#define SOIL_MOISTURE_PIN 33 //Adc Pin, ADC1
 #define SYS_LED_PIN 2
 #define DHT_PIN 4
-#define LOW_WATER_PIN 16
-#define LED_PIN 17
-#define PUMP_PIN 5
-#define FAN_PIN 18
-#define LAMP_PIN 23
-
-//#define DEBUG
-#define DHTTYPE DHT22 // DHT22
-#define CALENDAR_SIZE 400
+#define LOW_WATER_PIN 16 //Relay pins are in actuatorTable (actuators.h)
+
+#define CALENDAR_CHUNK_TIMEOUT 30000 //ms, an unfinished chunked upload is dropped after this
 #define DS1338_ADDR 0x68
-#define FILTER_LEN 10
-#define DEBOUNCE_DELAY 30
+#define NTP_SERVER "pool.ntp.org" //polled hourly by the SNTP client once WiFi is up
+#define DEBOUNCE_DELAY 30 //ms, float switch debounce window
 #define SW_VERSION "v1.0"
-#define WATER 1
-#define FAN 2
-#define LED 3
-#define LAMP 4
+
+//Task configuration
+#define CONTROL_TASK_CORE 1
+#define SENSOR_TASK_CORE 1
+#define NETWORK_TASK_CORE 0
+#define CONTROL_TASK_PRIORITY 5
+#define SENSOR_TASK_PRIORITY 2
+#define NETWORK_TASK_PRIORITY 1
+#define LOG_TASK_PRIORITY 0 //with the idle task, only runs when nothing else does
+#define LOG_TASK_CORE 1
+#define CONTROL_TASK_STACK 4096
+#define SENSOR_TASK_STACK 4096
+#define NETWORK_TASK_STACK 8192
+#define LOG_TASK_STACK 2048
+#ifdef POWER_SAVE
+#define NETWORK_PERIOD POWER_NETWORK_PERIOD
+#define MQTT_KEEPALIVE_TIME POWER_MQTT_KEEPALIVE
+#define LOG_DRAIN_PERIOD POWER_LOG_DRAIN_PERIOD
+#define SENSOR_PERIOD POWER_SENSOR_PERIOD
+#else
+#define NETWORK_PERIOD 10      //ms, longest wait of the network task, status events wake it at once
+#define MQTT_KEEPALIVE_TIME 15 //s
+#define LOG_DRAIN_PERIOD 20    //ms
+#define SENSOR_PERIOD 10000    //ms, resolution of the telemetry thresholds
+#endif
+#define COMMAND_QUEUE_LEN 8
+#define STATUS_QUEUE_LEN (2 * ACTUATOR_COUNT + 8) //controllerPublishAll, a transition of every actuator, water level
+
+static_assert(STATUS_QUEUE_LEN >= ACTUATOR_COUNT + 1, "controllerPublishAll fits in the status queue");
+
+//Control task commands
+#define CMD_ACTUATOR 1
+#define CMD_WATER_LEVEL 2
+#define CMD_SET_DATETIME 3
+#define CMD_PUBLISH_STATUS 4
+#define CMD_CALENDAR_DEADLINE 5
+#define CMD_CALENDAR_UPDATED 6
+#define CMD_TIME_SYNC 7 //SNTP sample waiting in the time service
+#define CMD_RTC_WRITE 8 //second boundary for writing the corrected time to the RTC
+#define CMD_UTC_OFFSET 9 //unixtime: the new offset in s, as int32_t
 
 //structs
+//Network/sensor task -> control task
 typedef struct
 {
-  uint16_t dayofmin;
-  uint16_t action;
-} calendar;
+  uint8_t cmd;
+  uint8_t type;
+  uint8_t action;
+  uint32_t unixtime;
+} controlCommand;
 
+//Control task -> network task
 typedef struct
 {
-  uint16_t index;
-  uint16_t length;
-  uint8_t actionPin;
   uint8_t type;
   uint8_t status;
-} calendarInfo;
+} statusEvent;
 
 //Function prototypes
 void mqttCallback(char *topic, byte *message, unsigned int length);
+void onActuatorTopic(uint8_t type, const byte *message, unsigned int length);
+void onCalendarTopic(uint8_t type, const byte *message, unsigned int length);
+void onDatetimeTopic(uint8_t type, const byte *message, unsigned int length);
+void onCalendarUploadTopic(uint8_t type, const byte *message, unsigned int length);
+void onCalendarBinaryTopic(uint8_t type, const byte *message, unsigned int length);
+void onGroupsTopic(uint8_t type, const byte *message, unsigned int length);
+void onOtaTopic(uint8_t type, const byte *message, unsigned int length);
+void onOtaDataTopic(uint8_t type, const byte *message, unsigned int length);
+void onHistoryTopic(uint8_t type, const byte *message, unsigned int length);
+void onTelemetryTopic(uint8_t type, const byte *message, unsigned int length);
+void onUtcOffsetTopic(uint8_t type, const byte *message, unsigned int length);
 void setup_wifi();
-void reconnect();
-uint32_t readADCCal(int ADC_Raw);
-uint32_t calculateAvg(int sample);
-void sort_calendar(calendar *cal, uint16_t length);
-uint16_t jsonCalendarParse(const char *input, unsigned int inputLength, calendar *itemCalendar);
-bool isDateEqualCalendar(const DateTime &dt, uint16_t calendarItem);
-void calendarPerformAction(DateTime nowDate, calendarInfo *itemInfo, calendar *itemCalendar);
-void publishStatus(calendarInfo *itemInfo);
-bool isLowWater();
-int openWaterPump();
-void readSavedData();
+void onMqttConnected();
+void setMqttFilters();
+void publishGroups();
+void publishOtaStatus();
+void publishTelemetryConfig();
+void calendarUploadChunk(calendarInfo *itemInfo, const char *input, unsigned int inputLength);
+void calendarBinaryUpdate(calendarInfo *itemInfo, const uint8_t *data, unsigned int dataLength);
+void updateCalendar(calendarInfo *itemInfo, calendarRule *rules, uint16_t length, uint16_t version);
+void publishCalendarVersion(calendarInfo *itemInfo);
+void calendarEvaluate(uint8_t forceType);
+uint8_t serviceClock();
+void onCalendarTimer(void *arg);
+void onRtcTimer(void *arg);
+void onSntpSync(struct timeval *tv);
+void onWaterLevelChange(bool lowWater);
 void getDateString(char *dateBuffer, const DateTime &dt);
 void getDeviceID(char *deviceID);
+void controlTask(void *parameter);
+void sensorTask(void *parameter);
+void networkTask(void *parameter);
+void logTask(void *parameter);
+void writeLogLine(const char *line, size_t length);
+void handleControlCommand(const controlCommand &command);
+void sendControlCommand(uint8_t cmd, uint8_t type, uint8_t action, uint32_t unixtime);
+void sendStatus(uint8_t type, uint8_t status);
 
 const char *ssid = "RedmiMk";
 const char *password = "01011980";
@@ -70,51 +136,72 @@ const char *password = "01011980";
 //const char* mqtt_server = "34.211.84.46";
 const char *mqtt_server = "broker.emqx.io"; //"broker.emqx.io";
 
-DHT dht(DHT_PIN, DHTTYPE);
-RTC_DS1307 rtc;
-WiFiClient espClient;
 WiFiManager wm;
-PubSubClient client(espClient);
-Preferences preferences;
-DynamicJsonDocument doc(6144);
-calendar waterCalendar[CALENDAR_SIZE], fanCalendar[CALENDAR_SIZE], ledCalendar[CALENDAR_SIZE], lampCalendar[CALENDAR_SIZE];
-calendarInfo waterInfo, fanInfo, ledInfo, lampInfo;
-DateTime nowDate, lastDate;
-
-uint32_t adcBuffer[FILTER_LEN] = {0};
-uint32_t soilMoistureRaw, soilMoisture;
-int filterIndex = 0, loopCount = 0;
-char dateBuffer[25], deviceID[20];
-unsigned long lastMsg = 0, wlCheckTime = 0, portalTimeout = 0;
-bool lowWaterCheck, mqttStatus;
-String preStrCon, preStrMon;
-
-float temperature = 0, humidity = 0;
-uint16_t mOfWeek, lastMinOfWeek;
+calendarUpload *calendarUploads[ACTUATOR_COUNT]; //indexed by type - 1, allocated while one is running, network task only
+
+//Control topics besides the ones of each actuator, see buildTopicRoutes()
+const topicRoute fixedRoutes[] = {
+    {"calendar", onCalendarTopic, 0, true},
+    {"datetime", onDatetimeTopic, 0, true},
+    {"groups", onGroupsTopic, 0, true},
+    {"ota", onOtaTopic, 0, true},
+    {"ota_data", onOtaDataTopic, 0, false},
+    {"history", onHistoryTopic, 0, true},
+    {"telemetry", onTelemetryTopic, 0, true},
+    {"utc_offset", onUtcOffsetTopic, 0, true},
+};
+const actuatorTopicHandlers actuatorRoutes = {onActuatorTopic, onCalendarUploadTopic, onCalendarBinaryTopic};
+topicRoute topicRoutes[TOPIC_ROUTE_COUNT(sizeof(fixedRoutes) / sizeof(fixedRoutes[0]))]; //sorted for routeTopic()
+uint8_t topicRouteCount;
+esp_timer_handle_t calendarTimer, rtcTimer;
+bool sntpStarted;
+
+const uint8_t soilMoisturePins[] = {SOIL_MOISTURE_PIN}; //more sensors: add ADC1 pins, read with soilSensorRead(i)
+char dateBuffer[25], deviceID[20], subscribeTopic[40];
+bool mqttStatus;
+char controlPrefix[40]; //doa/<id>/control/
+size_t controlPrefixLength;
+const char *mqttFilters[1 + GROUPS_MAX]; //subscribeTopic, then the groups
+uint8_t messageSource;                   //of the message being handled, 0: this device, 1 + group index
+
+QueueHandle_t commandQueue;      //network task, float switch ISR -> control
+QueueHandle_t statusQueue;       //control -> network
+QueueHandle_t sensorMailbox;     //sensor -> network, length 1
+TaskHandle_t controlTaskHandle, sensorTaskHandle, networkTaskHandle, logTaskHandle;
 
 void setup()
 {
   Serial.begin(115200);
+  loggerBegin();
+#ifdef POWER_SAVE
+  powerBegin(); //Light sleep from here on whenever every task waits, see power.h
+#endif
+  xTaskCreatePinnedToCore(logTask, "log", LOG_TASK_STACK, NULL, LOG_TASK_PRIORITY, &logTaskHandle, LOG_TASK_CORE);
 
   getDeviceID(deviceID);
-  Serial.print("deviceID:");
-  Serial.println(deviceID);
-
-  preStrCon = String("doa/") + String(deviceID) + String("/control/");
-  preStrMon = String("doa/") + String(deviceID) + String("/monitor/");
+  LOG_I("deviceID:%s", deviceID);
+
+  controlPrefixLength = snprintf(controlPrefix, sizeof(controlPrefix), "doa/%s/control/", deviceID);
+  topicRouteCount = buildTopicRoutes(topicRoutes, fixedRoutes, sizeof(fixedRoutes) / sizeof(fixedRoutes[0]), actuatorRoutes);
+  telemetryBegin(deviceID, SW_VERSION);
+  halBegin(); //RTC, NVS, calendar lock
+  groupsBegin();
+  telemetryConfigBegin();
+  otaBegin(SW_VERSION); //May roll back and restart
+  timeBegin(); //The only RTC read until the next check, see time_service.h
+  historyBegin();
+  historyOffline(timeNow()); //Replayed from here at the first connection, unless it was down before
 
   pinMode(SYS_LED_PIN, OUTPUT);
-  pinMode(LED_PIN, OUTPUT);
-  pinMode(PUMP_PIN, OUTPUT);
-  pinMode(FAN_PIN, OUTPUT);
+  for (const actuatorConfig &actuator : actuatorTable)
+  {
+    digitalWrite(actuator.pin, HIGH); //Active State:lOW
+    pinMode(actuator.pin, OUTPUT);
+  }
 
   pinMode(LOW_WATER_PIN, INPUT);
   pinMode(SOIL_MOISTURE_PIN, INPUT);
 
-  digitalWrite(LED_PIN, HIGH);  //Active State:lOW
-  digitalWrite(PUMP_PIN, HIGH); //Active State:lOW
-  digitalWrite(FAN_PIN, HIGH);  //Active State:lOW
-
   //================================
   WiFi.mode(WIFI_STA); // explicitly set mode, esp defaults to STA+AP
   //reset settings - wipe credentials for testing
@@ -130,166 +217,360 @@ void setup()
   String apName = String("DOA_") + String(deviceID);
   if (wm.autoConnect(apName.c_str())) //wm.autoConnect("AutoConnectAP")
   {
-    Serial.println("connected... :)");
+    LOG_I("connected... :)");
   }
   else
   {
-    Serial.println("Configportal running");
+    LOG_I("Configportal running");
   }
   //====================================
 
-  dht.begin();     //Initialize the DHT sensor
-  readSavedData(); //Read saved calendar data
-
-  //Start RTC
-  Wire.begin();
-  rtc.begin();
-  lastDate = rtc.now();
+  dht22Begin(DHT_PIN, DHT22_RMT_CHANNEL); //Initialize the DHT sensor
+  controllerBegin(sendStatus); //Read saved calendar data
 
   //setup_wifi();
-  client.setBufferSize(4096);
-  client.setServer(mqtt_server, 1883);
-  client.setCallback(mqttCallback);
+  snprintf(subscribeTopic, sizeof(subscribeTopic), "doa/%s/control/#", deviceID);
+  mqttLinkBegin(mqtt_server, 1883, deviceID, MQTT_KEEPALIVE_TIME, mqttCallback, onMqttConnected);
+  setMqttFilters();
+
+  commandQueue = xQueueCreate(COMMAND_QUEUE_LEN, sizeof(controlCommand));
+  statusQueue = xQueueCreate(STATUS_QUEUE_LEN, sizeof(statusEvent));
+  sensorMailbox = xQueueCreate(1, sizeof(sensorData));
+
+  //Single deadline for the earliest calendar transition of all actuators
+  esp_timer_create_args_t timerArgs = {};
+  timerArgs.callback = onCalendarTimer;
+  timerArgs.name = "calendar";
+  esp_timer_create(&timerArgs, &calendarTimer);
+  timerArgs.callback = onRtcTimer;
+  timerArgs.name = "rtc";
+  esp_timer_create(&timerArgs, &rtcTimer);
+  sntp_set_time_sync_notification_cb(onSntpSync);
+
+  //Float switch interrupt, posts CMD_WATER_LEVEL into commandQueue
+  waterLevelBegin(LOW_WATER_PIN, DEBOUNCE_DELAY, onWaterLevelChange);
+  if (!soilSensorBegin(soilMoisturePins, sizeof(soilMoisturePins), SENSOR_TASK_CORE))
+  {
+    LOG_E("Soil moisture sampling not available");
+  }
+
+  //Calendars and actuators on the application core, WiFi and MQTT next to the WiFi stack
+  xTaskCreatePinnedToCore(controlTask, "control", CONTROL_TASK_STACK, NULL, CONTROL_TASK_PRIORITY,
+                          &controlTaskHandle, CONTROL_TASK_CORE);
+  xTaskCreatePinnedToCore(sensorTask, "sensor", SENSOR_TASK_STACK, NULL, SENSOR_TASK_PRIORITY,
+                          &sensorTaskHandle, SENSOR_TASK_CORE);
+  xTaskCreatePinnedToCore(networkTask, "network", NETWORK_TASK_STACK, NULL, NETWORK_TASK_PRIORITY,
+                          &networkTaskHandle, NETWORK_TASK_CORE);
 }
 
 void loop()
 {
-  wm.process(); //Wifi manager
+  //All work is done in controlTask, sensorTask and networkTask
+  vTaskDelete(NULL);
+}
 
-  if (millis() - wlCheckTime > 10000) // every 10 seconds
+//Calendars and actuators. Owns the RTC and every actuator pin.
+//Sleeps on commandQueue, calendar deadlines arrive there as CMD_CALENDAR_DEADLINE.
+void controlTask(void *parameter)
+{
+  controlCommand command;
+
+  calendarEvaluate(CALENDAR_ALL); //Restore calendar states after boot
+
+  for (;;)
   {
-    wlCheckTime = millis();
-    if (WiFi.status() != WL_CONNECTED)
+    if (xQueueReceive(commandQueue, &command, portMAX_DELAY) == pdTRUE)
     {
-      //if AP mode is open
-      if (WiFi.getMode() != WIFI_STA)
-      {
-        if (millis() - portalTimeout > 180000) // every 180 seconds
-        {
-          portalTimeout = millis();
-          WiFi.mode(WIFI_STA);
-          Serial.println(F("Changing Wifi mode to WIFI_STA"));
-        }
-      }
-      else //WiFi.getMode() == WIFI_STA
-      {
-        Serial.println(F("No Wifi, try reconnect"));
-        WiFi.reconnect();
-      }
+      diagLoopBegin(DIAG_LOOP_CONTROL);
+      handleControlCommand(command);
+      diagLoopEnd(DIAG_LOOP_CONTROL);
     }
   }
+}
 
-  if (!client.connected())
-  {
-    reconnect();
-  }
-  //mqttStatus = client.connected();
-  if (mqttStatus)
-  {
-    digitalWrite(SYS_LED_PIN, HIGH);
-    client.loop();
-  }
-  else
+//esp_timer task context
+void onCalendarTimer(void *arg)
+{
+  controlCommand command = {CMD_CALENDAR_DEADLINE, 0, 0, 0};
+  if (xQueueSend(commandQueue, &command, 0) != pdTRUE)
   {
-    digitalWrite(SYS_LED_PIN, LOW);
+    esp_timer_start_once(calendarTimer, 100000); //Queue full, do not lose the deadline
   }
+}
 
-  //Serial.print("Test ");
-  long now = millis();
-  if (now - lastMsg > 5000)
+//esp_timer task context
+void onRtcTimer(void *arg)
+{
+  controlCommand command = {CMD_RTC_WRITE, 0, 0, 0};
+  xQueueSend(commandQueue, &command, 0); //Lost: written after the next SNTP sample
+}
+
+//SNTP client, lwIP task context
+void onSntpSync(struct timeval *tv)
+{
+  timeSntpSample((uint64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000);
+  sendControlCommand(CMD_TIME_SYNC, 0, 0, 0);
+}
+
+//Applies due transitions and arms calendarTimer for the earliest next one, see controllerEvaluate()
+void calendarEvaluate(uint8_t forceType)
+{
+  diagEnter(DIAG_LOOP_CONTROL);
+  uint32_t waitMs = controllerEvaluate(forceType, timeNowMs());
+  diagLeave(DIAG_LOOP_CONTROL, DIAG_CAUSE_CALENDAR);
+  esp_timer_stop(calendarTimer);
+  esp_timer_start_once(calendarTimer, (uint64_t)waitMs * 1000);
+}
+
+//Control task. Takes over SNTP samples and checks the RTC when due, see timeService(). A correction
+//is written to the RTC just after the next second boundary, the RTC second starts with the write.
+uint8_t serviceClock()
+{
+  uint8_t result = timeService();
+
+  if (timeRtcWritePending())
   {
-    lastMsg = now;
+    esp_timer_stop(rtcTimer);
+    esp_timer_start_once(rtcTimer, (1000 - timeNowMs() % 1000) * 1000 + 1000);
+  }
+  return result;
+}
 
-    //If Low water level,  close the pump
-    lowWaterCheck = isLowWater();
-    if (lowWaterCheck)
+void handleControlCommand(const controlCommand &command)
+{
+  switch (command.cmd)
+  {
+  case CMD_ACTUATOR:
+    controllerSetActuator(command.type, command.action);
+    break;
+  case CMD_WATER_LEVEL:
+    //action 1: low water, the ISR has already closed the pump
+    controllerWaterLevel(command.action);
+    for (uint8_t type = 1; type <= ACTUATOR_COUNT && !command.action; type++)
+    {
+      if (actuatorIsPump(type))
+      {
+        calendarEvaluate(type); //Refused while the tank read empty, e.g. at boot
+      }
+    }
+    break;
+  case CMD_SET_DATETIME:
+    timeSet(command.unixtime);
+    LOG_I(" =>Datetime is adjusted.");
+    calendarEvaluate(CALENDAR_ALL);
+    break;
+  case CMD_CALENDAR_DEADLINE:
+    //At least hourly, also the slow RTC check
+    calendarEvaluate(serviceClock() == TIME_STEPPED ? CALENDAR_ALL : 0);
+    break;
+  case CMD_TIME_SYNC:
+    switch (serviceClock())
+    {
+    case TIME_STEPPED:
+      calendarEvaluate(CALENDAR_ALL);
+      break;
+    case TIME_CORRECTED:
+      calendarEvaluate(0); //Re-arms the deadline on the corrected clock
+      break;
+    default:
+      break;
+    }
+    break;
+  case CMD_RTC_WRITE:
+    timeWriteRtc();
+    break;
+  case CMD_UTC_OFFSET:
+    if (timeSetUtcOffset((int32_t)command.unixtime) == TIME_STEPPED)
     {
-      digitalWrite(PUMP_PIN, HIGH); //Close the pump
-      waterInfo.status = 0;
-      publishStatus(&waterInfo);
+      serviceClock(); //Arms the RTC write
+      calendarEvaluate(CALENDAR_ALL);
     }
+    break;
+  case CMD_CALENDAR_UPDATED:
+    calendarEvaluate(command.type);
+    break;
+  case CMD_PUBLISH_STATUS:
+    controllerPublishAll();
+    break;
+  default:
+    break;
+  }
+}
 
-    if (loopCount % 6 == 0) //Her 30sn bir
+//DHT and soil moisture ADC. The float switch is interrupt driven, see water_level.cpp
+void sensorTask(void *parameter)
+{
+  sensorData data = {0, 0, 0, false, 0};
+  TickType_t lastWake = xTaskGetTickCount();
+
+  for (;;)
+  {
+    //Her SENSOR_PERIOD ms bir
+    diagLoopBegin(DIAG_LOOP_SENSOR);
+    diagEnter(DIAG_LOOP_SENSOR);
+    bool ok = telemetrySample(&data);
+    diagLeave(DIAG_LOOP_SENSOR, DIAG_CAUSE_DHT);
+    if (!ok)
     {
-      humidity = dht.readHumidity();
-      if (isnan(humidity))
+      vTaskDelay(pdMS_TO_TICKS(DHT22_MIN_INTERVAL)); //One retry, the sensor needs a pause
+      diagEnter(DIAG_LOOP_SENSOR);
+      ok = telemetrySample(&data);
+      diagLeave(DIAG_LOOP_SENSOR, DIAG_CAUSE_DHT);
+      if (!ok)
       {
-        humidity = dht.readHumidity();
-      }
-      temperature = dht.readTemperature();
-      if (isnan(temperature))
-      {
-        temperature = dht.readTemperature();
+        LOG_W("DHT22 read failed, last good values kept");
       }
+    }
+    diagSampleHeap();
 
-      Serial.println(F("#=== SENSOR BILGILERI ===="));
-      Serial.print(F("Humidity = "));
-      Serial.println(humidity);
-      Serial.print(F("Temperature = "));
-      Serial.println(temperature);
+    LOG_D("#=== SENSOR BILGILERI ====");
+    LOG_D("Humidity = %.2f, Temperature = %.2f, lowWaterCheck = %d, Soil Moisture = %u", data.humidity,
+          data.temperature, data.lowWater, (unsigned)data.soilMoisture);
 
-      Serial.print(F("lowWaterCheck = "));
-      Serial.println(lowWaterCheck);
+    xQueueOverwrite(sensorMailbox, &data);
+    diagLoopEnd(DIAG_LOOP_SENSOR);
+    vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(SENSOR_PERIOD));
+  }
+}
 
-      for (int i = 0; i < FILTER_LEN; i++)
-      {
-        soilMoistureRaw = readADCCal(analogRead(SOIL_MOISTURE_PIN)); //Make calibration correction
-        soilMoisture = calculateAvg(soilMoistureRaw);
-      }
-      Serial.print(F("Soil Moisture = "));
-      Serial.println(soilMoisture);
-    }
+//WiFiManager, MQTT and telemetry. Never touches the actuators.
+void networkTask(void *parameter)
+{
+  unsigned long lastMsg = 0, lastDiag = 0, wlCheckTime = 0, portalTimeout = 0;
+  statusEvent event;
+  sensorData data = {0, 0, 0, false, 0};
+  bool linkWasUp = false;
 
-    if (loopCount % 2 == 0) //Her 10sn bir
-    {
-      nowDate = rtc.now(); //Get RTC Time
-      getDateString(dateBuffer, nowDate);
-      mOfWeek = 1440 * nowDate.dayOfTheWeek() + 60 * nowDate.hour() + nowDate.minute();
-      lastMinOfWeek = 1440 * lastDate.dayOfTheWeek() + 60 * lastDate.hour() + lastDate.minute();
+  for (;;)
+  {
+    diagLoopBegin(DIAG_LOOP_NETWORK);
+    diagEnter(DIAG_LOOP_NETWORK);
+    wm.process(); //Wifi manager
 
-      //Eger tarih gecmis bir tarih olarak ayarlandi veya hafta yeniden baslamis ise
-      if (lastDate > nowDate || lastMinOfWeek > mOfWeek)
+    if (millis() - wlCheckTime > 10000) // every 10 seconds
+    {
+      wlCheckTime = millis();
+      if (!sntpStarted && WiFi.status() == WL_CONNECTED)
       {
-        waterInfo.index = 0;
-        fanInfo.index = 0;
-        ledInfo.index = 0;
-        lampInfo.index = 0;
+        configTime(0, 0, NTP_SERVER); //Keeps polling across reconnects, results arrive in onSntpSync()
+        sntpStarted = true;
       }
-      lastDate = nowDate;
-
-      Serial.print(F("minuteOfWeek: "));
-      Serial.println(mOfWeek);
-      Serial.println(dateBuffer);
+      if (WiFi.status() != WL_CONNECTED)
+      {
+        //if AP mode is open
+        if (WiFi.getMode() != WIFI_STA)
+        {
+          if (millis() - portalTimeout > 180000) // every 180 seconds
+          {
+            portalTimeout = millis();
+            WiFi.mode(WIFI_STA);
+            LOG_I("Changing Wifi mode to WIFI_STA");
+          }
+        }
+        else //WiFi.getMode() == WIFI_STA
+        {
+          LOG_W("No Wifi, try reconnect");
+          WiFi.reconnect();
+        }
+      }
+    }
+    diagLeave(DIAG_LOOP_NETWORK, DIAG_CAUSE_WIFI);
 
-      Serial.println(F("#=== TAKVIM KONTROLLERI ===="));
-      Serial.println(F(" =>Sulama takvimi:"));
-      calendarPerformAction(nowDate, &waterInfo, waterCalendar); //Perform calendar actions
+    //Actuator and water level changes from the control task. State goes to the outbox also while the
+    //link is down, only the latest value per topic is kept until it is back.
+    diagEnter(DIAG_LOOP_NETWORK);
+    while (xQueueReceive(statusQueue, &event, 0) == pdTRUE)
+    {
+      historyEvent record = {timeNow(), event.type, event.status};
+      telemetryPublishStatus(event.type, event.status);
+      historyRecordEvent(&record);
+    }
 
-      Serial.println(F(" =>Fan takvimi:"));
-      calendarPerformAction(nowDate, &fanInfo, fanCalendar);
+    //Every new sample, only what moved past its threshold goes out (telemetry.h)
+    if (xQueueReceive(sensorMailbox, &data, 0) == pdTRUE)
+    {
+      data.lowWater = waterLevelIsLow();
+      getDateString(dateBuffer, DateTime(timeNow()));
+      telemetryReport(data, dateBuffer, millis());
+    }
 
-      Serial.println(F(" =>Led takvimi:"));
-      calendarPerformAction(nowDate, &ledInfo, ledCalendar);
+    if (millis() - lastMsg > 60000) //Her 60sn de bir defa
+    {
+      lastMsg = millis();
+      historySample sample = {timeNow(), data.humidity, data.temperature, (uint16_t)data.soilMoisture, data.lowWater};
+      historyRecordSample(&sample);
+    }
 
-      Serial.println(F(" =>UV Lamba takvimi:"));
-      calendarPerformAction(nowDate, &lampInfo, lampCalendar);
+    //One block of a history query or replay per pass
+    size_t historyLength;
+    const uint8_t *historyMessage = mqttStatus ? historyNextMessage(&historyLength) : NULL;
+    if (historyMessage != NULL && mqttLinkPublishData(monitorTopic(TOPIC_HISTORY), historyMessage, historyLength))
+    {
+      historyMessageSent();
     }
 
-    if (mqttStatus && loopCount == 0) //Her 60sn de bir defa
+    if (mqttStatus && millis() - lastDiag > DIAG_INTERVAL)
     {
-      // Publish messages
-      client.publish((preStrMon + String("datetime")).c_str(), (const char *)dateBuffer);
-      client.publish((preStrMon + String("version")).c_str(), SW_VERSION);
-      client.publish((preStrMon + String("humidity")).c_str(), String(humidity).c_str());
-      client.publish((preStrMon + String("temperature")).c_str(), String(temperature).c_str());
-      client.publish((preStrMon + String("soilmoisture")).c_str(), String(soilMoisture).c_str());
-      client.publish((preStrMon + String("waterlevel")).c_str(), String(!lowWaterCheck).c_str());
+      char payload[384];
+
+      lastDiag = millis();
+      diagFormat(payload, sizeof(payload), mqttLinkReconnectCount());
+      mqttLinkPublish(monitorTopic(TOPIC_DIAG), payload, 0); //QoS0, too long for the outbox
     }
-    loopCount++;
-    if (loopCount >= 12)
+    diagLeave(DIAG_LOOP_NETWORK, DIAG_CAUSE_PUBLISH);
+
+    //Receives and runs the handlers, then sends what was published above in one batch
+    diagEnter(DIAG_LOOP_NETWORK);
+    mqttStatus = mqttLinkProcess(); //Non-blocking, one connection step per pass
+    if (linkWasUp && !mqttStatus)
     {
-      loopCount = 0;
+      historyOffline(timeNow());
     }
+    linkWasUp = mqttStatus;
+    diagLeave(DIAG_LOOP_NETWORK, DIAG_CAUSE_MQTT_LINK);
+    digitalWrite(SYS_LED_PIN, mqttStatus ? HIGH : LOW);
+    diagLoopEnd(DIAG_LOOP_NETWORK);
+
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(NETWORK_PERIOD)); //sendStatus() wakes it early
+  }
+}
+
+//Writes the log out over Serial, blocking on the UART here instead of in the other tasks
+void logTask(void *parameter)
+{
+  for (;;)
+  {
+    loggerDrain(writeLogLine);
+    vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_PERIOD));
+  }
+}
+
+void writeLogLine(const char *line, size_t length)
+{
+  Serial.write((const uint8_t *)line, length);
+  Serial.write('\n');
+}
+
+void sendControlCommand(uint8_t cmd, uint8_t type, uint8_t action, uint32_t unixtime)
+{
+  controlCommand command = {cmd, type, action, unixtime};
+  if (xQueueSend(commandQueue, &command, pdMS_TO_TICKS(100)) != pdTRUE)
+  {
+    LOG_E("Control queue full, command dropped");
+  }
+}
+
+void sendStatus(uint8_t type, uint8_t status)
+{
+  statusEvent event = {type, status};
+  //Never block the control task on the network
+  if (xQueueSend(statusQueue, &event, 0) != pdTRUE)
+  {
+    LOG_E("Status queue full, %s state not reported", type == WATERLEVEL ? "water level" : actuatorName(type));
+  }
+  if (networkTaskHandle != NULL) //controllerBegin() reports before the tasks start
+  {
+    xTaskNotifyGive(networkTaskHandle);
   }
 }
 
@@ -297,9 +578,7 @@ void setup_wifi()
 {
   delay(10);
   // We start by connecting to a WiFi network
-  Serial.println();
-  Serial.print(F("Connecting to "));
-  Serial.println(ssid);
+  LOG_I("Connecting to %s", ssid);
 
   //WiFi.begin(ssid, password);
   WiFi.begin();
@@ -307,544 +586,400 @@ void setup_wifi()
   if (WiFi.status() != WL_CONNECTED) //while
   {
     delay(500);
-    Serial.println(F("Wifi not connected"));
+    LOG_W("Wifi not connected");
   }
   else
   {
-    Serial.println("");
-    Serial.println(F("WiFi connected"));
-    Serial.println(F("IP address: "));
-    Serial.println(WiFi.localIP());
+    LOG_I("WiFi connected, IP address: %s", WiFi.localIP().toString().c_str());
     //digitalWrite(BLUE_LED, HIGH);
   }
 }
 
+//Runs in the network task. The topic suffix after doa/<id>/control/ or doa/group/<name>/control/ is
+//looked up in topicRoutes, nothing is allocated on the way.
 void mqttCallback(char *topic, byte *message, unsigned int length)
 {
-  Serial.print(F("Message arrived on topic: "));
-  Serial.print(topic);
-  Serial.print(F("  Message: "));
-  String messageTemp;
-  String topicString = String(topic);
+  const topicRoute *route;
+  uint8_t group;
+  const char *groupSuffix = groupTopicSuffix(topic, &group);
 
-  if (!(topicString == (preStrCon + String("water_calendar")) || topicString == (preStrCon + String("fan_calendar")) ||
-        topicString == (preStrCon + String("led_calendar")) || topicString == (preStrCon + String("lamp_calendar"))))
+  if (groupSuffix != NULL)
   {
-    for (int i = 0; i < length; i++)
-    {
-      Serial.print((char)message[i]);
-      {
-        messageTemp += (char)message[i];
-      }
-    }
+    route = findTopicRoute(topicRoutes, topicRouteCount, groupSuffix);
+    messageSource = 1 + group;
   }
-
-  Serial.println();
-  if (topicString == (preStrCon + String("fan")))
+  else
   {
-    Serial.print(F("Changing fan output: "));
-    if (messageTemp == "on")
-    {
-      Serial.println("on");
-      digitalWrite(FAN_PIN, LOW);
-      //client.subscribe(preStrCon.c_str());
-      fanInfo.status = 1;
-      client.publish((preStrMon + String("fan")).c_str(), "on");
-    }
-    else if (messageTemp == "off")
-    {
-      Serial.println("off");
-      digitalWrite(FAN_PIN, HIGH);
-      fanInfo.status = 0;
-      client.publish((preStrMon + String("fan")).c_str(), "off");
-    }
+    route = routeTopic(topicRoutes, topicRouteCount, controlPrefix, controlPrefixLength, topic);
+    messageSource = 0;
   }
-  else if (topicString == (preStrCon + String("led")))
+  if (route == NULL)
   {
-    Serial.print(F("Changing led output: "));
-    if (messageTemp == "on")
-    {
-      Serial.println("on");
-      digitalWrite(LED_PIN, LOW);
-      ledInfo.status = 1;
-      client.publish((preStrMon + String("led")).c_str(), "on");
-    }
-    else if (messageTemp == "off")
-    {
-      Serial.println("off");
-      digitalWrite(LED_PIN, HIGH);
-      ledInfo.status = 0;
-      client.publish((preStrMon + String("led")).c_str(), "off");
-    }
+    LOG_W("Message arrived on unknown topic: %s", topic);
+    return;
   }
-  else if (topicString == (preStrCon + String("water")))
+  diagEnter(DIAG_LOOP_NETWORK);
+  if (route->echo)
   {
-    Serial.print(F("Changing water output: "));
-    if (messageTemp == "on")
-    {
-      openWaterPump();
-      if (lowWaterCheck)
-      {
-        client.publish((preStrMon + String("waterlevel")).c_str(), String(!lowWaterCheck).c_str());
-        client.publish((preStrMon + String("water")).c_str(), "off");
-        waterInfo.status = 0;
-      }
-      else
-      {
-        client.publish((preStrMon + String("water")).c_str(), "on");
-        waterInfo.status = 1;
-      }
-    }
-    else if (messageTemp == "off")
-    {
-      Serial.println("off");
-      digitalWrite(PUMP_PIN, HIGH);
-      client.publish((preStrMon + String("water")).c_str(), "off");
-      waterInfo.status = 0;
-    }
+    LOG_I("Message arrived on topic: %s  Message: %.*s", topic, (int)length, (const char *)message);
   }
-  else if (topicString == (preStrCon + String("calendar")))
+  else
   {
-    if (messageTemp == "reset")
-    {
-      Serial.println(F("Reseting calendars:"));
-      waterInfo.length = 0;
-      fanInfo.length = 0;
-      ledInfo.length = 0;
-      lampInfo.length = 0;
-      preferences.begin("doa", false);
-      preferences.clear();
-      preferences.end();
-    }
+    LOG_I("Message arrived on topic: %s  (%u bytes)", topic, length);
   }
-  else if (topicString == (preStrCon + String("datetime")))
+
+  route->handler(route->type, message, length);
+  diagLeave(DIAG_LOOP_NETWORK, DIAG_CAUSE_MQTT_IN);
+}
+
+//<actuator>: on/off
+void onActuatorTopic(uint8_t type, const byte *message, unsigned int length)
+{
+  if (payloadIs(message, length, "on"))
   {
-    Serial.println(F("Adjust RTC datetime: "));
-    DateTime newDateTime = DateTime(messageTemp.c_str());
-    if (newDateTime > DateTime("2021-08-22T07:30:00"))
-    {
-      rtc.adjust(newDateTime);
-      //Serial.println(newDateTime.toString("yyyy-MM-ddTHH:mm:ss"));
-      Serial.println(F(" =>Datetime is adjusted."));
-    }
-    else
-    {
-      Serial.println(F(" =>Requested date is expired"));
-    }
+    LOG_I("Changing %s output: on", actuatorName(type));
+    sendControlCommand(CMD_ACTUATOR, type, 1, 0);
   }
-  else if (topicString == (preStrCon + String("water_calendar")))
+  else if (payloadIs(message, length, "off"))
   {
-    Serial.println(F("Water Calendar Output: "));
-    waterInfo.length = jsonCalendarParse((char *)message, length, waterCalendar);
-    if (waterInfo.length > 0)
-    {
-      waterInfo.index = 0;
-      preferences.begin("doa", false);
-      preferences.putUShort("waterLength", waterInfo.length);
-      preferences.putBytes("water", waterCalendar, waterInfo.length * sizeof(calendar));
-      preferences.end();
-    }
+    LOG_I("Changing %s output: off", actuatorName(type));
+    sendControlCommand(CMD_ACTUATOR, type, 0, 0);
   }
-  else if (topicString == (preStrCon + String("fan_calendar")))
+}
+
+//calendar: reset, or release (group calendars replace device ones again), device topic only
+void onCalendarTopic(uint8_t type, const byte *message, unsigned int length)
+{
+  if (messageSource != 0)
   {
-    Serial.println(F("Fan Calendar Output: "));
-    fanInfo.length = jsonCalendarParse((char *)message, length, fanCalendar);
-    if (fanInfo.length > 0)
-    {
-      fanInfo.index = 0;
-      preferences.begin("doa", false);
-      preferences.putUShort("fanLength", fanInfo.length);
-      preferences.putBytes("fan", fanCalendar, fanInfo.length * sizeof(calendar));
-      preferences.end();
-    }
+    LOG_W("calendar command ignored on a group topic");
+    return;
   }
-  else if (topicString == (preStrCon + String("led_calendar")))
+  if (payloadIs(message, length, "reset"))
   {
-    Serial.println(F("Led Calendar Output: "));
-    ledInfo.length = jsonCalendarParse((char *)message, length, ledCalendar);
-    if (ledInfo.length > 0)
-    {
-      ledInfo.index = 0;
-      preferences.begin("doa", false);
-      preferences.putUShort("ledLength", ledInfo.length);
-      preferences.putBytes("led", ledCalendar, ledInfo.length * sizeof(calendar));
-      preferences.end();
-    }
+    controllerResetCalendars();
+    sendControlCommand(CMD_CALENDAR_UPDATED, CALENDAR_ALL, 0, 0);
   }
-  else if (topicString == (preStrCon + String("lamp_calendar")))
+  else if (payloadIs(message, length, "release"))
   {
-    Serial.println(F("Lamp Calendar Output: "));
-    lampInfo.length = jsonCalendarParse((char *)message, length, lampCalendar);
-    if (lampInfo.length > 0)
-    {
-      lampInfo.index = 0;
-      preferences.begin("doa", false);
-      preferences.putUShort("lampLength", lampInfo.length);
-      preferences.putBytes("lamp", lampCalendar, lampInfo.length * sizeof(calendar));
-      preferences.end();
-    }
+    controllerReleaseCalendars();
   }
 }
 
-void reconnect()
+//datetime: ISO 8601, e.g. 2021-08-22T07:30:00
+void onDatetimeTopic(uint8_t type, const byte *message, unsigned int length)
 {
-  delay(5000);
-  mqttStatus = false;
-  if (WiFi.status() == WL_CONNECTED)
+  char text[25];
+
+  LOG_I("Adjust RTC datetime: ");
+  if (length >= sizeof(text))
   {
-    if (!client.connected())
-    {
-      //digitalWrite(BLUE_LED, LOW);
-      Serial.print(F("Attempting MQTT connection..."));
-      // Attempt to connect
-      if (client.connect(deviceID))
-      {
-        Serial.println(F("connected"));
-        // Subscribe
-        String subscribeStr = String("doa/") + String(deviceID) + String("/control/#"); //client.subscribe("doa/dev123/control/#");
-        client.subscribe(subscribeStr.c_str());
-
-        mqttStatus = true;
-        publishStatus(&waterInfo);
-        publishStatus(&fanInfo);
-        publishStatus(&ledInfo);
-        publishStatus(&lampInfo);
-      }
-      else
-      {
-        Serial.print(F("failed, rc="));
-        Serial.print(client.state());
-      }
-    }
+    return;
+  }
+  memcpy(text, message, length);
+  text[length] = '\0';
+  DateTime newDateTime = DateTime(text);
+  if (newDateTime > DateTime("2021-08-22T07:30:00"))
+  {
+    //The RTC belongs to the control task
+    sendControlCommand(CMD_SET_DATETIME, 0, 0, newDateTime.unixtime());
+  }
+  else
+  {
+    LOG_W(" =>Requested date is expired");
   }
 }
 
-uint32_t readADCCal(int ADC_Raw)
-{
-  esp_adc_cal_characteristics_t adc_chars;
-
-  esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, 1100, &adc_chars);
-  return (esp_adc_cal_raw_to_voltage(ADC_Raw, &adc_chars));
-}
-
-uint32_t calculateAvg(int sample)
+//utc_offset: seconds local time is ahead of UTC ("10800", "-18000"), applied to SNTP, see time_service.h
+void onUtcOffsetTopic(uint8_t type, const byte *message, unsigned int length)
 {
-  int i = 0;
-  uint32_t sum = 0;
+  char text[12];
+  char *end;
 
-  adcBuffer[filterIndex++] = sample;
-  if (filterIndex == FILTER_LEN)
+  if (length == 0 || length >= sizeof(text))
   {
-    filterIndex = 0;
+    return;
   }
-  for (i = 0; i < FILTER_LEN; i++)
+  memcpy(text, message, length);
+  text[length] = '\0';
+  long offset = strtol(text, &end, 10);
+  if (*end != '\0' || offset < -TIME_UTC_OFFSET_MAX || offset > TIME_UTC_OFFSET_MAX)
   {
-    sum += adcBuffer[i];
+    LOG_W("Invalid UTC offset");
+    return;
   }
-  return (sum / FILTER_LEN);
+  sendControlCommand(CMD_UTC_OFFSET, 0, 0, (uint32_t)(int32_t)offset); //The clock belongs to the control task
 }
 
-void sort_calendar(calendar *cal, uint16_t length)
+//<actuator>_calendar: JSON calendar, may be chunked
+void onCalendarUploadTopic(uint8_t type, const byte *message, unsigned int length)
 {
-  calendar temp;
-  //Sort the array in ascending order
-  for (int i = 0; i < length; i++)
-  {
-    for (int j = i + 1; j < length; j++)
-    {
-      if (cal[i].dayofmin > cal[j].dayofmin)
-      {
-        temp = cal[i];
-        cal[i] = cal[j];
-        cal[j] = temp;
-      }
-    }
-  }
+  LOG_D("%s Calendar Output: ", actuatorName(type));
+  calendarUploadChunk(controllerCalendar(type), (const char *)message, length);
 }
 
-uint16_t jsonCalendarParse(const char *input, unsigned int inputLength, calendar *itemCalendar)
+//<actuator>_calendar_bin: binary calendar delta
+void onCalendarBinaryTopic(uint8_t type, const byte *message, unsigned int length)
 {
-  Serial.println(F("Json Calendar Parse Started:"));
-  DeserializationError error = deserializeJson(doc, input, inputLength);
+  calendarBinaryUpdate(controllerCalendar(type), message, length);
+}
 
-  if (error)
+//groups: comma separated group names, "" leaves all groups. Device topic only.
+void onGroupsTopic(uint8_t type, const byte *message, unsigned int length)
+{
+  if (messageSource != 0)
   {
-    Serial.print(F("deserializeJson() failed: "));
-    Serial.println(error.f_str());
-    return 0;
+    LOG_W("groups ignored on a group topic");
+    return;
   }
+  char before[GROUPS_MAX * GROUP_NAME_MAX], after[GROUPS_MAX * GROUP_NAME_MAX];
 
-  uint16_t i = 0, j = 0;
-  for (JsonObject calendarItem : doc["calendar"].as<JsonArray>())
+  groupsFormat(before, sizeof(before));
+  if (!groupsSet((const char *)message, length))
   {
-    uint16_t dayofweek = calendarItem["dofw"];
-    uint16_t hour = calendarItem["h"];
-    uint16_t minute = calendarItem["m"];
-    uint16_t repeat = calendarItem["r"];
-    uint16_t action = calendarItem["a"];
-    Serial.printf("dayofweek:%d, hour:%d, minute:%d, repeat:%d, action:%d\n", dayofweek, hour, minute, repeat, action);
-    if (i < CALENDAR_SIZE && hour < 24 && minute < 60 && action < 2)
-    {
-      //repeat, 0: Haftanın bir günü, 1: Her gün, 2:Hafta içi, 3:Hafta sonu
-      if (repeat == 0) //0: Haftanın bir günü
-      {
-        itemCalendar[i].dayofmin = 1440 * dayofweek + 60 * hour + minute;
-        itemCalendar[i].action = action;
-#ifdef DEBUG
-        Serial.printf(" =>Index:%d, Dayofmin:%d, action:%d\n", i, itemCalendar[i].dayofmin, itemCalendar[i].action);
-#endif
-        i++;
-      }
-      else if (repeat == 1) //1: haftanın her günü
-      {
-        for (j = 0; j < 7 && i < CALENDAR_SIZE; j++)
-        {
-          itemCalendar[i].dayofmin = 1440 * j + 60 * hour + minute;
-          itemCalendar[i].action = action;
-#ifdef DEBUG
-          Serial.printf(" =>Index:%d, Dayofmin:%d, action:%d\n", i, itemCalendar[i].dayofmin, itemCalendar[i].action);
-#endif
-          i++;
-        }
-      }
-      else if (repeat == 2) //2:Hafta içi günler
-      {
-        for (j = 1; j < 6 && i < CALENDAR_SIZE; j++)
-        {
-          itemCalendar[i].dayofmin = 1440 * j + 60 * hour + minute;
-          itemCalendar[i].action = action;
-#ifdef DEBUG
-          Serial.printf(" =>Index:%d, Dayofmin:%d, action:%d\n", i, itemCalendar[i].dayofmin, itemCalendar[i].action);
-#endif
-          i++;
-        }
-      } //3:Hafta sonu günler
-      else if (repeat == 3)
-      {
-        for (j = 0; j < 7 && i < CALENDAR_SIZE; j = j + 6) //j=0 Pazar,  j=6 Cumartesi
-        {
-          itemCalendar[i].dayofmin = 1440 * j + 60 * hour + minute;
-          itemCalendar[i].action = action;
-#ifdef DEBUG
-          Serial.printf(" =>Index:%d, Dayofmin:%d, action:%d\n", i, itemCalendar[i].dayofmin, itemCalendar[i].action);
-#endif
-          i++;
-        }
-      }
-    }
+    LOG_W("Invalid group list");
   }
-
-  uint16_t itemCalendarLength = i;
-  sort_calendar(itemCalendar, itemCalendarLength);
-  Serial.print(F("### SORT itemCalendar, itemCalendarLength="));
-  Serial.println(itemCalendarLength);
-  for (i = 0; i < itemCalendarLength; i++)
+  groupsFormat(after, sizeof(after));
+  //The topic may be retained, it arrives again after every resubscribe
+  if (strcmp(before, after) != 0)
   {
-    Serial.printf(" ==>Index:%d, Dayofmin:%d, action:%d\n", i, itemCalendar[i].dayofmin, itemCalendar[i].action);
+    LOG_I("Groups: %s", after[0] ? after : "none");
+    setMqttFilters();
   }
-  return itemCalendarLength;
+  publishGroups();
 }
 
-bool isDateEqualCalendar(const DateTime &dt, uint16_t calendarItem)
+//Called by the MQTT link once the subscription is done
+void onMqttConnected()
 {
-  uint16_t minuteOfWeek = 1440 * dt.dayOfTheWeek() + 60 * dt.hour() + dt.minute();
-  return (minuteOfWeek == calendarItem);
+  otaConfirm();
+  historyReplay(timeNow()); //What the outbox could not keep, monitor/history
+  sendControlCommand(CMD_PUBLISH_STATUS, 0, 0, 0);
+  publishGroups();
+  publishOtaStatus();
+  publishTelemetryConfig();
 }
 
-void calendarPerformAction(DateTime nowDate, calendarInfo *itemInfo, calendar *itemCalendar)
+//ota: firmware manifest or abort, see ota.h
+void onOtaTopic(uint8_t type, const byte *message, unsigned int length)
 {
-  uint8_t action;
-  for (int i = itemInfo->index; i < itemInfo->length; i++)
+  if (otaManifest((const char *)message, length))
   {
-    if (isDateEqualCalendar(nowDate, itemCalendar[i].dayofmin))
-    {
-      itemInfo->index = i + 1;
-      action = (itemCalendar[i].action > 0) ? LOW : HIGH; //LOW: Open, HIGH:Close
-      if (itemInfo->actionPin == PUMP_PIN)
-      {
-        //Sulama komutu geldi ve yeterli su var ise
-        if (itemCalendar[i].action == 1)
-        {
-          openWaterPump();
-        }
-        else
-        {
-          digitalWrite(PUMP_PIN, HIGH);
-          Serial.println(F("Close Pump"));
-          itemInfo->status = 0;
-        }
-      }
-      else //if (itemInfo->actionPin == FAN_PIN)
-      {
-        digitalWrite(itemInfo->actionPin, action);
-        itemInfo->status = itemCalendar[i].action;
-      }
-      publishStatus(itemInfo);
-      Serial.printf("  *Action performed.Index=%d, Action:%d, Pin:%d\n", itemInfo->index, itemCalendar[i].action, itemInfo->actionPin);
-    }
+    publishOtaStatus();
   }
 }
 
-void publishStatus(calendarInfo *itemInfo)
+//ota_data: one compressed image chunk
+void onOtaDataTopic(uint8_t type, const byte *message, unsigned int length)
 {
-  if (mqttStatus)
+  if (otaChunk(message, length))
   {
-    String typeStr;
-
-    switch (itemInfo->type)
-    {
-    case WATER:
-      typeStr = String("water");
-      break;
-    case FAN:
-      typeStr = String("fan");
-      break;
-    case LED:
-      typeStr = String("led");
-      break;
-    case LAMP:
-      typeStr = String("lamp");
-      break;
-    default:
-      break;
-    }
-
-    //Publish  status
-    if (itemInfo->status == 0)
-    {
-      client.publish((preStrMon + typeStr).c_str(), "off");
-    }
-    else
-    {
-      client.publish((preStrMon + typeStr).c_str(), "on");
-    }
+    publishOtaStatus(); //next chunk index, the backend paces the download on it
   }
 }
 
-bool isLowWater()
+//history: "<from> <to>" in unix seconds, <to> defaults to now. The blocks arrive on monitor/history.
+//Device topic only.
+void onHistoryTopic(uint8_t type, const byte *message, unsigned int length)
 {
-  int status = 0;
-  int lowWater1 = digitalRead(LOW_WATER_PIN);
-  delay(DEBOUNCE_DELAY); //Delay 30ms for debounce
-  int lowWater2 = digitalRead(LOW_WATER_PIN);
-  if (lowWater1 == lowWater2 && lowWater1 == HIGH)
+  char text[24];
+  unsigned long from, to = timeNow();
+
+  if (messageSource != 0 || length >= sizeof(text)) //Not every member of a group at once
   {
-    //lowWater1 = 0 durumunda şamandıra boş konumunda
-    status = false;
+    return;
   }
-  else
+  memcpy(text, message, length);
+  text[length] = '\0';
+  if (sscanf(text, "%lu %lu", &from, &to) < 1 || from > to)
   {
-    status = true;
+    LOG_W("Invalid history range");
+    return;
   }
-  return status;
+  historyQuery(from, to);
 }
 
-int openWaterPump()
+//telemetry: report by exception thresholds, see telemetrySetConfig(). From a group topic too, the last
+//message wins.
+void onTelemetryTopic(uint8_t type, const byte *message, unsigned int length)
 {
-  int status;
-
-  lowWaterCheck = isLowWater();
-  if (lowWaterCheck)
+  if (!telemetrySetConfig((const char *)message, length))
   {
-    digitalWrite(PUMP_PIN, HIGH); //Close the pump
-    Serial.println(F("  Low water alarm. Not starting Pump"));
-    status = 0;
-    waterInfo.status = 0;
+    LOG_W("Invalid telemetry thresholds");
   }
-  else
+  publishTelemetryConfig();
+}
+
+//Device control topics first, the link requires it
+void setMqttFilters()
+{
+  uint8_t count = 0;
+
+  mqttFilters[count++] = subscribeTopic;
+  for (uint8_t i = 0; i < groupCount(); i++)
   {
-    Serial.println("Pump on");
-    digitalWrite(PUMP_PIN, LOW); //Open the pump
-    status = 1;
-    waterInfo.status = 1;
+    mqttFilters[count++] = groupFilter(i);
   }
-
-  return status;
+  mqttLinkSetFilters(mqttFilters, count);
 }
 
-void readSavedData()
+//monitor/groups, retained so the backend can tell the members of a group
+void publishGroups()
 {
-  preferences.begin("doa", false);
-  waterInfo.index = 0;
-  waterInfo.actionPin = PUMP_PIN;
-  waterInfo.status = 0;
-  waterInfo.type = WATER;
-  waterInfo.length = preferences.getUShort("waterLength", 0);
+  char payload[GROUPS_MAX * GROUP_NAME_MAX];
 
-  fanInfo.index = 0;
-  fanInfo.actionPin = FAN_PIN;
-  fanInfo.status = 0;
-  fanInfo.type = FAN;
-  fanInfo.length = preferences.getUShort("fanLength", 0);
+  groupsFormat(payload, sizeof(payload));
+  mqttLinkPublish(monitorTopic(TOPIC_GROUPS), payload, MQTT_QOS1 | MQTT_RETAIN);
+}
 
-  ledInfo.index = 0;
-  ledInfo.actionPin = LED_PIN;
-  ledInfo.status = 0;
-  ledInfo.type = LED;
-  ledInfo.length = preferences.getUShort("ledLength", 0);
+//monitor/telemetry, retained
+void publishTelemetryConfig()
+{
+  char payload[TELEMETRY_CONFIG_MAX];
 
-  lampInfo.index = 0;
-  lampInfo.actionPin = LAMP_PIN;
-  lampInfo.status = 0;
-  lampInfo.type = LAMP;
-  lampInfo.length = preferences.getUShort("lampLength", 0);
+  telemetryFormatConfig(payload, sizeof(payload));
+  mqttLinkPublish(monitorTopic(TOPIC_TELEMETRY), payload, MQTT_QOS1 | MQTT_RETAIN);
+}
 
-  Serial.printf("waterLength:%d, fanLength:%d, ledLength:%d, lampLength:%d\n",
-                waterInfo.length, fanInfo.length, ledInfo.length, lampInfo.length);
+//monitor/ota, retained
+void publishOtaStatus()
+{
+  char payload[128];
 
-  if (waterInfo.length > 0)
+  if (otaFormatStatus(payload, sizeof(payload)) > 0)
   {
-    preferences.getBytes("water", waterCalendar, waterInfo.length * sizeof(calendar));
+    mqttLinkPublish(monitorTopic(TOPIC_OTA), payload, MQTT_QOS1 | MQTT_RETAIN);
   }
-  if (fanInfo.length > 0)
+}
+
+//Network task. A calendar may arrive in several MQTT messages on the same topic, the document is
+//complete when its top level object closes. Chunks from the device topic and a group topic must not
+//mix, a new source restarts the upload.
+void calendarUploadChunk(calendarInfo *itemInfo, const char *input, unsigned int inputLength)
+{
+  calendarUpload **slot = &calendarUploads[itemInfo->type - 1];
+  calendarUpload *upload = *slot;
+
+  if (upload != NULL && (millis() - upload->lastChunk > CALENDAR_CHUNK_TIMEOUT || upload->source != messageSource))
   {
-    preferences.getBytes("fan", fanCalendar, fanInfo.length * sizeof(calendar));
+    LOG_W("Unfinished calendar upload dropped");
+    calendarUploadAbort(upload);
+    free(upload);
+    upload = *slot = NULL;
   }
-  if (ledInfo.length > 0)
+  if (upload == NULL)
   {
-    preferences.getBytes("led", ledCalendar, ledInfo.length * sizeof(calendar));
+    upload = (calendarUpload *)malloc(sizeof(calendarUpload));
+    if (upload == NULL)
+    {
+      LOG_E("No memory for a calendar upload");
+      return;
+    }
+    LOG_I("Json Calendar Parse Started:");
+    calendarUploadBegin(upload);
+    upload->source = messageSource;
+    *slot = upload;
   }
-  if (lampInfo.length > 0)
+  upload->lastChunk = millis();
+
+  uint8_t result = calendarUploadFeed(upload, input, inputLength);
+  if (result == CALENDAR_PARSE_BUSY)
   {
-    preferences.getBytes("lamp", lampCalendar, lampInfo.length * sizeof(calendar));
+    LOG_D("Calendar chunk received, %d rules so far", upload->length);
+    return;
   }
 
-  Serial.println(F("=== Read stored calendar values ==="));
-  int i;
-
-  Serial.println(F(" =>Water caledar values ==="));
-  for (i = 0; i < waterInfo.length; i++)
+  *slot = NULL;
+  if (result == CALENDAR_PARSE_DONE && !controllerAcceptsCalendar(itemInfo->type, upload->parser.version, messageSource != 0))
   {
-    Serial.printf("%d, %d - ", waterCalendar[i].dayofmin, waterCalendar[i].action);
+    LOG_I("%s group calendar v%u ignored, v%u%s installed", actuatorName(itemInfo->type), upload->parser.version,
+          itemInfo->version, itemInfo->deviceOverride ? " of the device" : "");
+    free(upload->rules);
   }
-
-  Serial.println();
-  Serial.println(F(" =>Fan caledar values ==="));
-  for (i = 0; i < fanInfo.length; i++)
+  else if (result == CALENDAR_PARSE_DONE)
   {
-    Serial.printf("%d, %d - ", fanCalendar[i].dayofmin, fanCalendar[i].action);
+    calendarRule *rules = upload->rules;
+    if (upload->length == 0)
+    {
+      free(rules);
+      rules = NULL;
+    }
+    else if (upload->length < upload->capacity)
+    {
+      calendarRule *shrunk = (calendarRule *)realloc(rules, upload->length * sizeof(calendarRule));
+      if (shrunk != NULL)
+      {
+        rules = shrunk;
+      }
+    }
+    updateCalendar(itemInfo, rules, upload->length, upload->parser.version);
   }
-
-  Serial.println();
-  Serial.println(F(" =>Led caledar values ==="));
-  for (i = 0; i < ledInfo.length; i++)
+  else
   {
-    Serial.printf("%d, %d - ", ledCalendar[i].dayofmin, ledCalendar[i].action);
+    free(upload->rules); //Keep the previous calendar
   }
+  free(upload);
+}
+
+//Network task. Applies a binary calendar message, see calendar_delta.h. A rejected delta leaves the
+//calendar as it is and the current version is published so the backend can resend.
+void calendarBinaryUpdate(calendarInfo *itemInfo, const uint8_t *data, unsigned int dataLength)
+{
+  calendarDelta delta;
+  calendarRule *rules;
+  uint16_t length;
 
-  Serial.println();
-  Serial.println(F(" =>Lamp caledar values ==="));
-  for (i = 0; i < lampInfo.length; i++)
+  uint8_t result = calendarDeltaDecode(data, dataLength, &delta);
+  if (result == CALENDAR_DELTA_OK && !controllerAcceptsCalendar(itemInfo->type, delta.newVersion, messageSource != 0))
+  {
+    LOG_I("%s group calendar v%u ignored, v%u%s installed", actuatorName(itemInfo->type), delta.newVersion,
+          itemInfo->version, itemInfo->deviceOverride ? " of the device" : "");
+    return;
+  }
+  if (result == CALENDAR_DELTA_OK)
+  {
+    //Only this task replaces rules, reading them without the mutex is safe
+    result = calendarDeltaApply(&delta, itemInfo->source, itemInfo->sourceLength, itemInfo->version, &rules, &length);
+  }
+  if (result != CALENDAR_DELTA_OK)
   {
-    Serial.printf("%d, %d - ", lampCalendar[i].dayofmin, lampCalendar[i].action);
+    LOG_W("%s calendar delta rejected at v%u, error %d", actuatorName(itemInfo->type), itemInfo->version, result);
+    publishCalendarVersion(itemInfo);
+    return;
   }
 
-  preferences.end();
+  LOG_I("%s calendar v%u -> v%u, %d rules", actuatorName(itemInfo->type), itemInfo->version, delta.newVersion, length);
+  updateCalendar(itemInfo, rules, length, delta.newVersion);
+}
+
+//Network task. Swaps the new rules in and persists them, the control task re-evaluates.
+void updateCalendar(calendarInfo *itemInfo, calendarRule *rules, uint16_t length, uint16_t version)
+{
+  controllerSetCalendar(itemInfo->type, rules, length, version, messageSource == 0);
+  sendControlCommand(CMD_CALENDAR_UPDATED, itemInfo->type, 0, 0);
+  publishCalendarVersion(itemInfo);
+}
 
-  // === jsonCalendarParse Test ====
-  // const char *input = "{\"calendar\":[{\"dofw\":1,\"h\":22,\"m\":26,\"r\":0,\"a\":1},{\"dofw\":1,\"h\":22,\"m\":27,\"r\":0,\"a\":0},{\"dofw\":1,\"h\":22,\"m\":28,\"r\":0,\"a\":1},{\"dofw\":1,\"h\":22,\"m\":29,\"r\":0,\"a\":0},{\"dofw\":1,\"h\":22,\"m\":30,\"r\":0,\"a\":1},{\"dofw\":1,\"h\":22,\"m\":31,\"r\":0,\"a\":0},{\"dofw\":1,\"h\":22,\"m\":32,\"r\":0,\"a\":1},{\"dofw\":1,\"h\":22,\"m\":33,\"r\":0,\"a\":0}]}";
-  // waterInfo.length = jsonCalendarParse(input, strlen(input), waterCalendar);
-  // waterInfo.index = 0;
+//Network task. Acknowledges the calendar version on monitor/<x>_calendar_version
+void publishCalendarVersion(calendarInfo *itemInfo)
+{
+  char payload[8];
+
+  snprintf(payload, sizeof(payload), "%u", itemInfo->version);
+  mqttLinkPublish(monitorTopic(TOPIC_CALENDAR_VERSION + itemInfo->type - 1), payload, MQTT_QOS1 | MQTT_RETAIN);
+}
+
+//Debounce timer ISR context
+void onWaterLevelChange(bool lowWater)
+{
+  controlCommand command = {CMD_WATER_LEVEL, 0, (uint8_t)lowWater, 0};
+  BaseType_t woken = pdFALSE;
+
+  xQueueSendFromISR(commandQueue, &command, &woken);
+  if (woken)
+  {
+    portYIELD_FROM_ISR();
+  }
 }
 
 void getDateString(char *dateBuffer, const DateTime &dt)
@@ -0,0 +1,666 @@
+#include "mqtt_link.h"
+#include "mqtt_outbox.h"
+#include "logger.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "lwip/dns.h"
+
+#define DNS_IDLE 0
+#define DNS_PENDING 1
+#define DNS_DONE 2
+#define DNS_FAILED 3
+
+typedef struct
+{
+  const char *host;
+  uint16_t port;
+  const char *clientId;
+  const char *filters[MQTT_FILTERS_MAX];
+  uint8_t filterCount;
+  bool cleanSession; //next CONNECT, after the filters changed
+  uint16_t keepAlive; //s
+  mqttMessageCallback onMessage;
+  mqttLinkCallback onConnected;
+
+  uint8_t state;
+  int sockfd;
+  IPAddress brokerIP;
+  bool brokerResolved;
+  unsigned long resolvedTime;
+  uint8_t connectFailures; //TCP connects in a row since the address was resolved
+  unsigned long stateTime;
+  unsigned long backoffDelay;
+  uint8_t attempt;
+  uint32_t reconnectCount;
+  uint32_t droppedCount; //QoS1 messages the outbox refused
+
+  uint16_t packetId;    //last one used
+  unsigned long lastTx; //keepalive: a packet is due within keepAlive of the last one sent
+  unsigned long pingTime;
+  bool pingOutstanding;
+  size_t rxLength, txLength;
+  uint32_t rxSkip; //rest of a packet larger than the receive buffer
+} mqttLink;
+
+static mqttLink conn;
+static uint8_t dnsState; //written by the lwip callback, DNS_*
+static uint32_t dnsAddress;
+static uint8_t rxBuffer[MQTT_BUFFER_SIZE];
+static uint8_t txBuffer[MQTT_TX_BUFFER];
+
+static void enterState(uint8_t state)
+{
+  conn.state = state;
+  conn.stateTime = millis();
+}
+
+//Drops the connection. The outbox keeps what was not acknowledged for the next session.
+static void closeSocket()
+{
+  if (conn.sockfd >= 0)
+  {
+    lwip_close(conn.sockfd);
+    conn.sockfd = -1;
+  }
+  conn.rxLength = 0;
+  conn.txLength = 0;
+  conn.rxSkip = 0;
+  conn.pingOutstanding = false;
+  mqttOutboxRequeue();
+}
+
+static uint16_t nextPacketId()
+{
+  if (++conn.packetId == 0)
+  {
+    conn.packetId = 1;
+  }
+  return conn.packetId;
+}
+
+//Space left in the send buffer for a packet, written with the next sendBuffered()
+static uint8_t *txSpace(size_t *size)
+{
+  *size = sizeof(txBuffer) - conn.txLength;
+  return txBuffer + conn.txLength;
+}
+
+static void txAppend(size_t length)
+{
+  conn.txLength += length;
+}
+
+//One send for everything buffered. False if the connection failed.
+static bool sendBuffered()
+{
+  if (conn.txLength == 0)
+  {
+    return true;
+  }
+  int sent = lwip_send(conn.sockfd, txBuffer, conn.txLength, MSG_DONTWAIT);
+  if (sent < 0)
+  {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+  memmove(txBuffer, txBuffer + sent, conn.txLength - sent);
+  conn.txLength -= sent;
+  conn.lastTx = millis();
+  return true;
+}
+
+//Equal jitter: half of the exponential step is fixed, the other half random.
+//Devices restarted by the same broker outage spread out instead of retrying in lockstep.
+static void startBackoff()
+{
+  unsigned long ceiling = MQTT_BACKOFF_BASE;
+  for (uint8_t i = 0; i < conn.attempt && ceiling < MQTT_BACKOFF_MAX; i++)
+  {
+    ceiling *= 2;
+  }
+  if (ceiling > MQTT_BACKOFF_MAX)
+  {
+    ceiling = MQTT_BACKOFF_MAX;
+  }
+  conn.backoffDelay = ceiling / 2 + esp_random() % (ceiling / 2 + 1);
+  if (conn.attempt < 31)
+  {
+    conn.attempt++;
+  }
+  closeSocket();
+  LOG_I("MQTT retry in %lu ms", conn.backoffDelay);
+  enterState(MQTT_LINK_BACKOFF);
+}
+
+//tcpip task
+static void onDnsFound(const char *name, const ip_addr_t *ipaddr, void *arg)
+{
+  if (ipaddr != NULL)
+  {
+    dnsAddress = ipaddr->u_addr.ip4.addr;
+  }
+  __atomic_store_n(&dnsState, ipaddr != NULL ? DNS_DONE : DNS_FAILED, __ATOMIC_RELEASE);
+}
+
+//0: still resolving, 1: conn.brokerIP is set, -1: failed. Starts a lookup if none is pending.
+static int pollResolve()
+{
+  uint8_t state = __atomic_load_n(&dnsState, __ATOMIC_ACQUIRE);
+
+  if (state == DNS_IDLE)
+  {
+    ip_addr_t addr;
+    __atomic_store_n(&dnsState, DNS_PENDING, __ATOMIC_RELAXED);
+    err_t err = dns_gethostbyname(conn.host, &addr, onDnsFound, NULL);
+    if (err == ERR_INPROGRESS)
+    {
+      return 0;
+    }
+    __atomic_store_n(&dnsState, DNS_IDLE, __ATOMIC_RELAXED);
+    if (err != ERR_OK)
+    {
+      return -1;
+    }
+    conn.brokerIP = addr.u_addr.ip4.addr; //Cached or an address literal
+    return 1;
+  }
+  if (state == DNS_PENDING)
+  {
+    return 0;
+  }
+  __atomic_store_n(&dnsState, DNS_IDLE, __ATOMIC_RELAXED);
+  if (state == DNS_FAILED)
+  {
+    return -1;
+  }
+  conn.brokerIP = dnsAddress;
+  return 1;
+}
+
+//The address is kept over reconnects, a new lookup only after repeated failures or MQTT_DNS_TTL
+static bool resolveDue()
+{
+  return !conn.brokerResolved || conn.connectFailures >= MQTT_DNS_RETRY_FAILURES ||
+         millis() - conn.resolvedTime > MQTT_DNS_TTL;
+}
+
+static bool startTcpConnect()
+{
+  struct sockaddr_in addr;
+
+  conn.sockfd = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (conn.sockfd < 0)
+  {
+    return false;
+  }
+  fcntl(conn.sockfd, F_SETFL, fcntl(conn.sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(conn.port);
+  addr.sin_addr.s_addr = (uint32_t)conn.brokerIP;
+
+  if (lwip_connect(conn.sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+  {
+    closeSocket();
+    return false;
+  }
+  return true;
+}
+
+//0: still connecting, 1: connected, -1: failed
+static int pollTcpConnect()
+{
+  fd_set writeSet;
+  struct timeval timeout = {0, 0};
+  int sockError = 0;
+  socklen_t len = sizeof(sockError);
+
+  FD_ZERO(&writeSet);
+  FD_SET(conn.sockfd, &writeSet);
+  if (select(conn.sockfd + 1, NULL, &writeSet, NULL, &timeout) <= 0)
+  {
+    return 0;
+  }
+  if (getsockopt(conn.sockfd, SOL_SOCKET, SO_ERROR, &sockError, &len) < 0 || sockError != 0)
+  {
+    return -1;
+  }
+  return 1;
+}
+
+static uint16_t readU16(const uint8_t *at)
+{
+  return (uint16_t)(at[0] << 8 | at[1]);
+}
+
+static void sendSubscribe()
+{
+  size_t size;
+  uint8_t *packet = txSpace(&size);
+
+  txAppend(mqttSubscribePacket(packet, size, nextPacketId(), conn.filters, conn.filterCount, 1));
+}
+
+static void sendAck(uint16_t packetId)
+{
+  size_t size;
+  uint8_t *packet = txSpace(&size);
+
+  //A PUBACK that does not fit is not sent, the broker repeats the message in the next session
+  if (size >= 4)
+  {
+    txAppend(mqttAckPacket(packet, MQTT_PUBACK, packetId));
+  }
+}
+
+//PUBLISH from the broker. The topic is moved one byte back over its length to terminate it in place.
+static void receivePublish(uint8_t flags, uint8_t *body, uint32_t length)
+{
+  uint16_t topicLength = readU16(body);
+  uint32_t offset = 2 + topicLength + ((flags & MQTT_QOS1) ? 2 : 0);
+
+  if (offset > length)
+  {
+    return;
+  }
+  uint16_t packetId = (flags & MQTT_QOS1) ? readU16(body + 2 + topicLength) : 0;
+  memmove(body + 1, body + 2, topicLength);
+  body[1 + topicLength] = 0;
+  if (conn.onMessage != NULL)
+  {
+    conn.onMessage((char *)body + 1, body + offset, length - offset);
+  }
+  if (flags & MQTT_QOS1)
+  {
+    sendAck(packetId); //After the handler: a reset in between gets the message again
+  }
+}
+
+//One complete packet. False if the session has to be dropped.
+static bool receivePacket(uint8_t type, uint8_t *body, uint32_t length)
+{
+  switch (type & 0xF0)
+  {
+  case MQTT_CONNACK:
+    if (conn.state != MQTT_LINK_MQTT_CONNECT || length < 2 || body[1] != 0)
+    {
+      LOG_W("MQTT connect failed, rc=%d", length < 2 ? -1 : body[1]);
+      return false;
+    }
+    LOG_I("MQTT connected%s", (body[0] & 0x01) ? ", session resumed" : "");
+    conn.attempt = 0;
+    conn.reconnectCount++;
+    if (conn.filterCount == 0)
+    {
+      enterState(MQTT_LINK_PUBLISH_STATE);
+      break;
+    }
+    sendSubscribe(); //Also with a resumed session, it is cheap
+    enterState(MQTT_LINK_SUBSCRIBE);
+    break;
+
+  case MQTT_SUBACK:
+    if (conn.state == MQTT_LINK_SUBSCRIBE)
+    {
+      //The first filter is required, the broker may refuse the others
+      if (length < 3 || body[2] == 0x80)
+      {
+        LOG_E("MQTT subscribe refused");
+        return false;
+      }
+      for (uint32_t i = 3; i < length && i - 2 < conn.filterCount; i++)
+      {
+        if (body[i] == 0x80)
+        {
+          LOG_W("MQTT subscribe refused: %s", conn.filters[i - 2]);
+        }
+      }
+      enterState(MQTT_LINK_PUBLISH_STATE);
+    }
+    break;
+
+  case MQTT_PUBLISH:
+    receivePublish(type & 0x0F, body, length);
+    break;
+
+  case MQTT_PUBACK:
+    if (length >= 2)
+    {
+      mqttOutboxAcked(readU16(body));
+    }
+    break;
+
+  case MQTT_PINGRESP:
+    conn.pingOutstanding = false;
+    break;
+
+  default:
+    break;
+  }
+  return true;
+}
+
+//Reads what arrived and handles every complete packet. False if the connection failed.
+static bool receive()
+{
+  for (;;)
+  {
+    int received = lwip_recv(conn.sockfd, rxBuffer + conn.rxLength, sizeof(rxBuffer) - conn.rxLength, MSG_DONTWAIT);
+    if (received == 0)
+    {
+      return false; //Closed by the broker
+    }
+    if (received < 0)
+    {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    conn.rxLength += received;
+
+    size_t used = 0;
+    while (used < conn.rxLength)
+    {
+      uint8_t *packet = rxBuffer + used;
+      size_t available = conn.rxLength - used;
+      uint32_t remaining;
+
+      if (conn.rxSkip > 0)
+      {
+        size_t skip = (conn.rxSkip < available) ? conn.rxSkip : available;
+        conn.rxSkip -= skip;
+        used += skip;
+        continue;
+      }
+      int header = mqttParseHeader(packet, available, &remaining);
+      if (header < 0)
+      {
+        return false;
+      }
+      if (header == 0 || header + remaining > available)
+      {
+        if (used == 0 && conn.rxLength == sizeof(rxBuffer))
+        {
+          //Larger than the buffer: dropped, a QoS1 PUBLISH is still acknowledged
+          LOG_W("MQTT packet of %lu bytes dropped", (unsigned long)(header + remaining));
+          size_t idOffset = header + 2 + readU16(packet + header);
+          if ((packet[0] & 0xF0) == MQTT_PUBLISH && (packet[0] & MQTT_QOS1) && idOffset + 2 <= available)
+          {
+            sendAck(readU16(packet + idOffset));
+          }
+          conn.rxSkip = header + remaining;
+          continue;
+        }
+        break; //Rest of the packet still on the way
+      }
+      if (!receivePacket(packet[0], packet + header, remaining))
+      {
+        return false;
+      }
+      used += header + remaining;
+    }
+    memmove(rxBuffer, rxBuffer + used, conn.rxLength - used);
+    conn.rxLength -= used;
+  }
+}
+
+//Pipelined batch: every waiting message that fits the window and the send buffer, in one send
+static void sendOutbox()
+{
+  mqttOutboxEntry *entry;
+
+  while (mqttOutboxInFlight() < MQTT_INFLIGHT_MAX && (entry = mqttOutboxNext()) != NULL)
+  {
+    size_t size;
+    uint8_t *packet = txSpace(&size);
+    uint16_t packetId = 0;
+
+    if (entry->flags & MQTT_QOS1)
+    {
+      packetId = (entry->flags & MQTT_DUP) ? entry->packetId : nextPacketId();
+    }
+    size_t length = mqttPublishPacket(packet, size, entry->topic, (const uint8_t *)entry->payload, entry->length,
+                                      entry->flags, packetId);
+    if (length == 0)
+    {
+      break; //Next batch
+    }
+    txAppend(length);
+    mqttOutboxSent(entry, packetId);
+  }
+}
+
+//PINGREQ when nothing was sent for keepAlive, the session is dead without an answer within keepAlive
+static bool keepAlive()
+{
+  unsigned long period = (unsigned long)conn.keepAlive * 1000;
+
+  if (conn.pingOutstanding)
+  {
+    return millis() - conn.pingTime < period;
+  }
+  if (period > 0 && millis() - conn.lastTx >= period)
+  {
+    size_t size;
+    uint8_t *packet = txSpace(&size);
+    if (size >= 2)
+    {
+      txAppend(mqttEmptyPacket(packet, MQTT_PINGREQ));
+      conn.pingOutstanding = true;
+      conn.pingTime = millis();
+    }
+  }
+  return true;
+}
+
+void mqttLinkBegin(const char *host, uint16_t port, const char *clientId, uint16_t keepAlive,
+                   mqttMessageCallback onMessage, mqttLinkCallback onConnected)
+{
+  conn.host = host;
+  conn.port = port;
+  conn.clientId = clientId;
+  conn.keepAlive = keepAlive;
+  conn.onMessage = onMessage;
+  conn.onConnected = onConnected;
+  conn.sockfd = -1;
+  conn.brokerResolved = false;
+  conn.attempt = 0;
+  conn.reconnectCount = 0;
+  conn.droppedCount = 0;
+  enterState(MQTT_LINK_WAIT_WIFI);
+}
+
+bool mqttLinkProcess()
+{
+  int result;
+
+  if (WiFi.status() != WL_CONNECTED && conn.state != MQTT_LINK_WAIT_WIFI)
+  {
+    LOG_W("MQTT link: WiFi lost");
+    closeSocket();
+    enterState(MQTT_LINK_WAIT_WIFI);
+  }
+
+  if (conn.state >= MQTT_LINK_MQTT_CONNECT && conn.state <= MQTT_LINK_CONNECTED && !receive())
+  {
+    LOG_W("MQTT connection lost");
+    startBackoff();
+  }
+
+  switch (conn.state)
+  {
+  case MQTT_LINK_WAIT_WIFI:
+    if (WiFi.status() == WL_CONNECTED)
+    {
+      enterState(resolveDue() ? MQTT_LINK_RESOLVE : MQTT_LINK_TCP_CONNECT);
+    }
+    break;
+
+  case MQTT_LINK_RESOLVE:
+    result = pollResolve();
+    if (result > 0)
+    {
+      conn.brokerResolved = true;
+      conn.resolvedTime = millis();
+      conn.connectFailures = 0;
+      enterState(MQTT_LINK_TCP_CONNECT);
+    }
+    else if (result < 0 || millis() - conn.stateTime > MQTT_DNS_TIMEOUT)
+    {
+      //A lookup still pending in lwip is picked up by the next attempt
+      LOG_W("MQTT link: DNS failed%s", conn.brokerResolved ? ", keeping the last address" : "");
+      if (conn.brokerResolved)
+      {
+        conn.resolvedTime = millis();
+        conn.connectFailures = 0;
+      }
+      startBackoff();
+    }
+    break;
+
+  case MQTT_LINK_TCP_CONNECT:
+    if (conn.sockfd < 0)
+    {
+      LOG_I("Attempting MQTT connection...");
+      if (!startTcpConnect())
+      {
+        LOG_E("MQTT link: socket failed");
+        startBackoff();
+      }
+      break;
+    }
+    result = pollTcpConnect();
+    if (result > 0)
+    {
+      //The socket stays non-blocking, CONNACK arrives through receive()
+      conn.connectFailures = 0;
+      int noDelay = 1;
+      setsockopt(conn.sockfd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+      size_t size;
+      uint8_t *packet = txSpace(&size);
+      txAppend(mqttConnectPacket(packet, size, conn.clientId, conn.keepAlive, conn.cleanSession));
+      conn.cleanSession = false;
+      enterState(MQTT_LINK_MQTT_CONNECT);
+    }
+    else if (result < 0 || millis() - conn.stateTime > MQTT_TCP_CONNECT_TIMEOUT)
+    {
+      LOG_W("MQTT link: TCP connect failed");
+      if (conn.connectFailures < MQTT_DNS_RETRY_FAILURES)
+      {
+        conn.connectFailures++; //The broker may have moved
+      }
+      startBackoff();
+    }
+    break;
+
+  case MQTT_LINK_MQTT_CONNECT:
+  case MQTT_LINK_SUBSCRIBE:
+    if (millis() - conn.stateTime > MQTT_RESPONSE_TIMEOUT)
+    {
+      LOG_W("MQTT link: no %s", conn.state == MQTT_LINK_MQTT_CONNECT ? "CONNACK" : "SUBACK");
+      startBackoff();
+    }
+    break;
+
+  case MQTT_LINK_PUBLISH_STATE:
+    if (conn.onConnected != NULL)
+    {
+      conn.onConnected();
+    }
+    enterState(MQTT_LINK_CONNECTED);
+    break;
+
+  case MQTT_LINK_CONNECTED:
+    if (conn.cleanSession)
+    {
+      //Not from the message callback, receive() still walks the buffer there
+      LOG_I("MQTT filters changed, reconnecting");
+      closeSocket();
+      enterState(MQTT_LINK_TCP_CONNECT);
+      break;
+    }
+    if (!keepAlive())
+    {
+      LOG_W("MQTT connection lost, no PINGRESP");
+      startBackoff();
+      break;
+    }
+    sendOutbox();
+    break;
+
+  case MQTT_LINK_BACKOFF:
+    if (millis() - conn.stateTime >= conn.backoffDelay)
+    {
+      enterState(resolveDue() ? MQTT_LINK_RESOLVE : MQTT_LINK_TCP_CONNECT);
+    }
+    break;
+
+  default:
+    enterState(MQTT_LINK_WAIT_WIFI);
+    break;
+  }
+
+  if (conn.sockfd >= 0 && conn.state >= MQTT_LINK_MQTT_CONNECT && !sendBuffered())
+  {
+    LOG_W("MQTT link: send failed");
+    startBackoff();
+  }
+  return conn.state == MQTT_LINK_CONNECTED;
+}
+
+//Into the current batch, only while connected
+static bool publishNow(const char *topic, const uint8_t *payload, size_t length, uint8_t flags)
+{
+  if (conn.state != MQTT_LINK_CONNECTED)
+  {
+    return false;
+  }
+  size_t size;
+  uint8_t *packet = txSpace(&size);
+  size_t packetLength = mqttPublishPacket(packet, size, topic, payload, length, flags, 0);
+  txAppend(packetLength);
+  return packetLength > 0;
+}
+
+bool mqttLinkPublish(const char *topic, const char *payload, uint8_t flags)
+{
+  if (flags & MQTT_QOS1)
+  {
+    if (!mqttOutboxPut(topic, payload, flags))
+    {
+      conn.droppedCount++;
+      LOG_E("MQTT outbox refused %s, %lu dropped", topic, (unsigned long)conn.droppedCount);
+      return false;
+    }
+    return true;
+  }
+  return publishNow(topic, (const uint8_t *)payload, strlen(payload), flags);
+}
+
+bool mqttLinkPublishData(const char *topic, const uint8_t *payload, size_t length)
+{
+  return publishNow(topic, payload, length, 0);
+}
+
+void mqttLinkSetFilters(const char *const *filters, uint8_t count)
+{
+  if (count > MQTT_FILTERS_MAX)
+  {
+    count = MQTT_FILTERS_MAX;
+  }
+  //A persistent session would keep the old filters, drop it once. Not on the first call from setup().
+  conn.cleanSession = conn.filterCount > 0;
+  for (uint8_t i = 0; i < count; i++)
+  {
+    conn.filters[i] = filters[i];
+  }
+  conn.filterCount = count;
+}
+
+uint8_t mqttLinkState()
+{
+  return conn.state;
+}
+
+uint32_t mqttLinkReconnectCount()
+{
+  return conn.reconnectCount;
+}
@@ -0,0 +1,64 @@
+#ifndef MQTT_LINK_H
+#define MQTT_LINK_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include "mqtt_packet.h"
+
+//Connection states, advanced one step per mqttLinkProcess() call
+#define MQTT_LINK_WAIT_WIFI 0
+#define MQTT_LINK_RESOLVE 1
+#define MQTT_LINK_TCP_CONNECT 2
+#define MQTT_LINK_MQTT_CONNECT 3
+#define MQTT_LINK_SUBSCRIBE 4
+#define MQTT_LINK_PUBLISH_STATE 5
+#define MQTT_LINK_CONNECTED 6
+#define MQTT_LINK_BACKOFF 7
+
+#define MQTT_DNS_TIMEOUT 30000         //ms, lwip gives up on its own before that
+#define MQTT_DNS_TTL 3600000           //ms the resolved broker address is used without a new lookup
+#define MQTT_DNS_RETRY_FAILURES 3      //TCP connect failures in a row before a new lookup
+#define MQTT_TCP_CONNECT_TIMEOUT 10000 //ms
+#define MQTT_RESPONSE_TIMEOUT 5000     //ms for CONNACK and SUBACK
+#define MQTT_BACKOFF_BASE 1000         //ms
+#define MQTT_BACKOFF_MAX 300000        //ms
+
+#define MQTT_BUFFER_SIZE 4352 //largest received packet, an OTA chunk (ota.h). Larger calendars are sent in several chunks.
+#define MQTT_TX_BUFFER 1024   //one batch of outgoing packets
+#define MQTT_INFLIGHT_MAX 8   //QoS1 publishes without PUBACK
+#define MQTT_FILTERS_MAX 4    //subscribed topic filters
+
+typedef void (*mqttLinkCallback)();
+
+//topic is terminated in place, both point into the receive buffer until the callback returns
+typedef void (*mqttMessageCallback)(char *topic, uint8_t *payload, unsigned int length);
+
+//MQTT 3.1.1 over a non-blocking lwip socket. The session is persistent (clean session off) and the
+//filters are subscribed with QoS1, so control messages sent while the link is down arrive after the
+//reconnect. The host and clientId strings must stay valid while the link is used.
+//onConnected is called once per session after the subscription, e.g. to publish actuator states.
+void mqttLinkBegin(const char *host, uint16_t port, const char *clientId, uint16_t keepAlive,
+                   mqttMessageCallback onMessage, mqttLinkCallback onConnected);
+
+//Topic filters to subscribe, up to MQTT_FILTERS_MAX, the first one is required. The strings must stay
+//valid until the next call. Later calls reconnect once with a clean session, so the broker forgets
+//the old filters; QoS1 messages it held for the old session are lost.
+void mqttLinkSetFilters(const char *const *filters, uint8_t count);
+
+//Never waits on the network. Receives, keeps the session alive and sends the outbox (mqtt_outbox.h)
+//in batches of up to MQTT_INFLIGHT_MAX unacknowledged messages. Returns true while the session is usable.
+bool mqttLinkProcess();
+
+//With MQTT_QOS1 the message goes to the outbox, replaces one still waiting on the same topic and is
+//sent whenever the link is up, topic must stay valid until then. Without it the message is sent with
+//the next batch if the link is up now. False if it could not be queued, a refused QoS1 message is logged.
+bool mqttLinkPublish(const char *topic, const char *payload, uint8_t flags);
+
+//Binary payload, QoS0: sent with the next batch if the link is up now. False if it is not or the batch
+//has no room, try again after the next mqttLinkProcess().
+bool mqttLinkPublishData(const char *topic, const uint8_t *payload, size_t length);
+
+uint8_t mqttLinkState();
+uint32_t mqttLinkReconnectCount();
+
+#endif
@@ -0,0 +1,119 @@
+#include "mqtt_outbox.h"
+#include "mqtt_packet.h"
+#include <string.h>
+
+static mqttOutboxEntry outbox[MQTT_OUTBOX_SLOTS];
+static uint32_t nextSequence;
+
+void mqttOutboxClear()
+{
+  memset(outbox, 0, sizeof(outbox));
+  nextSequence = 0;
+}
+
+bool mqttOutboxPut(const char *topic, const char *payload, uint8_t flags)
+{
+  size_t length = strlen(payload);
+  mqttOutboxEntry *slot = NULL;
+
+  if (length >= MQTT_OUTBOX_PAYLOAD)
+  {
+    return false;
+  }
+  for (mqttOutboxEntry &entry : outbox)
+  {
+    if (entry.topic != NULL && (entry.topic == topic || strcmp(entry.topic, topic) == 0))
+    {
+      slot = &entry; //Coalesced, also when the older one is in flight: its PUBACK is ignored
+      break;
+    }
+    if (entry.topic == NULL && slot == NULL)
+    {
+      slot = &entry;
+    }
+  }
+  if (slot == NULL)
+  {
+    return false;
+  }
+  slot->topic = topic;
+  slot->sequence = nextSequence++;
+  slot->packetId = 0;
+  slot->flags = flags & (MQTT_RETAIN | MQTT_QOS1);
+  slot->sent = false;
+  slot->length = (uint16_t)length;
+  memcpy(slot->payload, payload, length + 1);
+  return true;
+}
+
+mqttOutboxEntry *mqttOutboxNext()
+{
+  mqttOutboxEntry *oldest = NULL;
+
+  for (mqttOutboxEntry &entry : outbox)
+  {
+    if (entry.topic != NULL && !entry.sent && (oldest == NULL || (int32_t)(entry.sequence - oldest->sequence) < 0))
+    {
+      oldest = &entry;
+    }
+  }
+  return oldest;
+}
+
+void mqttOutboxSent(mqttOutboxEntry *entry, uint16_t packetId)
+{
+  if (!(entry->flags & MQTT_QOS1))
+  {
+    entry->topic = NULL;
+    return;
+  }
+  entry->packetId = packetId;
+  entry->sent = true;
+}
+
+bool mqttOutboxAcked(uint16_t packetId)
+{
+  for (mqttOutboxEntry &entry : outbox)
+  {
+    if (entry.topic != NULL && entry.sent && entry.packetId == packetId)
+    {
+      entry.topic = NULL;
+      return true;
+    }
+  }
+  return false;
+}
+
+void mqttOutboxRequeue()
+{
+  for (mqttOutboxEntry &entry : outbox)
+  {
+    if (entry.topic != NULL && entry.sent)
+    {
+      entry.sent = false;
+      entry.flags |= MQTT_DUP;
+    }
+  }
+}
+
+uint8_t mqttOutboxInFlight()
+{
+  uint8_t count = 0;
+
+  for (const mqttOutboxEntry &entry : outbox)
+  {
+    count += (entry.topic != NULL && entry.sent) ? 1 : 0;
+  }
+  return count;
+}
+
+uint8_t mqttOutboxWaiting()
+{
+  uint8_t count = 0;
+
+  for (const mqttOutboxEntry &entry : outbox)
+  {
+    count += (entry.topic != NULL && !entry.sent) ? 1 : 0;
+  }
+  return count;
+}
@@ -0,0 +1,48 @@
+#ifndef MQTT_OUTBOX_H
+#define MQTT_OUTBOX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "telemetry.h"
+
+//Outbound MQTT messages, one slot per topic. A newer message replaces the one waiting on the same topic,
+//so state topics never queue more than their latest value and a full outbox needs that many topics.
+//Only the network task uses it, there is no lock.
+#define MQTT_OUTBOX_SLOTS TOPIC_COUNT //one per monitor topic, grows with actuatorTable
+#define MQTT_OUTBOX_PAYLOAD 200       //bytes with the terminator, the snapshot is the longest
+
+static_assert(MQTT_OUTBOX_SLOTS >= TOPIC_COUNT, "every monitor topic needs a slot, retained states are lost otherwise");
+
+typedef struct
+{
+  const char *topic; //NULL: free slot. Points to the caller's string, which must stay valid.
+  uint32_t sequence; //sends go oldest first
+  uint16_t packetId; //QoS1 id of the last send, kept for the DUP resend after a reconnect
+  uint8_t flags;     //MQTT_RETAIN, MQTT_QOS1, MQTT_DUP
+  bool sent;         //QoS1 waiting for PUBACK
+  uint16_t length;
+  char payload[MQTT_OUTBOX_PAYLOAD];
+} mqttOutboxEntry;
+
+void mqttOutboxClear();
+
+//Queues payload on topic, replacing a message still waiting there. False if the outbox is full or the
+//payload too long.
+bool mqttOutboxPut(const char *topic, const char *payload, uint8_t flags);
+
+//Oldest message not sent yet, NULL if none
+mqttOutboxEntry *mqttOutboxNext();
+
+//entry went out. QoS0 is done, QoS1 waits for the PUBACK of packetId.
+void mqttOutboxSent(mqttOutboxEntry *entry, uint16_t packetId);
+
+//PUBACK arrived. False for an unknown id, e.g. of a message replaced since.
+bool mqttOutboxAcked(uint16_t packetId);
+
+//Connection lost: unacknowledged messages go out again with MQTT_DUP and their packet id
+void mqttOutboxRequeue();
+
+uint8_t mqttOutboxInFlight(); //sent, no PUBACK yet
+uint8_t mqttOutboxWaiting();  //not sent yet
+
+#endif
@@ -0,0 +1,144 @@
+#include "mqtt_packet.h"
+#include <string.h>
+
+//Fixed header with the variable length encoding of remaining, 0 if it does not fit
+static size_t writeHeader(uint8_t *packet, size_t size, uint8_t type, size_t remaining)
+{
+  size_t length = 0;
+
+  if (remaining > 268435455 || size < 2)
+  {
+    return 0;
+  }
+  packet[length++] = type;
+  do
+  {
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    packet[length++] = remaining > 0 ? (digit | 0x80) : digit;
+  } while (remaining > 0 && length < size);
+  return remaining > 0 ? 0 : length;
+}
+
+static uint8_t headerLength(size_t remaining)
+{
+  return remaining < 128 ? 2 : remaining < 16384 ? 3 : remaining < 2097152 ? 4 : 5;
+}
+
+static uint8_t *writeU16(uint8_t *at, uint16_t value)
+{
+  at[0] = value >> 8;
+  at[1] = value & 0xFF;
+  return at + 2;
+}
+
+static uint8_t *writeString(uint8_t *at, const char *text, size_t length)
+{
+  at = writeU16(at, (uint16_t)length);
+  memcpy(at, text, length);
+  return at + length;
+}
+
+size_t mqttConnectPacket(uint8_t *packet, size_t size, const char *clientId, uint16_t keepAlive, bool cleanSession)
+{
+  size_t idLength = strlen(clientId);
+  size_t remaining = 10 + 2 + idLength;
+  size_t total = headerLength(remaining) + remaining;
+
+  if (idLength > 0xFFFF || total > size)
+  {
+    return 0;
+  }
+  uint8_t *at = packet + writeHeader(packet, size, MQTT_CONNECT, remaining);
+  at = writeString(at, "MQTT", 4);
+  *at++ = 4; //protocol level 3.1.1
+  *at++ = cleanSession ? 0x02 : 0x00;
+  at = writeU16(at, keepAlive);
+  writeString(at, clientId, idLength);
+  return total;
+}
+
+size_t mqttPublishPacket(uint8_t *packet, size_t size, const char *topic, const uint8_t *payload, size_t length,
+                         uint8_t flags, uint16_t packetId)
+{
+  size_t topicLength = strlen(topic);
+  size_t remaining = 2 + topicLength + ((flags & MQTT_QOS1) ? 2 : 0) + length;
+  size_t total = headerLength(remaining) + remaining;
+
+  if (topicLength > 0xFFFF || total > size)
+  {
+    return 0;
+  }
+  uint8_t *at = packet + writeHeader(packet, size, MQTT_PUBLISH | (flags & (MQTT_RETAIN | MQTT_QOS1 | MQTT_DUP)), remaining);
+  at = writeString(at, topic, topicLength);
+  if (flags & MQTT_QOS1)
+  {
+    at = writeU16(at, packetId);
+  }
+  memcpy(at, payload, length);
+  return total;
+}
+
+size_t mqttSubscribePacket(uint8_t *packet, size_t size, uint16_t packetId, const char *const *filters, uint8_t count,
+                           uint8_t qos)
+{
+  size_t remaining = 2;
+
+  for (uint8_t i = 0; i < count; i++)
+  {
+    size_t filterLength = strlen(filters[i]);
+    if (filterLength > 0xFFFF)
+    {
+      return 0;
+    }
+    remaining += 2 + filterLength + 1;
+  }
+  size_t total = headerLength(remaining) + remaining;
+  if (count == 0 || total > size)
+  {
+    return 0;
+  }
+  uint8_t *at = packet + writeHeader(packet, size, MQTT_SUBSCRIBE | 0x02, remaining); //reserved flags 0010
+  at = writeU16(at, packetId);
+  for (uint8_t i = 0; i < count; i++)
+  {
+    at = writeString(at, filters[i], strlen(filters[i]));
+    *at++ = qos;
+  }
+  return total;
+}
+
+size_t mqttAckPacket(uint8_t *packet, uint8_t type, uint16_t packetId)
+{
+  packet[0] = type;
+  packet[1] = 2;
+  writeU16(packet + 2, packetId);
+  return 4;
+}
+
+size_t mqttEmptyPacket(uint8_t *packet, uint8_t type)
+{
+  packet[0] = type;
+  packet[1] = 0;
+  return 2;
+}
+
+int mqttParseHeader(const uint8_t *data, size_t available, uint32_t *remaining)
+{
+  uint32_t value = 0;
+
+  for (uint8_t i = 1; i < MQTT_HEADER_MAX; i++)
+  {
+    if (i >= available)
+    {
+      return 0;
+    }
+    value |= (uint32_t)(data[i] & 0x7F) << (7 * (i - 1));
+    if ((data[i] & 0x80) == 0)
+    {
+      *remaining = value;
+      return i + 1;
+    }
+  }
+  return -1;
+}
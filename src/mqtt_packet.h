@@ -0,0 +1,49 @@
+#ifndef MQTT_PACKET_H
+#define MQTT_PACKET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//MQTT 3.1.1 packets, only the ones mqtt_link.cpp uses. Encoders return the packet size, 0 if it does
+//not fit into size bytes.
+
+//Packet types, first byte of the fixed header without the flags
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_SUBSCRIBE 0x80
+#define MQTT_SUBACK 0x90
+#define MQTT_PINGREQ 0xC0
+#define MQTT_PINGRESP 0xD0
+#define MQTT_DISCONNECT 0xE0
+
+//PUBLISH flags, as in the fixed header
+#define MQTT_RETAIN 0x01
+#define MQTT_QOS1 0x02
+#define MQTT_DUP 0x08
+
+#define MQTT_HEADER_MAX 5 //type and a remaining length of up to four bytes
+
+//cleanSession false: the broker keeps the subscription and the QoS1 messages while we are away
+size_t mqttConnectPacket(uint8_t *packet, size_t size, const char *clientId, uint16_t keepAlive, bool cleanSession);
+
+//packetId only with MQTT_QOS1
+size_t mqttPublishPacket(uint8_t *packet, size_t size, const char *topic, const uint8_t *payload, size_t length,
+                         uint8_t flags, uint16_t packetId);
+
+//One SUBSCRIBE for count filters, all with qos
+size_t mqttSubscribePacket(uint8_t *packet, size_t size, uint16_t packetId, const char *const *filters, uint8_t count,
+                           uint8_t qos);
+
+//PUBACK, 4 bytes
+size_t mqttAckPacket(uint8_t *packet, uint8_t type, uint16_t packetId);
+
+//PINGREQ, DISCONNECT, 2 bytes
+size_t mqttEmptyPacket(uint8_t *packet, uint8_t type);
+
+//Fixed header of the packet at data. Returns its length and the remaining length, 0 while more bytes
+//are needed, -1 if the length is malformed.
+int mqttParseHeader(const uint8_t *data, size_t available, uint32_t *remaining);
+
+#endif
@@ -0,0 +1,518 @@
+//Microbenchmarks of the hot paths of the firmware, run on the host against the native HAL.
+//  pio run -e bench -t exec        (or: .pio/build/bench/program [-j] [name filter])
+//Every benchmark reports ns/op, the slowest op, heap allocations and frees per op and the peak heap
+//held during the run. -j prints one JSON object per line instead, for regression tracking.
+//Times are host times: compare runs on the same machine, not with the board.
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hal_native.h"
+#include "calendar_engine.h"
+#include "calendar_upload.h"
+#include "controller.h"
+#include "telemetry.h"
+#include "topic_route.h"
+#include "time_service.h"
+#include "logger.h"
+#include "mqtt_outbox.h"
+#include "mqtt_packet.h"
+#include "history_store.h"
+
+#define BENCH_EPOCH 1704585600UL //2024-01-07 00:00:00 UTC, a Sunday
+#define BENCH_MIN_MS 200         //wall time per benchmark
+#define BENCH_MIN_SAMPLES 20
+#define BENCH_CHUNK 1024         //MQTT_BUFFER_SIZE in mqtt_link.h, largest message the callback gets
+#define BENCH_DOCUMENT_SIZE 65536
+
+typedef struct
+{
+  const char *name;
+  uint32_t batch;    //ops per timed sample, for ops close to the clock resolution
+  void (*setup)();   //untimed, before every sample
+  void (*op)();
+  void (*teardown)(); //untimed, after every sample
+} benchCase;
+
+typedef struct
+{
+  uint64_t ops;
+  double nsPerOp;
+  double maxNs; //slowest sample / batch
+  double allocsPerOp;
+  double freesPerOp;
+  int64_t peakBytes;
+} benchResult;
+
+//Heap counters. malloc and friends are interposed on glibc, other hosts report no heap figures.
+static bool tracking;
+static uint64_t allocCount, freeCount;
+static int64_t liveBytes, peakBytes;
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#define BENCH_HEAP 1
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void __libc_free(void *ptr);
+
+static void trackAlloc(void *ptr)
+{
+  if (tracking && ptr != NULL)
+  {
+    allocCount++;
+    liveBytes += malloc_usable_size(ptr);
+    peakBytes = (liveBytes > peakBytes) ? liveBytes : peakBytes;
+  }
+}
+
+static void trackFree(void *ptr)
+{
+  if (tracking && ptr != NULL)
+  {
+    freeCount++;
+    liveBytes -= malloc_usable_size(ptr);
+  }
+}
+
+extern "C" void *malloc(size_t size) noexcept
+{
+  void *ptr = __libc_malloc(size);
+  trackAlloc(ptr);
+  return ptr;
+}
+
+extern "C" void *calloc(size_t count, size_t size) noexcept
+{
+  void *ptr = __libc_calloc(count, size);
+  trackAlloc(ptr);
+  return ptr;
+}
+
+//Counted as a free and an allocation, like the heap sees it when the block moves
+extern "C" void *realloc(void *ptr, size_t size) noexcept
+{
+  size_t oldSize = (ptr != NULL) ? malloc_usable_size(ptr) : 0;
+  void *moved = __libc_realloc(ptr, size);
+
+  if (moved == NULL && size > 0)
+  {
+    return NULL; //ptr is untouched
+  }
+  if (tracking && ptr != NULL)
+  {
+    freeCount++;
+    liveBytes -= oldSize;
+  }
+  trackAlloc(moved);
+  return moved;
+}
+
+extern "C" void free(void *ptr) noexcept
+{
+  trackFree(ptr);
+  __libc_free(ptr);
+}
+#else
+#define BENCH_HEAP 0
+#endif
+
+//Benchmark inputs
+static char documents[3][BENCH_DOCUMENT_SIZE];
+static size_t documentLength[3];
+static const uint16_t documentEntries[3] = {10, 100, 400};
+static calendarUpload upload;
+static calendarRule *unsorted, *sortBuffer;
+static uint16_t unsortedLength;
+static uint64_t evaluateTime; //unix ms
+static volatile uint64_t timeSink;
+static uint8_t topicIndex;
+static sensorData telemetryData = {57.0f, 21.4f, 1834, false, 0};
+static char controlPrefix[40];
+static size_t controlPrefixLength;
+static uint8_t mqttBatch[1024]; //MQTT_TX_BUFFER in mqtt_link.h
+static uint16_t mqttPacketId;
+static uint32_t telemetryMs;
+static uint32_t historyTime = BENCH_EPOCH;
+static double worstChunkNs; //400 entries, slowest message of the fastest upload, free of host scheduling noise
+
+static void noopHandler(uint8_t type, const uint8_t *message, unsigned int length)
+{
+}
+
+static void noopStatus(uint8_t type, uint8_t status)
+{
+}
+
+//Built like topicRoutes in main.cpp
+static const topicRoute benchFixedRoutes[] = {
+    {"calendar", noopHandler, 0, true},
+    {"datetime", noopHandler, 0, true},
+};
+static topicRoute benchRoutes[TOPIC_ROUTE_COUNT(2)];
+static uint8_t benchRouteCount;
+static const char *const benchTopics[] = {
+    "doa/BENCH/control/water", "doa/BENCH/control/fan_calendar", "doa/BENCH/control/led_calendar_bin",
+    "doa/BENCH/control/datetime", "doa/BENCH/control/unknown", "doa/OTHER/control/water",
+};
+#define BENCH_TOPICS (sizeof(benchTopics) / sizeof(benchTopics[0]))
+
+static uint32_t lcg(uint32_t *seed)
+{
+  *seed = *seed * 1664525 + 1013904223;
+  return *seed >> 8;
+}
+
+//Calendar document as the backend sends it, mostly single day items like the app produces
+static size_t makeDocument(char *buffer, size_t size, uint16_t entries, uint32_t seed)
+{
+  size_t length = snprintf(buffer, size, "{\"calendar\":[");
+
+  for (uint16_t i = 0; i < entries; i++)
+  {
+    uint32_t repeat = lcg(&seed) % 8;
+    length += snprintf(buffer + length, size - length, "%s{\"dofw\":%u,\"h\":%u,\"m\":%u,\"r\":%u,\"a\":%u}",
+                       i ? "," : "", lcg(&seed) % 7, lcg(&seed) % 24, lcg(&seed) % 60, repeat < 4 ? repeat : 0,
+                       lcg(&seed) % 2);
+  }
+  length += snprintf(buffer + length, size - length, "]}");
+  return length;
+}
+
+//Parses a whole document the way it arrives over MQTT, in BENCH_CHUNK messages
+static void uploadDocument(uint8_t index)
+{
+  double slowestNs = 0;
+
+  calendarUploadBegin(&upload);
+  for (size_t offset = 0; offset < documentLength[index]; offset += BENCH_CHUNK)
+  {
+    size_t chunk = documentLength[index] - offset;
+    chunk = (chunk < BENCH_CHUNK) ? chunk : BENCH_CHUNK;
+
+    auto start = std::chrono::steady_clock::now();
+    calendarUploadFeed(&upload, documents[index] + offset, chunk);
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    slowestNs = (ns > slowestNs) ? ns : slowestNs;
+  }
+  if (index == 2 && (worstChunkNs == 0 || slowestNs < worstChunkNs))
+  {
+    worstChunkNs = slowestNs;
+  }
+}
+
+static void benchUpload10()
+{
+  uploadDocument(0);
+}
+
+static void benchUpload100()
+{
+  uploadDocument(1);
+}
+
+static void benchUpload400()
+{
+  uploadDocument(2);
+}
+
+static void uploadTeardown()
+{
+  calendarUploadAbort(&upload);
+}
+
+static void sortSetup()
+{
+  memcpy(sortBuffer, unsorted, unsortedLength * sizeof(calendarRule));
+}
+
+static void benchSort()
+{
+  sort_calendar(sortBuffer, unsortedLength);
+}
+
+static void benchCompile()
+{
+  calendarCompile(sortBuffer, unsortedLength);
+}
+
+//Steady state: one minute later every time, usually nothing is due
+static void benchEvaluate()
+{
+  evaluateTime += 60000;
+  controllerEvaluate(0, evaluateTime);
+}
+
+//After boot or an RTC adjustment, every actuator is looked up and applied
+static void benchEvaluateAll()
+{
+  evaluateTime += 60000;
+  controllerEvaluate(CALENDAR_ALL, evaluateTime);
+}
+
+static void benchDispatch()
+{
+  const char *topic = benchTopics[topicIndex++ % BENCH_TOPICS];
+  const topicRoute *route = routeTopic(benchRoutes, benchRouteCount, controlPrefix, controlPrefixLength, topic);
+  if (route != NULL)
+  {
+    route->handler(route->type, (const uint8_t *)"on", 2);
+  }
+}
+
+//Every value due, the heartbeat interval passed
+static void benchTelemetry()
+{
+  telemetryData.humidity += 0.1f;
+  telemetryMs += 600000;
+  telemetryReport(telemetryData, "2024-01-07 12:00:00", telemetryMs);
+}
+
+//Steady state: the next sample, nothing moved past its deadband
+static void benchTelemetryQuiet()
+{
+  telemetryMs += 10000;
+  telemetryReport(telemetryData, "2024-01-07 12:00:00", telemetryMs);
+}
+
+static void benchTimeNow()
+{
+  timeSink = timeNowMs();
+}
+
+static void benchLog()
+{
+  LOG_I("Calendar compiled, %d items -> %d rules", 400, 212);
+}
+
+static void logTeardown()
+{
+  loggerDrain(NULL);
+}
+
+static void benchStatus()
+{
+  topicIndex++;
+  telemetryPublishStatus(topicIndex % (ACTUATOR_COUNT + 1), topicIndex & 1); //WATERLEVEL and every actuator
+}
+
+//One network task pass with the link up: four status changes into the outbox, two of them coalesced,
+//encoded as one batch like mqttLinkProcess() sends it, then acknowledged
+static void benchOutbox()
+{
+  uint16_t ids[MQTT_OUTBOX_SLOTS];
+  uint8_t sent = 0;
+  size_t length = 0;
+  mqttOutboxEntry *entry;
+
+  topicIndex++;
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    mqttOutboxPut(monitorTopic(TOPIC_ACTUATOR + (topicIndex + i / 2) % ACTUATOR_COUNT), (i & 1) ? "on" : "off",
+                  MQTT_QOS1 | MQTT_RETAIN);
+  }
+  while ((entry = mqttOutboxNext()) != NULL)
+  {
+    ids[sent] = ++mqttPacketId;
+    length += mqttPublishPacket(mqttBatch + length, sizeof(mqttBatch) - length, entry->topic,
+                                (const uint8_t *)entry->payload, entry->length, entry->flags, ids[sent]);
+    mqttOutboxSent(entry, ids[sent++]);
+  }
+  for (uint8_t i = 0; i < sent; i++)
+  {
+    mqttOutboxAcked(ids[i]);
+  }
+}
+
+//One sample a minute into the store, the flushes and raw block evictions included
+static void benchHistory()
+{
+  historyTime += 60;
+  historySample sample = {historyTime, 40.0f + (historyTime / 60) % 20, 21.5f + (historyTime / 60) % 7 * 0.1f,
+                          (uint16_t)(1500 + (historyTime / 60) % 300), false};
+  historyRecordSample(&sample);
+}
+
+static const benchCase cases[] = {
+    {"calendar_upload_10", 1, NULL, benchUpload10, uploadTeardown},
+    {"calendar_upload_100", 1, NULL, benchUpload100, uploadTeardown},
+    {"calendar_upload_400", 1, NULL, benchUpload400, uploadTeardown},
+    {"sort_calendar_400", 1, sortSetup, benchSort, NULL},
+    {"calendar_compile_400", 1, sortSetup, benchCompile, NULL},
+    {"controller_evaluate", 100, NULL, benchEvaluate, NULL},
+    {"controller_evaluate_all", 100, NULL, benchEvaluateAll, NULL},
+    {"mqtt_dispatch", 1000, NULL, benchDispatch, NULL},
+    {"telemetry_publish", 100, NULL, benchTelemetry, NULL},
+    {"telemetry_report_quiet", 1000, NULL, benchTelemetryQuiet, NULL},
+    {"telemetry_status", 1000, NULL, benchStatus, NULL},
+    {"mqtt_outbox_batch", 1000, NULL, benchOutbox, NULL},
+    {"history_record", 100, NULL, benchHistory, NULL},
+    {"time_now", 1000, NULL, benchTimeNow, NULL},
+    {"log_line", LOG_SLOTS, NULL, benchLog, logTeardown},
+};
+
+static benchResult run(const benchCase &bench)
+{
+  benchResult result = {0, 0, 0, 0, 0, 0};
+  double totalNs = 0;
+  uint64_t samples = 0;
+
+  //Warm up caches and lazy state, untracked
+  if (bench.setup)
+  {
+    bench.setup();
+  }
+  bench.op();
+  if (bench.teardown)
+  {
+    bench.teardown();
+  }
+
+  allocCount = freeCount = 0;
+  liveBytes = peakBytes = 0;
+  auto started = std::chrono::steady_clock::now();
+  while (samples < BENCH_MIN_SAMPLES ||
+         std::chrono::steady_clock::now() - started < std::chrono::milliseconds(BENCH_MIN_MS))
+  {
+    if (bench.setup)
+    {
+      bench.setup();
+    }
+    tracking = true;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < bench.batch; i++)
+    {
+      bench.op();
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    if (bench.teardown)
+    {
+      bench.teardown(); //Frees what the op kept, counted so that the peak is what the op holds
+    }
+    tracking = false;
+    loggerDrain(NULL);
+
+    totalNs += ns;
+    result.maxNs = (ns / bench.batch > result.maxNs) ? ns / bench.batch : result.maxNs;
+    samples++;
+  }
+
+  result.ops = samples * bench.batch;
+  result.nsPerOp = totalNs / result.ops;
+  result.allocsPerOp = (double)allocCount / result.ops;
+  result.freesPerOp = (double)freeCount / result.ops;
+  result.peakBytes = peakBytes;
+  return result;
+}
+
+static void setupInputs()
+{
+  uint32_t seed = 12345;
+
+  for (int i = 0; i < 3; i++)
+  {
+    documentLength[i] = makeDocument(documents[i], BENCH_DOCUMENT_SIZE, documentEntries[i], 7 + i);
+  }
+
+  //400 parsed items before compile, the input of sort_calendar and calendarCompile
+  unsortedLength = documentEntries[2];
+  unsorted = (calendarRule *)malloc(unsortedLength * sizeof(calendarRule));
+  sortBuffer = (calendarRule *)malloc(unsortedLength * sizeof(calendarRule));
+  for (uint16_t i = 0; i < unsortedLength; i++)
+  {
+    unsorted[i].minute = lcg(&seed) % MINUTES_PER_DAY;
+    unsorted[i].days = 1 + lcg(&seed) % DAYS_ALL;
+    unsorted[i].action = lcg(&seed) % 2;
+  }
+
+  //Every actuator runs the compiled 400 item calendar
+  loggerBegin();
+  simBegin(BENCH_EPOCH, NULL);
+  halBegin();
+  historyBegin();
+  telemetryBegin("BENCH", "bench");
+  telemetryConfigBegin();
+  controllerBegin(noopStatus);
+  for (uint8_t type = 1; type <= ACTUATOR_COUNT; type++)
+  {
+    uploadDocument(2);
+    controllerSetCalendar(type, upload.rules, upload.length, 1, false);
+    upload.rules = NULL;
+  }
+  timeBegin();
+  evaluateTime = timeNowMs();
+  controllerEvaluate(CALENDAR_ALL, evaluateTime);
+
+  controlPrefixLength = snprintf(controlPrefix, sizeof(controlPrefix), "doa/BENCH/control/");
+  actuatorTopicHandlers handlers = {noopHandler, noopHandler, noopHandler};
+  benchRouteCount = buildTopicRoutes(benchRoutes, benchFixedRoutes, 2, handlers);
+  simSetMqttRecord(false); //Only the firmware side of a publish is measured
+  worstChunkNs = 0;
+}
+
+int main(int argc, char **argv)
+{
+  bool json = false;
+  const char *filter = NULL;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-j") == 0)
+    {
+      json = true;
+    }
+    else
+    {
+      filter = argv[i];
+    }
+  }
+
+  setupInputs();
+  if (!json)
+  {
+    printf("%-26s %10s %12s %12s %10s %10s %10s\n", "benchmark", "ops", "ns/op", "max ns", "allocs/op", "frees/op",
+           "peak B");
+  }
+  for (const benchCase &bench : cases)
+  {
+    if (filter != NULL && strstr(bench.name, filter) == NULL)
+    {
+      continue;
+    }
+    benchResult result = run(bench);
+    if (json)
+    {
+      printf("{\"name\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.1f,\"max_ns\":%.1f,\"allocs_per_op\":%.3f,"
+             "\"frees_per_op\":%.3f,\"peak_bytes\":%lld,\"heap\":%s}\n",
+             bench.name, (unsigned long long)result.ops, result.nsPerOp, result.maxNs, result.allocsPerOp,
+             result.freesPerOp, (long long)result.peakBytes, BENCH_HEAP ? "true" : "false");
+    }
+    else
+    {
+      printf("%-26s %10llu %12.1f %12.1f %10.3f %10.3f %10lld\n", bench.name, (unsigned long long)result.ops,
+             result.nsPerOp, result.maxNs, result.allocsPerOp, result.freesPerOp, (long long)result.peakBytes);
+    }
+  }
+
+  //The MQTT callback holds the network task for one message at a time
+  if (worstChunkNs > 0)
+  {
+    if (json)
+    {
+      printf("{\"name\":\"calendar_upload_worst_chunk\",\"max_ns\":%.1f,\"chunk_bytes\":%d}\n", worstChunkNs,
+             BENCH_CHUNK);
+    }
+    else
+    {
+      printf("Longest callback of a 400 entry upload (%d byte messages): %.1f ns\n", BENCH_CHUNK, worstChunkNs);
+    }
+  }
+  if (!BENCH_HEAP && !json)
+  {
+    printf("Heap counters need glibc, not available on this host\n");
+  }
+  return 0;
+}
@@ -0,0 +1,381 @@
+#include "hal_native.h"
+#include "actuators.h"
+#include "logger.h"
+#include "mqtt_outbox.h"
+#include "mqtt_packet.h"
+#include "history_store.h"
+#include <map>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+static uint64_t nowMs;
+static int64_t rtcOffsetMs; //halRtcAdjust() moves the RTC against the virtual clock
+static uint32_t epochTime;
+static uint8_t pinLevels[64];
+static simPinHook pinHook;
+static float climateHumidity = NAN, climateTemperature = NAN;
+static bool climateOk;
+static uint32_t soilMoisture;
+static bool waterLow;
+static std::map<std::string, std::vector<uint8_t>> nvsBlobs;
+static std::map<std::string, uint16_t> nvsU16;
+static std::map<std::string, std::string> mqttLast;
+static uint32_t mqttCount, mqttDropped;
+static uint16_t mqttPacketId;
+static bool mqttConnected = true;
+static uint32_t nvsWrites;
+static int32_t nvsWritesLeft = -1; //-1: no power cut scheduled
+static bool mqttRecord = true;
+static bool verboseLog;
+static int32_t clockDriftPpm;
+static uint8_t historyRegion[HISTORY_REGION_SIZE];
+static uint32_t historyWrites;
+
+void simBegin(uint32_t epoch, simPinHook onPinWrite)
+{
+  epochTime = epoch;
+  pinHook = onPinWrite;
+  memset(pinLevels, 1, sizeof(pinLevels)); //Relays are active LOW, all closed
+}
+
+void simSetTime(uint64_t ms)
+{
+  nowMs = ms;
+}
+
+uint64_t simTime()
+{
+  return nowMs;
+}
+
+uint8_t simPinLevel(uint8_t pin)
+{
+  return pinLevels[pin];
+}
+
+void simSetClimate(float humidity, float temperature, bool ok)
+{
+  climateOk = ok;
+  if (ok)
+  {
+    climateHumidity = humidity;
+    climateTemperature = temperature;
+  }
+}
+
+void simSetSoilMoisture(uint32_t mV)
+{
+  soilMoisture = mV;
+}
+
+void simSetWaterLow(bool lowWater)
+{
+  waterLow = lowWater;
+  for (uint8_t i = 0; i < ACTUATOR_COUNT && lowWater; i++)
+  {
+    if ((actuatorTable[i].flags & ACTUATOR_PUMP) && pinLevels[actuatorTable[i].pin] == 0)
+    {
+      halPinWrite(actuatorTable[i].pin, 1);
+    }
+  }
+}
+
+uint32_t simMqttCount()
+{
+  return mqttCount;
+}
+
+const char *simMqttLast(const char *topic)
+{
+  auto it = mqttLast.find(topic);
+  return (it == mqttLast.end()) ? NULL : it->second.c_str();
+}
+
+void simNvsPowerCut(int32_t writes)
+{
+  nvsWritesLeft = writes;
+}
+
+uint32_t simNvsWrites()
+{
+  return nvsWrites;
+}
+
+bool simNvsCorrupt(const char *key)
+{
+  auto it = nvsBlobs.find(key);
+  if (it == nvsBlobs.end() || it->second.empty())
+  {
+    return false;
+  }
+  it->second[it->second.size() / 2] ^= 0x10;
+  return true;
+}
+
+void simSetMqttRecord(bool record)
+{
+  mqttRecord = record;
+}
+
+void simSetClockDrift(int32_t ppm)
+{
+  clockDriftPpm = ppm;
+}
+
+void simSetVerbose(bool verbose)
+{
+  verboseLog = verbose;
+}
+
+void halBegin()
+{
+}
+
+void halPinWrite(uint8_t pin, uint8_t level)
+{
+  if (pinLevels[pin] != level)
+  {
+    pinLevels[pin] = level;
+    if (pinHook != NULL)
+    {
+      pinHook(pin, level);
+    }
+  }
+}
+
+uint32_t halRtcNow()
+{
+  return epochTime + (uint32_t)((nowMs + rtcOffsetMs) / 1000);
+}
+
+void halRtcAdjust(uint32_t unixtime)
+{
+  rtcOffsetMs = (int64_t)(unixtime - epochTime) * 1000 - (int64_t)nowMs; //The RTC second restarts now
+}
+
+uint32_t halMillis()
+{
+  return (uint32_t)nowMs;
+}
+
+uint32_t halMicros()
+{
+  return (uint32_t)(nowMs * 1000);
+}
+
+int64_t halUptimeUs()
+{
+  return (int64_t)nowMs * 1000 + (int64_t)nowMs * clockDriftPpm / 1000;
+}
+
+uint32_t halAwakeMs()
+{
+  return (uint32_t)nowMs;
+}
+
+bool halHistoryRead(uint32_t offset, void *data, size_t length)
+{
+  if (offset + length > sizeof(historyRegion))
+  {
+    return false;
+  }
+  memcpy(data, historyRegion + offset, length);
+  return true;
+}
+
+bool halHistoryWrite(uint32_t offset, const void *data, size_t length)
+{
+  if (offset + length > sizeof(historyRegion))
+  {
+    return false;
+  }
+  memcpy(historyRegion + offset, data, length);
+  historyWrites++;
+  return true;
+}
+
+uint32_t simHistoryWrites()
+{
+  return historyWrites;
+}
+
+//Not modelled
+uint32_t halHeapFree()
+{
+  return 0;
+}
+
+uint32_t halHeapLargestBlock()
+{
+  return 0;
+}
+
+bool halReadClimate(float *humidity, float *temperature)
+{
+  *humidity = climateHumidity;
+  *temperature = climateTemperature;
+  return climateOk;
+}
+
+uint32_t halReadSoilMoisture(uint8_t channel)
+{
+  return soilMoisture;
+}
+
+bool halWaterIsLow()
+{
+  return waterLow;
+}
+
+bool halPumpOpen(uint8_t pin)
+{
+  if (waterLow)
+  {
+    return false;
+  }
+  halPinWrite(pin, 0);
+  return true;
+}
+
+void halPumpClose(uint8_t pin)
+{
+  halPinWrite(pin, 1);
+}
+
+void halNvsOpen()
+{
+}
+
+void halNvsClose()
+{
+}
+
+size_t halNvsLength(const char *key)
+{
+  auto it = nvsBlobs.find(key);
+  return (it == nvsBlobs.end()) ? 0 : it->second.size();
+}
+
+size_t halNvsRead(const char *key, void *data, size_t length)
+{
+  auto it = nvsBlobs.find(key);
+  if (it == nvsBlobs.end() || it->second.size() > length)
+  {
+    return 0;
+  }
+  memcpy(data, it->second.data(), it->second.size());
+  return it->second.size();
+}
+
+//Power is gone once the scheduled writes are used up, nothing reaches the flash any more
+static bool nvsPowered()
+{
+  if (nvsWritesLeft == 0)
+  {
+    return false;
+  }
+  if (nvsWritesLeft > 0)
+  {
+    nvsWritesLeft--;
+  }
+  nvsWrites++;
+  return true;
+}
+
+size_t halNvsWrite(const char *key, const void *data, size_t length)
+{
+  if (!nvsPowered())
+  {
+    return 0;
+  }
+  nvsBlobs[key].assign((const uint8_t *)data, (const uint8_t *)data + length);
+  return length;
+}
+
+uint16_t halNvsReadU16(const char *key, uint16_t defaultValue)
+{
+  auto it = nvsU16.find(key);
+  return (it == nvsU16.end()) ? defaultValue : it->second;
+}
+
+void halNvsRemove(const char *key)
+{
+  if ((nvsBlobs.count(key) == 0 && nvsU16.count(key) == 0) || !nvsPowered())
+  {
+    return;
+  }
+  nvsBlobs.erase(key);
+  nvsU16.erase(key);
+}
+
+void halNvsClear()
+{
+  nvsBlobs.clear();
+  nvsU16.clear();
+}
+
+//The broker takes every waiting message and acknowledges it at once
+static void mqttDeliver()
+{
+  mqttOutboxEntry *entry;
+
+  while ((entry = mqttOutboxNext()) != NULL)
+  {
+    if (mqttRecord)
+    {
+      mqttLast[entry->topic] = entry->payload;
+    }
+    mqttCount++;
+    mqttOutboxSent(entry, ++mqttPacketId);
+    mqttOutboxAcked(mqttPacketId);
+  }
+}
+
+bool halMqttPublish(const char *topic, const char *payload)
+{
+  if (!mqttOutboxPut(topic, payload, MQTT_QOS1 | MQTT_RETAIN))
+  {
+    mqttDropped++;
+    return false;
+  }
+  if (mqttConnected)
+  {
+    mqttDeliver();
+  }
+  return true;
+}
+
+void simSetMqttConnected(bool connected)
+{
+  mqttConnected = connected;
+  if (connected)
+  {
+    mqttDeliver();
+  }
+}
+
+uint32_t simMqttDropped()
+{
+  return mqttDropped;
+}
+
+void halLock()
+{
+}
+
+void halUnlock()
+{
+}
+
+static void printLine(const char *line, size_t length)
+{
+  printf("%.*s\n", (int)length, line);
+}
+
+void simDrainLog()
+{
+  loggerDrain(verboseLog ? printLine : NULL);
+}
@@ -0,0 +1,46 @@
+#ifndef HAL_NATIVE_H
+#define HAL_NATIVE_H
+
+#include <stdint.h>
+#include "hal.h"
+
+//Simulator side of the native HAL: a virtual clock, scripted sensors and a recorded pin history.
+
+typedef void (*simPinHook)(uint8_t pin, uint8_t level);
+
+//Virtual time in ms since the start of the simulation, the RTC reads epoch + time
+void simBegin(uint32_t epoch, simPinHook onPinWrite);
+void simSetTime(uint64_t ms);
+uint64_t simTime();
+
+//The uptime counter (halUptimeUs) runs ppm fast against the virtual clock, like a crystal off by that
+void simSetClockDrift(int32_t ppm);
+
+uint8_t simPinLevel(uint8_t pin);
+
+void simSetClimate(float humidity, float temperature, bool ok);
+void simSetSoilMoisture(uint32_t mV);
+
+//Float switch settled on a new level. Low water cuts the pump pin like the debounce ISR does.
+void simSetWaterLow(bool lowWater);
+
+//NVS: writes and removes after the next writes ones are lost, -1 powers it again. Counts what reached it.
+void simNvsPowerCut(int32_t writes);
+uint32_t simNvsWrites();
+bool simNvsCorrupt(const char *key); //flips a bit in the middle of a blob, false if it does not exist
+
+uint32_t simHistoryWrites(); //halHistoryWrite calls
+
+uint32_t simMqttCount();
+const char *simMqttLast(const char *topic); //last payload published on topic, NULL if none
+void simSetMqttRecord(bool record);         //off: only count, simMqttLast() is not updated
+
+//halMqttPublish goes through the outbox (mqtt_outbox.h), the broker receives it while connected and
+//everything still waiting when the connection is back. Dropped: outbox full.
+void simSetMqttConnected(bool connected);
+uint32_t simMqttDropped();
+
+void simSetVerbose(bool verbose);
+void simDrainLog(); //prints the queued log lines when verbose, drops them otherwise
+
+#endif
@@ -0,0 +1,1053 @@
+//Week simulator, runs the portable control path against the native HAL on a virtual clock.
+//  pio run -e native -t exec        (or: .pio/build/native/program [-v] [weeks])
+//Before the week, calendar saves are cut off by a power loss after every possible NVS write.
+//Every actuator pin change is checked against a brute force expansion of the scenario calendars.
+//The uptime counter runs SIM_DRIFT_PPM fast, the time service only learns the wall clock from hourly
+//SNTP samples (with a day long network outage). Calendar transitions must still happen in their wall
+//clock minute, at most SIM_CLOCK_TOLERANCE after CALENDAR_TIMER_GUARD into it.
+//The MQTT broker is unreachable twice a week, after each outage the retained actuator states must
+//match the pins again. Group membership must survive a reboot and a stale group calendar must not
+//replace the installed one. The history replay after each outage must hold every sample recorded
+//during it, and a full query after a reboot everything but the last unflushed records. Every published
+//sensor value must stay within its deadband of the current one and go out again within its max interval.
+//The site is at UTC+3 (SNTP samples are UTC), moved to UTC+4 once with the clock following.
+#include <algorithm>
+#include <chrono>
+#include <queue>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hal_native.h"
+#include "controller.h"
+#include "telemetry.h"
+#include "time_service.h"
+#include "diag.h"
+#include "logger.h"
+#include "calendar_engine.h"
+#include "calendar_store.h"
+#include "calendar_delta.h"
+#include "calendar_upload.h"
+#include "groups.h"
+#include "history_store.h"
+
+#define SIM_EPOCH 1704585600UL //2024-01-07 00:00:00 UTC, a Sunday
+#define SIM_BOOT 20000         //ms after midnight
+#define SIM_SENSOR_PERIOD 10000    //SENSOR_PERIOD in main.cpp, every sample is reported
+#define SIM_TELEMETRY_PERIOD 60000 //history samples
+#define SIM_DRIFT_PPM 40
+#define SIM_CLOCK_TOLERANCE 200 //ms
+#define SIM_CHECK_OFFSET (CALENDAR_TIMER_GUARD + SIM_CLOCK_TOLERANCE) //ms into every wall clock minute
+#define SIM_SNTP_PERIOD 3600000
+#define SIM_SNTP_FIRST 45000 //ms after boot, WiFi is up
+#define SIM_RTC_ERROR 3      //s the RTC is behind at boot, fixed by the first SNTP sample
+#define SIM_UTC_OFFSET 10800 //s, the wall clock and the RTC are local time
+#define SIM_DEBOUNCE 30      //ms, float switch debounce window
+#define MS_PER_DAY 86400000ULL
+
+#define DAY(d) (1 << (d))
+#define AT(d, h, m) ((uint64_t)(d) * MS_PER_DAY + ((h) * 60 + (m)) * 60000ULL)
+
+//Scenario events
+#define EV_CHECK 1
+#define EV_SENSOR 2
+#define EV_TELEMETRY 3
+#define EV_WATER_LOW 4
+#define EV_WATER_OK 5
+#define EV_DATETIME 6 //value: seconds added to the wall clock, sent as a datetime message
+#define EV_MANUAL 7     //value: type << 1 | action
+#define EV_SNTP 8
+#define EV_RTC_WRITE 9
+#define EV_MQTT_DOWN 10
+#define EV_MQTT_UP 11
+#define EV_UTC_OFFSET 12 //value: new UTC offset in s
+#define EV_REBOOT 13     //the float switch reads empty until its first debounced sample
+
+typedef struct
+{
+  uint64_t at;
+  uint8_t kind;
+  int32_t value;
+} simEvent;
+
+struct laterFirst
+{
+  bool operator()(const simEvent &a, const simEvent &b) const { return a.at > b.at; }
+};
+
+typedef struct
+{
+  const char *actuator;
+  const calendarRule *rules;
+  uint16_t length;
+} simScenario;
+
+static const calendarRule waterRules[] = {{6 * 60, DAYS_ALL, 1}, {6 * 60 + 10, DAYS_ALL, 0},
+                                          {18 * 60, DAYS_WEEKDAYS, 1}, {18 * 60 + 5, DAYS_WEEKDAYS, 0}};
+static const calendarRule fanRules[] = {{8 * 60, DAYS_ALL, 1}, {20 * 60, DAYS_ALL, 0}};
+static const calendarRule ledRules[] = {{7 * 60, DAYS_WEEKEND, 1}, {19 * 60, DAYS_WEEKEND, 0},
+                                        {12 * 60, DAY(3), 1}, {12 * 60 + 30, DAY(3), 0}};
+static const calendarRule lampRules[] = {{22 * 60, DAY(1), 1}, {2 * 60, DAY(2), 0}}; //Monday night
+//Actuators of actuatorTable without a row here keep an empty calendar
+static const simScenario scenarios[] = {
+    {"water", waterRules, 4}, {"fan", fanRules, 2}, {"led", ledRules, 4}, {"lamp", lampRules, 2}};
+
+static std::priority_queue<simEvent, std::vector<simEvent>, laterFirst> events;
+static uint8_t expectedTable[ACTUATOR_COUNT][MINUTES_PER_WEEK];
+static uint8_t expected[ACTUATOR_COUNT];
+static const simScenario *scenarioOf[ACTUATOR_COUNT]; //by type - 1
+static uint8_t fanType;
+static uint16_t checkedMinute;
+static bool waterLow, scripted;
+static int64_t wallOffsetMs; //datetime messages move the wall clock
+static int32_t utcOffset = SIM_UTC_OFFSET;
+static uint32_t failures, pinChanges;
+static uint32_t evaluations;
+static double evaluateNs, evaluateMaxNs;
+static std::vector<uint32_t> offlineSamples; //recorded while the broker is away
+static uint32_t historySamples, historyBytes;
+static uint64_t reportedAt[TELEMETRY_SIGNALS];
+static uint32_t reportedValues, reportedSamples;
+
+//What the firmware should read, SNTP serves it
+static uint64_t wallMs()
+{
+  return SIM_EPOCH * 1000ULL + simTime() + wallOffsetMs;
+}
+
+static void fail(const char *what, uint8_t pin)
+{
+  uint32_t now = (uint32_t)(wallMs() / 1000);
+  printf("FAIL day %u %02u:%02u:%02u pin %u: %s\n", minuteOfWeek(now) / MINUTES_PER_DAY, (now / 3600) % 24, (now / 60) % 60,
+         now % 60, pin, what);
+  failures++;
+}
+
+//Reference model: every rule expanded to every day it covers, the last transition before a minute wins
+static void expandScenario()
+{
+  for (const simScenario &scenario : scenarios)
+  {
+    uint8_t type = actuatorType(scenario.actuator);
+    if (type == 0)
+    {
+      printf("FAIL scenario: no actuator %s\n", scenario.actuator);
+      failures++;
+      continue;
+    }
+    scenarioOf[type - 1] = &scenario;
+  }
+  fanType = actuatorType("fan");
+
+  for (int a = 0; a < ACTUATOR_COUNT; a++)
+  {
+    int8_t at[MINUTES_PER_WEEK];
+    int8_t state = -1;
+
+    memset(at, -1, sizeof(at));
+    for (int r = 0; scenarioOf[a] != NULL && r < scenarioOf[a]->length; r++)
+    {
+      const calendarRule &rule = scenarioOf[a]->rules[r];
+      for (int d = 0; d < 7; d++)
+      {
+        if (rule.days & DAY(d))
+        {
+          at[d * MINUTES_PER_DAY + rule.minute] = rule.action;
+        }
+      }
+    }
+    for (int pass = 0; pass < 2; pass++) //The second pass carries the end of the week over to its start
+    {
+      for (int m = 0; m < MINUTES_PER_WEEK; m++)
+      {
+        state = (at[m] >= 0) ? at[m] : state;
+        expectedTable[a][m] = (state > 0);
+      }
+    }
+  }
+}
+
+static void applyExpected(uint8_t a, uint8_t state)
+{
+  expected[a] = actuatorIsPump(a + 1) ? (state && !waterLow) : state;
+}
+
+static void onPinWrite(uint8_t pin, uint8_t level)
+{
+  pinChanges++;
+  uint32_t phase = wallMs() % 60000;
+  if (!scripted && phase >= SIM_CHECK_OFFSET)
+  {
+    fail(phase >= 30000 ? "early transition" : "late transition", pin);
+  }
+}
+
+static void evaluate(uint8_t forceType, uint64_t *deadline)
+{
+  auto start = std::chrono::steady_clock::now();
+  uint32_t waitMs = controllerEvaluate(forceType, timeNowMs());
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+  evaluations++;
+  evaluateNs += ns;
+  evaluateMaxNs = (ns > evaluateMaxNs) ? ns : evaluateMaxNs;
+  *deadline = simTime() + waitMs * 1000000ULL / (1000000 + SIM_DRIFT_PPM); //esp_timer counts uptime
+}
+
+//Control task side of timeService(), like serviceClock() in main.cpp
+static uint8_t serviceClock()
+{
+  uint8_t result = timeService();
+
+  if (timeRtcWritePending())
+  {
+    events.push({simTime() + 1000 - timeNowMs() % 1000 + 1, EV_RTC_WRITE, 0});
+  }
+  return result;
+}
+
+//Next time the wall clock is SIM_CHECK_OFFSET ms into a minute
+static uint64_t nextCheck()
+{
+  uint32_t wait = (60000 + SIM_CHECK_OFFSET - wallMs() % 60000) % 60000;
+  return simTime() + (wait ? wait : 60000);
+}
+
+//Walks the reference model up to the current RTC minute and compares every pin
+static void check()
+{
+  uint16_t now = minuteOfWeek(wallMs() / 1000);
+
+  while (checkedMinute != now)
+  {
+    uint16_t previous = checkedMinute;
+    checkedMinute = (checkedMinute + 1) % MINUTES_PER_WEEK;
+    for (int a = 0; a < ACTUATOR_COUNT; a++)
+    {
+      if (expectedTable[a][checkedMinute] != expectedTable[a][previous])
+      {
+        applyExpected(a, expectedTable[a][checkedMinute]);
+      }
+    }
+  }
+  for (int a = 0; a < ACTUATOR_COUNT; a++)
+  {
+    if (simPinLevel(actuatorTable[a].pin) != (expected[a] ? 0 : 1))
+    {
+      fail(expected[a] ? "should be on" : "should be off", actuatorTable[a].pin);
+      expected[a] = !expected[a]; //Report once
+    }
+  }
+}
+
+static bool loadsAs(const calendarRule *rules, uint16_t length)
+{
+  calendarRule *loaded;
+  uint16_t loadedLength, version;
+  uint8_t flags;
+
+  calendarStoreLoad("test", &loaded, &loadedLength, &version, &flags);
+  bool same = loadedLength == length && version == length && memcmp(loaded, rules, length * sizeof(calendarRule)) == 0;
+  free(loaded);
+  return same;
+}
+
+//A 40 rule calendar is replaced by a 70 rule one that differs on page 1 and from page 2 on. Whatever
+//write the power is lost after, one of the two must load. Corrupted records fall back to the old one,
+//which the next save keeps.
+static void checkStorage()
+{
+  calendarRule before[40], after[70];
+  uint32_t writes = 0;
+
+  for (int i = 0; i < 70; i++)
+  {
+    calendarRule rule = {(uint16_t)(i * 20), (uint8_t)(1 + i % DAYS_ALL), (uint8_t)(i & 1)};
+    after[i] = rule;
+    if (i < 40)
+    {
+      before[i] = rule;
+    }
+  }
+  after[20].action = !after[20].action;
+
+  for (int32_t cut = 0;; cut++)
+  {
+    halNvsClear();
+    calendarStoreSave("test", 40, 0, before, 40, NULL, 0);
+    uint32_t start = simNvsWrites();
+    simNvsPowerCut(cut);
+    bool saved = calendarStoreSave("test", 70, 0, after, 70, before, 40);
+    simNvsPowerCut(-1);
+    writes = simNvsWrites() - start;
+
+    if (!(saved ? loadsAs(after, 70) : loadsAs(before, 40) || loadsAs(after, 70)))
+    {
+      printf("FAIL storage: power lost after %d writes\n", cut);
+      failures++;
+    }
+    if (saved)
+    {
+      break;
+    }
+  }
+  if (writes != 5) //pages 1 to 4 and the header
+  {
+    printf("FAIL storage: %u writes for a partial change\n", writes);
+    failures++;
+  }
+
+  //The second save wrote header H1 and page 1 into slot b
+  static const char *const corrupted[] = {"testH1", "testP1b"};
+  for (const char *key : corrupted)
+  {
+    halNvsClear();
+    calendarStoreSave("test", 40, 0, before, 40, NULL, 0);
+    calendarStoreSave("test", 70, 0, after, 70, before, 40);
+    if (!simNvsCorrupt(key) || !loadsAs(before, 40))
+    {
+      printf("FAIL storage: no fallback for a corrupted %s\n", key);
+      failures++;
+    }
+  }
+
+  //After that fallback the next save must keep H0 and its pages, the only copy that loads
+  calendarRule next[40];
+  memcpy(next, before, sizeof(next));
+  next[30].action = !next[30].action;
+  for (int32_t cut = 0;; cut++)
+  {
+    halNvsClear();
+    calendarStoreSave("test", 40, 0, before, 40, NULL, 0);
+    calendarStoreSave("test", 70, 0, after, 70, before, 40);
+    simNvsCorrupt("testP1b");
+    simNvsPowerCut(cut);
+    bool saved = calendarStoreSave("test", 40, 0, next, 40, before, 40);
+    simNvsPowerCut(-1);
+
+    if (!(saved ? loadsAs(next, 40) : loadsAs(before, 40) || loadsAs(next, 40)))
+    {
+      printf("FAIL storage: save after a fallback lost the calendar after %d writes\n", cut);
+      failures++;
+    }
+    if (saved)
+    {
+      break;
+    }
+  }
+  halNvsClear();
+}
+
+//DELETE of rule on the uploaded on 08:00, on 09:00, off 10:00, in the lookup at Sunday minute
+static uint8_t deltaStateAfter(uint16_t minute, uint16_t at, uint8_t *result)
+{
+  calendarRule uploaded[] = {{480, DAYS_ALL, 1}, {540, DAYS_ALL, 1}, {600, DAYS_ALL, 0}};
+  uint8_t message[CALENDAR_BIN_HEADER + CALENDAR_BIN_RECORD] = {CALENDAR_BIN_FORMAT, CALENDAR_OP_DELETE, 1, 0, 2, 0,
+                                                                 0, 0, 0, 0, 1, 0,
+                                                                 (uint8_t)minute, (uint8_t)(minute >> 8), DAYS_ALL, 1};
+  calendarDelta delta;
+  calendarRule *rules;
+  uint16_t length;
+  uint8_t action = 0xFF;
+
+  *result = calendarDeltaDecode(message, sizeof(message), &delta);
+  if (*result == CALENDAR_DELTA_OK)
+  {
+    *result = calendarDeltaApply(&delta, uploaded, 3, 1, &rules, &length);
+  }
+  if (*result == CALENDAR_DELTA_OK)
+  {
+    length = calendarCompile(rules, length);
+    calendarStateAt(rules, length, at, &action);
+    free(rules);
+  }
+  return action;
+}
+
+//Deltas apply to the calendar as uploaded, not to its compiled lookup table
+static void checkDelta()
+{
+  calendarRule uploaded[] = {{480, DAYS_ALL, 1}, {540, DAYS_ALL, 1}, {600, DAYS_ALL, 0}};
+  uint8_t result;
+
+  if (calendarCompile(uploaded, 3) != 2)
+  {
+    printf("FAIL delta: the 09:00 rule is not redundant after compiling\n");
+    failures++;
+  }
+  if (deltaStateAfter(480, 570, &result) != 1 || result != CALENDAR_DELTA_OK)
+  {
+    printf("FAIL delta: deleting 08:00 did not leave on 09:00-10:00 (%u)\n", result);
+    failures++;
+  }
+  if (deltaStateAfter(540, 510, &result) != 1 || result != CALENDAR_DELTA_OK)
+  {
+    printf("FAIL delta: deleting the redundant 09:00 rule failed (%u)\n", result);
+    failures++;
+  }
+}
+
+//Escapes, skipped values of every type, a field out of range and keys in any order
+static const char uploadDocument[] =
+    "{\"id\":\"wall \\\"3\\\"\",\"version\":42,\"meta\":{\"tags\":[\"a\",{\"b\":[1,-2.5e3,true,null]}]},"
+    "\"calendar\":[{\"dofw\":1,\"h\":6,\"m\":0,\"r\":1,\"a\":1},{\"dofw\":1,\"h\":6,\"m\":10,\"r\":1,\"a\":0},"
+    "{\"dofw\":3,\"h\":22,\"m\":26,\"r\":0,\"a\":1,\"note\":\"x\\\\y}\"},{\"dofw\":4,\"h\":23,\"m\":59,\"r\":0,\"a\":0},"
+    "{\"dofw\":2,\"h\":25,\"m\":0,\"r\":0,\"a\":1},{\"h\":12,\"m\":30,\"dofw\":5,\"a\":1,\"r\":2}],\"end\":[]}";
+
+//Feeds document, the first chunk first bytes long and the rest in chunks of chunk bytes. The rules
+//collected stay in upload.
+static uint8_t uploadInChunks(const char *document, size_t length, size_t first, size_t chunk, calendarUpload *upload)
+{
+  uint8_t result = CALENDAR_PARSE_BUSY;
+
+  calendarUploadBegin(upload);
+  for (size_t at = 0; at < length && result == CALENDAR_PARSE_BUSY;)
+  {
+    size_t size = (at == 0) ? first : chunk;
+    size = (size < length - at) ? size : length - at;
+    result = calendarUploadFeed(upload, document + at, size);
+    at += size;
+  }
+  return result;
+}
+
+//Compiled rules and version of the upload match the reference
+static bool sameUpload(calendarUpload *upload, const calendarUpload *reference)
+{
+  calendarRule compiled[2][64];
+  uint16_t lengths[2];
+  const calendarUpload *uploads[2] = {upload, reference};
+
+  for (uint8_t i = 0; i < 2; i++)
+  {
+    if (uploads[i]->length > 64)
+    {
+      return false;
+    }
+    memcpy(compiled[i], uploads[i]->rules, uploads[i]->length * sizeof(calendarRule));
+    lengths[i] = calendarCompile(compiled[i], uploads[i]->length);
+  }
+  return upload->parser.version == reference->parser.version && lengths[0] == lengths[1] &&
+         memcmp(compiled[0], compiled[1], lengths[0] * sizeof(calendarRule)) == 0;
+}
+
+//The streaming parser gives the same calendar whatever the document is split into
+static void checkUploadSplits()
+{
+  static const char *const malformed[] = {"{\"calendar\":[{\"h\":6,\"a\":1}}]}", "[{\"h\":6}]",
+                                          "{\"calendar\":[{\"h\":@}]}", "{\"a\":[[[[[[[[1]]]]]]]]}", "x{}"};
+  size_t length = sizeof(uploadDocument) - 1;
+  calendarUpload reference, upload;
+
+  if (uploadInChunks(uploadDocument, length, length, length, &reference) != CALENDAR_PARSE_DONE ||
+      reference.parser.version != 42 || reference.length != 5)
+  {
+    printf("FAIL upload: reference document, %u rules\n", reference.length);
+    failures++;
+  }
+  if (uploadInChunks(uploadDocument, length, 1, 1, &upload) != CALENDAR_PARSE_DONE || !sameUpload(&upload, &reference))
+  {
+    printf("FAIL upload: document in 1 byte chunks\n");
+    failures++;
+  }
+  calendarUploadAbort(&upload);
+  for (size_t first = 1; first < length; first++)
+  {
+    if (uploadInChunks(uploadDocument, length, first, length, &upload) != CALENDAR_PARSE_DONE ||
+        !sameUpload(&upload, &reference))
+    {
+      printf("FAIL upload: document split at %zu\n", first);
+      failures++;
+    }
+    calendarUploadAbort(&upload);
+    if (uploadInChunks(uploadDocument, first, first, first, &upload) != CALENDAR_PARSE_BUSY)
+    {
+      printf("FAIL upload: document truncated to %zu bytes not pending\n", first);
+      failures++;
+    }
+    calendarUploadAbort(&upload);
+  }
+  for (const char *document : malformed)
+  {
+    for (size_t chunk : {(size_t)1, strlen(document)})
+    {
+      if (uploadInChunks(document, strlen(document), chunk, chunk, &upload) != CALENDAR_PARSE_ERROR)
+      {
+        printf("FAIL upload: %s accepted in %zu byte chunks\n", document, chunk);
+        failures++;
+      }
+      calendarUploadAbort(&upload);
+    }
+  }
+  calendarUploadAbort(&reference);
+}
+
+//Last state the broker holds for every actuator, after the outbox was flushed
+static void checkRetained()
+{
+  for (uint8_t a = 0; a < ACTUATOR_COUNT; a++)
+  {
+    const char *last = simMqttLast(monitorTopic(TOPIC_ACTUATOR + a));
+    const char *state = (simPinLevel(actuatorTable[a].pin) == 0) ? "on" : "off";
+    if (last == NULL || strcmp(last, state) != 0)
+    {
+      fail("retained state lost during the broker outage", actuatorTable[a].pin);
+    }
+  }
+}
+
+//Installs the current rules of type 1 again
+static void setDeviceCalendar(uint16_t version, bool deviceOverride)
+{
+  calendarInfo *itemInfo = controllerCalendar(1);
+  calendarRule *rules = (calendarRule *)malloc(itemInfo->sourceLength * sizeof(calendarRule));
+
+  memcpy(rules, itemInfo->source, itemInfo->sourceLength * sizeof(calendarRule));
+  controllerSetCalendar(1, rules, itemInfo->sourceLength, version, deviceOverride);
+}
+
+static bool storedOverride()
+{
+  calendarRule *rules;
+  uint16_t length, version;
+  uint8_t flags;
+
+  calendarStoreLoad(actuatorName(1), &rules, &length, &version, &flags);
+  free(rules);
+  return (flags & CALENDAR_STORE_OVERRIDE) != 0;
+}
+
+//After loadScenario(), every calendar is at version 1
+static void checkGroups()
+{
+  uint8_t index = 0xFF;
+
+  if (!groupsSet("site1,wall3", 11) || groupsSet("a/b", 3) || groupsSet("a,a", 3) || groupsSet("a,b,c,d", 7) ||
+      groupsSet("wall3,", 6))
+  {
+    printf("FAIL groups: list validation\n");
+    failures++;
+  }
+  groupsBegin(); //As after a reboot
+  const char *suffix = groupTopicSuffix("doa/group/wall3/control/fan_calendar", &index);
+  if (groupCount() != 2 || suffix == NULL || strcmp(suffix, "fan_calendar") != 0 || index != 1 ||
+      groupTopicSuffix("doa/group/wall30/control/fan", &index) != NULL)
+  {
+    printf("FAIL groups: not restored from NVS\n");
+    failures++;
+  }
+  if (controllerAcceptsCalendar(1, 1, true) || !controllerAcceptsCalendar(1, 2, true) ||
+      !controllerAcceptsCalendar(1, 0, false))
+  {
+    printf("FAIL groups: calendar version rule\n");
+    failures++;
+  }
+  //A device upload (version 0) holds off newer group pushes until released, also after a reboot
+  setDeviceCalendar(0, true);
+  if (controllerAcceptsCalendar(1, 2, true) || !storedOverride())
+  {
+    printf("FAIL groups: group push replaced a device calendar\n");
+    failures++;
+  }
+  controllerReleaseCalendars();
+  if (!controllerAcceptsCalendar(1, 1, true) || storedOverride())
+  {
+    printf("FAIL groups: device calendar not released\n");
+    failures++;
+  }
+  setDeviceCalendar(1, false);
+  groupsSet("", 0);
+}
+
+//A calendar reset must only drop the calendars, the rest of the namespace stays
+static void checkReset()
+{
+  char key[16];
+
+  groupsSet("site1", 5);
+  controllerResetCalendars();
+  snprintf(key, sizeof(key), "%sH0", actuatorName(fanType));
+  if (halNvsLength(key) > 0 || controllerCalendar(fanType)->source != NULL)
+  {
+    printf("FAIL reset: calendar kept\n");
+    failures++;
+  }
+  if (halNvsLength(GROUPS_NVS_KEY) == 0 || halNvsLength(TELEMETRY_NVS_KEY) == 0 || halNvsLength(TIME_NVS_KEY) == 0)
+  {
+    printf("FAIL reset: other settings cleared\n");
+    failures++;
+  }
+  groupsSet("", 0);
+}
+
+static void checkTelemetryConfig()
+{
+  const telemetryThreshold *thresholds = telemetryThresholds();
+
+  if (!telemetrySetConfig("soilmoisture 20 5 900;heartbeat 0 0 1800", 40) || telemetrySetConfig("soil 1 1 1", 10) ||
+      telemetrySetConfig("humidity -1 0 10", 16) || telemetrySetConfig("humidity 1 20 10", 16) ||
+      telemetrySetConfig("humidity 1 0 0", 14) || telemetrySetConfig("humidity 1 0 10 x", 17))
+  {
+    printf("FAIL telemetry: threshold validation\n");
+    failures++;
+  }
+  telemetryConfigBegin(); //As after a reboot
+  if (thresholds[TELEMETRY_SOILMOISTURE].deadband != 20 || thresholds[TELEMETRY_HEARTBEAT].maxInterval != 1800 ||
+      thresholds[TELEMETRY_HUMIDITY].maxInterval != 600)
+  {
+    printf("FAIL telemetry: thresholds not restored from NVS\n");
+    failures++;
+  }
+  telemetrySetConfig("", 0);
+}
+
+#ifndef TELEMETRY_SNAPSHOT
+//The broker's value of a signal must be within its deadband of the current one
+static void checkReported(uint8_t topic, uint8_t signal, float current)
+{
+  const char *last = simMqttLast(monitorTopic(topic));
+
+  if (last == NULL || fabsf((float)atof(last) - current) >= telemetryThresholds()[signal].deadband + 0.01f)
+  {
+    printf("FAIL telemetry: %s %s, the sample is %.2f\n", monitorTopic(topic), last ? last : "missing", current);
+    failures++;
+  }
+}
+#endif
+
+static void report(const sensorData &data, const char *date, bool online)
+{
+  uint8_t due = telemetryReport(data, date, (uint32_t)simTime());
+
+  reportedSamples++;
+  for (uint8_t i = 0; i < TELEMETRY_SIGNALS; i++)
+  {
+    if (due & (1 << i))
+    {
+      reportedAt[i] = simTime();
+      reportedValues += (i == TELEMETRY_HEARTBEAT) ? 3 : 1; //datetime, version, awake
+    }
+    else if (simTime() - reportedAt[i] > telemetryThresholds()[i].maxInterval * 1000ULL)
+    {
+      printf("FAIL telemetry: signal %u quiet for %llu s\n", i, (unsigned long long)(simTime() - reportedAt[i]) / 1000);
+      failures++;
+    }
+  }
+#ifndef TELEMETRY_SNAPSHOT
+  if (online)
+  {
+    checkReported(TOPIC_HUMIDITY, TELEMETRY_HUMIDITY, data.humidity);
+    checkReported(TOPIC_TEMPERATURE, TELEMETRY_TEMPERATURE, data.temperature);
+    checkReported(TOPIC_SOILMOISTURE, TELEMETRY_SOILMOISTURE, data.soilMoisture);
+  }
+#endif
+}
+
+static void onStatus(uint8_t type, uint8_t status)
+{
+  historyEvent record = {timeNow(), type, status};
+
+  telemetryPublishStatus(type, status);
+  historyRecordEvent(&record);
+}
+
+static void recordHistory(const sensorData &data, bool online)
+{
+  historySample sample = {timeNow(), data.humidity, data.temperature, (uint16_t)data.soilMoisture, data.lowWater};
+
+  historyRecordSample(&sample);
+  historySamples++;
+  if (!online)
+  {
+    offlineSamples.push_back(sample.time);
+  }
+}
+
+//Sends the running query like the network task, decodes it like the backend. False without the end.
+static bool drainHistory(std::vector<uint32_t> *times, uint32_t *coarse)
+{
+  historyCoder decoder;
+  historySample sample;
+  historyEvent event;
+  historyBlockHeader header;
+  size_t length;
+
+  for (int i = 0; i < 1000; i++) //Positions are skipped HISTORY_SCAN_STEP at a time
+  {
+    const uint8_t *message = historyNextMessage(&length);
+    if (message == NULL)
+    {
+      continue;
+    }
+    memcpy(&header, message, sizeof(header));
+    historyMessageSent();
+    historyBytes += length;
+    if (header.kind == HISTORY_END)
+    {
+      return true;
+    }
+    if (!historyDecoderBegin(&decoder, message, length))
+    {
+      printf("FAIL history: block %u does not decode\n", header.sequence);
+      failures++;
+      continue;
+    }
+    if (header.kind == HISTORY_EVENTS)
+    {
+      while (historyDecodeEvent(&decoder, &event))
+      {
+      }
+      continue;
+    }
+    while (historyDecodeSample(&decoder, &sample))
+    {
+      if (header.kind == HISTORY_SENSOR_COARSE)
+      {
+        (*coarse)++;
+      }
+      else
+      {
+        times->push_back(sample.time);
+      }
+    }
+  }
+  return false;
+}
+
+//Every sample recorded during the outage must come back in the replay
+static void checkReplay()
+{
+  std::vector<uint32_t> times;
+  uint32_t coarse = 0;
+
+  historyReplay(timeNow());
+  if (!drainHistory(&times, &coarse))
+  {
+    printf("FAIL history: replay did not end\n");
+    failures++;
+  }
+  for (uint32_t time : offlineSamples)
+  {
+    if (std::find(times.begin(), times.end(), time) == times.end())
+    {
+      printf("FAIL history: sample at %u missing from the replay\n", time);
+      failures++;
+      break;
+    }
+  }
+  offlineSamples.clear();
+}
+
+//After a reboot everything but the unflushed records must still be there, older samples averaged
+static void checkHistory()
+{
+  std::vector<uint32_t> times;
+  uint32_t coarse = 0;
+
+  historyBegin();
+  historyBytes = 0;
+  historyQuery(0, timeNow());
+  if (!drainHistory(&times, &coarse))
+  {
+    printf("FAIL history: query did not end\n");
+    failures++;
+  }
+  uint32_t kept = times.size() + coarse * HISTORY_DOWNSAMPLE;
+  printf("  history %u of %u samples kept (%u averaged), %u bytes sent, %u flash writes\n",
+         (unsigned)times.size() + coarse, historySamples, coarse, historyBytes, simHistoryWrites());
+  if (kept + HISTORY_FLUSH + HISTORY_DOWNSAMPLE < historySamples || (coarse == 0 && kept + HISTORY_FLUSH < historySamples))
+  {
+    printf("FAIL history: samples lost\n");
+    failures++;
+  }
+}
+
+static void dateString(char *buffer, uint32_t unixtime)
+{
+  time_t t = unixtime;
+  struct tm parts;
+
+  gmtime_r(&t, &parts);
+  strftime(buffer, 25, "%Y-%m-%d %H:%M:%S", &parts);
+}
+
+static void loadScenario()
+{
+  for (int a = 0; a < ACTUATOR_COUNT; a++)
+  {
+    if (scenarioOf[a] == NULL)
+    {
+      continue;
+    }
+    calendarRule *rules = (calendarRule *)malloc(scenarioOf[a]->length * sizeof(calendarRule));
+    memcpy(rules, scenarioOf[a]->rules, scenarioOf[a]->length * sizeof(calendarRule));
+    controllerSetCalendar(a + 1, rules, calendarNormalize(rules, scenarioOf[a]->length), 1, false);
+  }
+}
+
+static void scheduleWeek(uint64_t week)
+{
+  uint64_t base = week * 7 * MS_PER_DAY;
+
+  events.push({base + AT(3, 5, 50), EV_WATER_LOW, 0}); //Empty before the 06:00 watering
+  events.push({base + AT(3, 7, 0), EV_WATER_OK, 0});
+  events.push({base + AT(4, 6, 5), EV_WATER_LOW, 0}); //Runs dry while watering
+  events.push({base + AT(4, 6, 30), EV_WATER_OK, 0});
+  events.push({base + AT(6, 10, 0) + 15000, EV_MANUAL, fanType << 1 | 0}); //Overrides the calendar until 20:00
+  events.push({base + AT(1, 21, 50), EV_MQTT_DOWN, 0}); //Lamp on and off again while the broker is away
+  events.push({base + AT(2, 2, 30), EV_MQTT_UP, 0});
+  events.push({base + AT(4, 6, 2), EV_MQTT_DOWN, 0}); //Pump on, cut by the float switch, water back
+  events.push({base + AT(4, 6, 40), EV_MQTT_UP, 0});
+  if (week == 0)
+  {
+    events.push({AT(5, 17, 0) + 30000, EV_DATETIME, 2 * 3600}); //Skips the 18:00 watering
+    events.push({AT(6, 4, 55), EV_UTC_OFFSET, SIM_UTC_OFFSET + 3600}); //Wall 06:55, skips the 07:00 LED transition
+    events.push({AT(5, 6, 3) + 5000, EV_REBOOT, 0}); //While watering
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int weeks = 1;
+  uint64_t deadline = 0;
+  sensorData data = {NAN, NAN, 0, false, 0};
+  uint32_t samples = 0;
+  char date[25];
+  bool online = true;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-v") == 0)
+    {
+      simSetVerbose(true);
+    }
+    else
+    {
+      weeks = atoi(argv[i]) > 0 ? atoi(argv[i]) : 1;
+    }
+  }
+
+  loggerBegin();
+  expandScenario();
+  simBegin(SIM_EPOCH, onPinWrite);
+  checkStorage();
+  simDrainLog();
+  simSetTime(SIM_BOOT);
+  simSetClockDrift(SIM_DRIFT_PPM);
+  halBegin();
+  halRtcAdjust(SIM_EPOCH + SIM_BOOT / 1000 - SIM_RTC_ERROR);
+  timeBegin();
+  timeSetUtcOffset(SIM_UTC_OFFSET); //No SNTP yet, the clock stays
+  timeBegin();                      //As after a reboot
+  if (timeUtcOffset() != SIM_UTC_OFFSET)
+  {
+    printf("FAIL UTC offset not restored from NVS\n");
+    failures++;
+  }
+  historyBegin();
+  telemetryBegin("SIMULATOR", "sim");
+  telemetryConfigBegin();
+  checkTelemetryConfig();
+  scripted = true;
+  controllerBegin(onStatus);
+  checkDelta();
+  checkUploadSplits();
+  loadScenario();
+  checkGroups();
+  checkedMinute = minuteOfWeek(wallMs() / 1000);
+  for (int a = 0; a < ACTUATOR_COUNT; a++)
+  {
+    applyExpected(a, expectedTable[a][checkedMinute]);
+  }
+  evaluate(CALENDAR_ALL, &deadline); //Boot
+  scripted = false;
+
+  for (int w = 0; w < weeks; w++)
+  {
+    scheduleWeek(w);
+  }
+  events.push({nextCheck(), EV_CHECK, 0});
+  events.push({SIM_BOOT + SIM_SENSOR_PERIOD, EV_SENSOR, 0});
+  events.push({SIM_BOOT + SIM_TELEMETRY_PERIOD, EV_TELEMETRY, 0});
+  events.push({SIM_BOOT + SIM_SNTP_FIRST, EV_SNTP, 0});
+
+  auto started = std::chrono::steady_clock::now();
+  uint64_t end = (uint64_t)weeks * 7 * MS_PER_DAY;
+  while (simTime() < end)
+  {
+    simDrainLog();
+    if (deadline <= events.top().at)
+    {
+      simSetTime(deadline);
+      evaluate(serviceClock() == TIME_STEPPED ? CALENDAR_ALL : 0, &deadline);
+      continue;
+    }
+
+    simEvent event = events.top();
+    events.pop();
+    simSetTime(event.at);
+    scripted = true;
+    switch (event.kind)
+    {
+    case EV_CHECK:
+      scripted = false;
+      check();
+      events.push({nextCheck(), EV_CHECK, 0});
+      break;
+    case EV_SENSOR:
+      samples++;
+      //Slow drifts, soil moisture jumps back every 45 min like after watering. Every 9th read fails.
+      simSetClimate(40 + (samples / 30) % 20, 21.5f + (samples / 12) % 7 * 0.1f, samples % 9 != 0);
+      simSetSoilMoisture(1500 + samples % 270 * 2);
+      telemetrySample(&data);
+      if (isnan(data.humidity) || isnan(data.temperature))
+      {
+        fail("climate lost after a failed read", 0);
+      }
+      dateString(date, timeNow());
+      report(data, date, online);
+      events.push({event.at + SIM_SENSOR_PERIOD, EV_SENSOR, 0});
+      break;
+    case EV_TELEMETRY:
+      recordHistory(data, online);
+      events.push({event.at + SIM_TELEMETRY_PERIOD, EV_TELEMETRY, 0});
+      break;
+    case EV_WATER_LOW:
+    case EV_WATER_OK:
+      waterLow = (event.kind == EV_WATER_LOW);
+      simSetWaterLow(waterLow);
+      controllerWaterLevel(waterLow);
+      for (uint8_t a = 0; a < ACTUATOR_COUNT; a++)
+      {
+        if (actuatorIsPump(a + 1) && !waterLow)
+        {
+          evaluate(a + 1, &deadline); //As main.cpp
+        }
+        if (actuatorIsPump(a + 1))
+        {
+          applyExpected(a, expectedTable[a][checkedMinute]);
+        }
+      }
+      break;
+    case EV_REBOOT:
+      waterLow = true;
+      simSetWaterLow(true);
+      controllerBegin(onStatus);
+      evaluate(CALENDAR_ALL, &deadline);
+      for (int a = 0; a < ACTUATOR_COUNT; a++)
+      {
+        applyExpected(a, expectedTable[a][checkedMinute]);
+      }
+      events.push({event.at + SIM_DEBOUNCE, EV_WATER_OK, 0});
+      break;
+    case EV_DATETIME:
+      wallOffsetMs += event.value * 1000LL;
+      timeSet((uint32_t)(wallMs() / 1000));
+      evaluate(CALENDAR_ALL, &deadline);
+      checkedMinute = minuteOfWeek(wallMs() / 1000);
+      for (int a = 0; a < ACTUATOR_COUNT; a++)
+      {
+        applyExpected(a, expectedTable[a][checkedMinute]);
+      }
+      break;
+    case EV_UTC_OFFSET:
+      wallOffsetMs += (event.value - utcOffset) * 1000LL;
+      utcOffset = event.value;
+      if (timeSetUtcOffset(utcOffset) != TIME_STEPPED)
+      {
+        fail("clock did not follow the UTC offset", 0);
+      }
+      serviceClock();
+      evaluate(CALENDAR_ALL, &deadline);
+      checkedMinute = minuteOfWeek(wallMs() / 1000);
+      for (int a = 0; a < ACTUATOR_COUNT; a++)
+      {
+        applyExpected(a, expectedTable[a][checkedMinute]);
+      }
+      break;
+    case EV_SNTP:
+      if ((event.at / MS_PER_DAY) % 7 != 2) //No network on Tuesdays, the RTC is checked instead
+      {
+        timeSntpSample(wallMs() - utcOffset * 1000LL); //UTC
+        uint8_t result = serviceClock();
+        if (result != TIME_UNCHANGED)
+        {
+          evaluate(result == TIME_STEPPED ? CALENDAR_ALL : 0, &deadline);
+        }
+      }
+      events.push({event.at + SIM_SNTP_PERIOD, EV_SNTP, 0});
+      break;
+    case EV_RTC_WRITE:
+      timeWriteRtc();
+      break;
+    case EV_MANUAL:
+      controllerSetActuator(event.value >> 1, event.value & 1);
+      applyExpected((event.value >> 1) - 1, event.value & 1);
+      break;
+    case EV_MQTT_DOWN:
+    case EV_MQTT_UP:
+      online = (event.kind == EV_MQTT_UP);
+      simSetMqttConnected(online);
+      if (online)
+      {
+        checkRetained();
+        checkReplay();
+      }
+      else
+      {
+        historyOffline(timeNow());
+      }
+      break;
+    }
+    scripted = false;
+  }
+  double runMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+
+  printf("Simulated %d week(s) in %.1f ms\n", weeks, runMs);
+  printf("  pin changes %u, calendar evaluations %u (avg %.0f ns, max %.0f ns), mqtt messages %u\n", pinChanges,
+         evaluations, evaluateNs / evaluations, evaluateMaxNs, simMqttCount());
+  printf("  last humidity %s, water %s\n", simMqttLast("doa/SIMULATOR/monitor/humidity"),
+         simMqttLast("doa/SIMULATOR/monitor/water"));
+  checkRetained();
+  checkHistory();
+  printf("  telemetry %u values published for %u samples, %.1f%% of reporting all 7 every minute\n", reportedValues,
+         reportedSamples, 100.0 * reportedValues / (reportedSamples * SIM_SENSOR_PERIOD / 60000.0 * 7));
+  if (simMqttDropped() > 0)
+  {
+    printf("FAIL %u message(s) dropped, outbox full\n", simMqttDropped());
+    failures++;
+  }
+
+  printf("  clock %+lld ms, drift %d ppb measured, RTC %+lld s\n", (long long)(timeNowMs() - wallMs()),
+         timeDriftPpb(), (long long)halRtcNow() - (long long)(wallMs() / 1000));
+  if (timeDriftPpb() < SIM_DRIFT_PPM * 1000 - 1000 || timeDriftPpb() > SIM_DRIFT_PPM * 1000 + 1000)
+  {
+    printf("FAIL clock drift not measured\n");
+    failures++;
+  }
+  if (halRtcNow() + 1 < wallMs() / 1000 || halRtcNow() > wallMs() / 1000 + 1)
+  {
+    printf("FAIL RTC not kept on time\n");
+    failures++;
+  }
+
+  //Every on time transition must also look on time to the firmware's own late action counter
+  char diag[384];
+  diagFormat(diag, sizeof(diag), 0);
+  printf("  diag %s\n", diag);
+  if (strstr(diag, "\"late\":[0,") == NULL)
+  {
+    printf("FAIL calendar actions reported late\n");
+    failures++;
+  }
+  checkReset();
+  if (failures > 0)
+  {
+    printf("%u failure(s)\n", failures);
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,388 @@
+#include <Arduino.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_timer.h>
+#include <mbedtls/ecdsa.h>
+#include <mbedtls/sha256.h>
+#include "esp32/rom/miniz.h"
+#include "ota.h"
+#include "hal.h"
+#include "logger.h"
+
+#define OTA_IDLE 0
+#define OTA_RECEIVING 1
+#define OTA_TRIAL 2 //new image booted, not confirmed yet
+
+#define OTA_IMAGE_MAGIC 0xE9 //first byte of an app image
+
+static const char *const stateNames[] = {"idle", "receiving", "trial"};
+
+//Kept in NVS under OTA_NVS_KEY
+typedef struct
+{
+  uint8_t state;
+  uint8_t trialBoots;
+  uint32_t size;
+  uint32_t nextChunk;
+  uint8_t sha256[32];
+  uint8_t signature[OTA_SIGNATURE_SIZE];
+  char version[OTA_VERSION_MAX];
+  char previous[17]; //partition label to roll back to
+  char error[12];    //last failure, the image with sha256 is not tried again
+} otaState;
+
+static otaState ota;
+static const char *running;
+static tinfl_decompressor *inflater; //both only while receiving
+static uint8_t *sector;
+static esp_timer_handle_t otaTimer; //confirm timeout, or the restart into the new image
+static bool restarting;
+
+static void saveState()
+{
+  halNvsOpen();
+  halNvsWrite(OTA_NVS_KEY, &ota, sizeof(ota));
+  halNvsClose();
+}
+
+static uint32_t chunkCount()
+{
+  return (ota.size + OTA_CHUNK_SIZE - 1) / OTA_CHUNK_SIZE;
+}
+
+static void freeBuffers()
+{
+  free(inflater);
+  free(sector);
+  inflater = NULL;
+  sector = NULL;
+}
+
+static void fail(const char *error)
+{
+  LOG_E("OTA %s failed: %s", ota.version, error);
+  strncpy(ota.error, error, sizeof(ota.error) - 1);
+  ota.state = OTA_IDLE;
+  freeBuffers();
+  saveState();
+}
+
+//esp_timer task. Nothing but the boot partition changes, otaBegin() notices the rollback.
+static void rollback()
+{
+  const esp_partition_t *previous = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY,
+                                                             ota.previous);
+
+  if (previous == NULL || esp_ota_set_boot_partition(previous) != ESP_OK)
+  {
+    LOG_E("OTA rollback to %s failed", ota.previous);
+    return;
+  }
+  LOG_W("OTA rolling back to %s", ota.previous);
+  esp_restart();
+}
+
+static void onOtaTimer(void *arg)
+{
+  if (restarting)
+  {
+    esp_restart();
+  }
+  LOG_W("OTA %s did not reach the broker", ota.version);
+  rollback();
+}
+
+void otaBegin(const char *runningVersion)
+{
+  const esp_partition_t *current = esp_ota_get_running_partition();
+
+  running = runningVersion;
+  esp_timer_create_args_t timerArgs = {};
+  timerArgs.callback = onOtaTimer;
+  timerArgs.name = "ota";
+  esp_timer_create(&timerArgs, &otaTimer);
+
+  halNvsOpen();
+  if (halNvsRead(OTA_NVS_KEY, &ota, sizeof(ota)) != sizeof(ota))
+  {
+    memset(&ota, 0, sizeof(ota));
+  }
+  halNvsClose();
+
+  if (ota.state != OTA_TRIAL)
+  {
+    return;
+  }
+  if (strcmp(current->label, ota.previous) == 0)
+  {
+    fail("rollback"); //The new image gave up, or the bootloader refused it
+    return;
+  }
+  ota.trialBoots++;
+  saveState();
+  if (ota.trialBoots > OTA_TRIAL_BOOTS)
+  {
+    LOG_W("OTA %s restarted %d times", ota.version, OTA_TRIAL_BOOTS);
+    rollback();
+    return;
+  }
+  LOG_I("OTA %s on trial, boot %d", ota.version, ota.trialBoots);
+  esp_timer_start_once(otaTimer, OTA_CONFIRM_TIMEOUT * 1000ULL);
+}
+
+void otaConfirm()
+{
+  if (ota.state != OTA_TRIAL)
+  {
+    return;
+  }
+  esp_timer_stop(otaTimer);
+  esp_ota_mark_app_valid_cancel_rollback(); //For a bootloader with rollback support
+  LOG_I("OTA %s confirmed", ota.version);
+  ota.state = OTA_IDLE;
+  ota.error[0] = '\0';
+  saveState();
+}
+
+static bool parseHex(const char *text, uint8_t *data, size_t length)
+{
+  for (size_t i = 0; i < 2 * length; i++)
+  {
+    char c = text[i];
+    uint8_t nibble = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+                                                      : (c >= 'A' && c <= 'F') ? c - 'A' + 10
+                                                                                : 0xFF;
+    if (nibble == 0xFF)
+    {
+      return false;
+    }
+    data[i / 2] = (i & 1) ? (data[i / 2] | nibble) : (nibble << 4);
+  }
+  return true;
+}
+
+//Checks signature of "<prefix><version> <size> <sha256 hex>" against OTA_PUBLIC_KEY
+static bool signatureValid(const char *prefix, const char *version, uint32_t size, const uint8_t *sha256,
+                           const uint8_t *signature)
+{
+  static const char publicKeyHex[] = OTA_PUBLIC_KEY;
+  uint8_t publicKey[65], digest[32];
+  char text[OTA_VERSION_MAX + 88];
+  mbedtls_ecp_group group;
+  mbedtls_ecp_point point;
+  mbedtls_mpi r, s;
+  bool valid;
+
+  if (strlen(publicKeyHex) != 2 * sizeof(publicKey) || !parseHex(publicKeyHex, publicKey, sizeof(publicKey)))
+  {
+    LOG_E("OTA has no public key");
+    return false;
+  }
+  int length = snprintf(text, sizeof(text), "%s%s %lu ", prefix, version, (unsigned long)size);
+  for (uint8_t i = 0; i < 32; i++)
+  {
+    length += snprintf(text + length, sizeof(text) - length, "%02x", sha256[i]);
+  }
+  mbedtls_sha256_ret((const unsigned char *)text, length, digest, 0);
+
+  mbedtls_ecp_group_init(&group);
+  mbedtls_ecp_point_init(&point);
+  mbedtls_mpi_init(&r);
+  mbedtls_mpi_init(&s);
+  valid = mbedtls_ecp_group_load(&group, MBEDTLS_ECP_DP_SECP256R1) == 0 &&
+          mbedtls_ecp_point_read_binary(&group, &point, publicKey, sizeof(publicKey)) == 0 &&
+          mbedtls_ecp_check_pubkey(&group, &point) == 0 &&
+          mbedtls_mpi_read_binary(&r, signature, OTA_SIGNATURE_SIZE / 2) == 0 &&
+          mbedtls_mpi_read_binary(&s, signature + OTA_SIGNATURE_SIZE / 2, OTA_SIGNATURE_SIZE / 2) == 0 &&
+          mbedtls_ecdsa_verify(&group, digest, sizeof(digest), &point, &r, &s) == 0;
+  mbedtls_mpi_free(&s);
+  mbedtls_mpi_free(&r);
+  mbedtls_ecp_point_free(&point);
+  mbedtls_ecp_group_free(&group);
+  return valid;
+}
+
+bool otaManifest(const char *text, size_t length)
+{
+  char manifest[OTA_VERSION_MAX + 80 + 2 * OTA_SIGNATURE_SIZE];
+  char version[OTA_VERSION_MAX], hex[65], signatureHex[2 * OTA_SIGNATURE_SIZE + 1];
+  unsigned long size;
+  uint8_t sha256[32], signature[OTA_SIGNATURE_SIZE];
+
+  if (length >= sizeof(manifest))
+  {
+    return false;
+  }
+  memcpy(manifest, text, length);
+  manifest[length] = '\0';
+  if (strncmp(manifest, "abort", 5) == 0)
+  {
+    //Signed for the update being received, an abort cannot be replayed against the next one
+    if (ota.state != OTA_RECEIVING || sscanf(manifest, "abort %128s", signatureHex) != 1 ||
+        strlen(signatureHex) != 2 * OTA_SIGNATURE_SIZE || !parseHex(signatureHex, signature, OTA_SIGNATURE_SIZE) ||
+        !signatureValid("abort ", ota.version, ota.size, ota.sha256, signature))
+    {
+      LOG_W("OTA abort ignored, not signed for %s", ota.version);
+      return false;
+    }
+    fail("aborted");
+    return true;
+  }
+  if (sscanf(manifest, "%15s %lu %64s %128s", version, &size, hex, signatureHex) != 4 || strlen(hex) != 64 ||
+      !parseHex(hex, sha256, 32) || strlen(signatureHex) != 2 * OTA_SIGNATURE_SIZE ||
+      !parseHex(signatureHex, signature, OTA_SIGNATURE_SIZE))
+  {
+    LOG_W("OTA manifest invalid or unsigned");
+    return false;
+  }
+  if (strcmp(version, running) == 0 || ota.state == OTA_TRIAL)
+  {
+    return false; //Also the retained manifest of the update we are running
+  }
+  if (!signatureValid("", version, size, sha256, signature))
+  {
+    LOG_W("OTA manifest %s: signature invalid", version);
+    return false;
+  }
+  bool same = memcmp(sha256, ota.sha256, sizeof(sha256)) == 0 && size == ota.size;
+  if (same && (ota.state == OTA_RECEIVING || ota.error[0] != '\0'))
+  {
+    return false; //Resumes with the next chunk, or failed before
+  }
+
+  const esp_partition_t *target = esp_ota_get_next_update_partition(NULL);
+  memset(&ota, 0, sizeof(ota));
+  memcpy(ota.sha256, sha256, sizeof(sha256));
+  memcpy(ota.signature, signature, sizeof(signature));
+  strcpy(ota.version, version);
+  ota.size = size;
+  if (target == NULL || size == 0 || size > target->size)
+  {
+    fail("size");
+    return true;
+  }
+  LOG_I("OTA %s: %lu bytes to %s", version, size, target->label);
+  ota.state = OTA_RECEIVING;
+  saveState();
+  return true;
+}
+
+//Inflates the chunk into sector, returns its length or 0
+static size_t inflateChunk(const uint8_t *data, size_t length)
+{
+  size_t inLength = length;
+  size_t outLength = OTA_CHUNK_SIZE;
+
+  tinfl_init(inflater);
+  tinfl_status status = tinfl_decompress(inflater, data, &inLength, sector, sector, &outLength,
+                                         TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+  return status == TINFL_STATUS_DONE ? outLength : 0;
+}
+
+//Reads the whole image back, so the check covers what is in flash
+static bool verifyImage(const esp_partition_t *target)
+{
+  mbedtls_sha256_context context;
+  uint8_t digest[32];
+  bool ok = true;
+
+  mbedtls_sha256_init(&context);
+  mbedtls_sha256_starts_ret(&context, 0);
+  for (uint32_t offset = 0; offset < ota.size && ok; offset += OTA_CHUNK_SIZE)
+  {
+    size_t length = (ota.size - offset < OTA_CHUNK_SIZE) ? ota.size - offset : OTA_CHUNK_SIZE;
+    ok = esp_partition_read(target, offset, sector, length) == ESP_OK;
+    mbedtls_sha256_update_ret(&context, sector, length);
+  }
+  mbedtls_sha256_finish_ret(&context, digest);
+  mbedtls_sha256_free(&context);
+  return ok && memcmp(digest, ota.sha256, sizeof(digest)) == 0;
+}
+
+static void finish(const esp_partition_t *target)
+{
+  LOG_I("OTA %s received, verifying", ota.version);
+  if (!verifyImage(target))
+  {
+    fail("sha");
+    return;
+  }
+  if (!signatureValid("", ota.version, ota.size, ota.sha256, ota.signature)) //The resume state came from NVS
+  {
+    fail("signature");
+    return;
+  }
+  strncpy(ota.previous, esp_ota_get_running_partition()->label, sizeof(ota.previous) - 1);
+  if (esp_ota_set_boot_partition(target) != ESP_OK) //Also checks the image format
+  {
+    fail("image");
+    return;
+  }
+  freeBuffers();
+  ota.state = OTA_TRIAL;
+  ota.trialBoots = 0;
+  saveState();
+  LOG_I("OTA %s verified, restarting", ota.version);
+  restarting = true;
+  esp_timer_start_once(otaTimer, OTA_RESTART_DELAY * 1000ULL);
+}
+
+bool otaChunk(const uint8_t *data, size_t length)
+{
+  if (ota.state != OTA_RECEIVING || length <= OTA_CHUNK_HEADER || memcmp(data, ota.sha256, 4) != 0)
+  {
+    return false;
+  }
+  uint16_t index = data[4] | (data[5] << 8);
+  if (index != ota.nextChunk)
+  {
+    return true; //Someone else's resend on the group topic, the status tells the backend where we are
+  }
+
+  const esp_partition_t *target = esp_ota_get_next_update_partition(NULL);
+  if (sector == NULL)
+  {
+    inflater = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+    sector = (uint8_t *)malloc(OTA_CHUNK_SIZE);
+  }
+  if (inflater == NULL || sector == NULL)
+  {
+    LOG_E("No memory for OTA");
+    freeBuffers();
+    return false; //The chunk is resent
+  }
+
+  uint32_t offset = index * OTA_CHUNK_SIZE;
+  size_t expected = (ota.size - offset < OTA_CHUNK_SIZE) ? ota.size - offset : OTA_CHUNK_SIZE;
+  if (inflateChunk(data + OTA_CHUNK_HEADER, length - OTA_CHUNK_HEADER) != expected ||
+      (index == 0 && sector[0] != OTA_IMAGE_MAGIC))
+  {
+    fail("inflate");
+    return true;
+  }
+  if (esp_partition_erase_range(target, offset, OTA_CHUNK_SIZE) != ESP_OK ||
+      esp_partition_write(target, offset, sector, expected) != ESP_OK)
+  {
+    fail("flash");
+    return true;
+  }
+
+  ota.nextChunk++;
+  if (ota.nextChunk == chunkCount())
+  {
+    finish(target);
+  }
+  else if (ota.nextChunk % OTA_SAVE_CHUNKS == 0)
+  {
+    saveState();
+  }
+  return true;
+}
+
+size_t otaFormatStatus(char *buffer, size_t size)
+{
+  int length = snprintf(buffer, size, "{\"state\":\"%s\",\"version\":\"%s\",\"next\":%lu,\"chunks\":%lu,\"error\":\"%s\"}",
+                        stateNames[ota.state], ota.state == OTA_IDLE && ota.error[0] == '\0' ? running : ota.version,
+                        (unsigned long)ota.nextChunk, (unsigned long)chunkCount(), ota.error);
+  return (length > 0 && (size_t)length < size) ? length : 0;
+}
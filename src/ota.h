@@ -0,0 +1,54 @@
+#ifndef OTA_H
+#define OTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Firmware update over MQTT, on the device or a group control topic (groups.h):
+//  ota       "<version> <size> <sha256 hex> <signature hex>" starts or resumes an update,
+//            "abort <signature hex>" cancels it. The signature is ECDSA P-256, r and s of 32 bytes each,
+//            over the SHA-256 of "<version> <size> <sha256 hex>" with lowercase hex, for an abort of
+//            "abort <version> <size> <sha256 hex>" of the update being received. Messages without a
+//            valid signature of OTA_PUBLIC_KEY are ignored, as are the running version and an image
+//            that already failed.
+//  ota_data  one chunk, all fields little endian
+//              0 uint8[4] first bytes of the image SHA-256, chunks of another image are ignored
+//              4 uint16   chunk index
+//              6          zlib stream of image bytes [index * OTA_CHUNK_SIZE, + OTA_CHUNK_SIZE)
+//            Every chunk is compressed on its own, so the download resumes at any chunk.
+//Only the next chunk is written, to the inactive OTA partition. monitor/ota reports it, the backend
+//sends from there after a disconnect or reboot. After the last chunk the partition is read back and
+//SHA-256 checked and the signature is checked again, then the device restarts into the new image.
+//The new image is on trial until it reaches the broker (otaConfirm()). If it restarts
+//OTA_TRIAL_BOOTS times or does not connect within OTA_CONFIRM_TIMEOUT, the previous image boots again.
+#define OTA_CHUNK_SIZE 4096        //one flash sector
+#define OTA_CHUNK_HEADER 6
+#define OTA_SAVE_CHUNKS 16         //resume point written to NVS every this many chunks
+#define OTA_VERSION_MAX 16
+#define OTA_TRIAL_BOOTS 3
+#define OTA_CONFIRM_TIMEOUT 600000 //ms
+#define OTA_RESTART_DELAY 2000     //ms to send the status before restarting
+#define OTA_NVS_KEY "ota"
+#define OTA_SIGNATURE_SIZE 64
+
+//Uncompressed P-256 public key of the release signer, "04" and 64 bytes of X and Y in hex, e.g.
+//  build_flags = -DOTA_PUBLIC_KEY='"04..."'
+//Without it every manifest is rejected.
+#ifndef OTA_PUBLIC_KEY
+#define OTA_PUBLIC_KEY ""
+#endif
+
+//Before the MQTT link starts. Counts trial boots and rolls back if needed.
+void otaBegin(const char *runningVersion);
+
+//The running image reached the broker, it is kept
+void otaConfirm();
+
+//Network task. Both return true if the status changed.
+bool otaManifest(const char *text, size_t length);
+bool otaChunk(const uint8_t *data, size_t length);
+
+//JSON for monitor/ota, e.g. {"state":"receiving","version":"v1.1","next":37,"chunks":256,"error":""}
+size_t otaFormatStatus(char *buffer, size_t size);
+
+#endif
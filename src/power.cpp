@@ -0,0 +1,35 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include "power.h"
+#include "logger.h"
+
+static uint32_t lastCycles;
+static uint64_t awakeCycles;
+
+void powerBegin()
+{
+  setCpuFrequencyMhz(POWER_CPU_MHZ);
+
+  esp_pm_config_esp32_t config = {POWER_CPU_MHZ, POWER_CPU_MHZ, true}; //max, min MHz, light sleep
+  esp_err_t err = esp_pm_configure(&config);
+  if (err != ESP_OK)
+  {
+    LOG_W("Light sleep not available (%d), modem sleep only", (int)err);
+  }
+  esp_sleep_enable_gpio_wakeup(); //Pins are armed with gpio_wakeup_enable, see water_level.cpp
+  WiFi.setSleep(true);
+  lastCycles = ESP.getCycleCount();
+  LOG_I("Power save: %d MHz, light sleep %s", POWER_CPU_MHZ, (err == ESP_OK) ? "on" : "off");
+}
+
+//The cycle counter stops while the CPU sleeps, at a fixed frequency it counts awake time
+uint32_t powerAwakeMs()
+{
+  uint32_t cycles = ESP.getCycleCount();
+
+  awakeCycles += (uint32_t)(cycles - lastCycles);
+  lastCycles = cycles;
+  return (uint32_t)(awakeCycles / (POWER_CPU_MHZ * 1000));
+}
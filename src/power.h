@@ -0,0 +1,29 @@
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdint.h>
+
+//Power managed build (-DPOWER_SAVE, env:esp32dev_lowpower). The CPU runs at a fixed POWER_CPU_MHZ and
+//the idle task enters light sleep whenever no task is ready. Tickless idle sleeps until the next
+//FreeRTOS delay or esp_timer alarm, so the wakeups are the calendar deadline (calendarTimer), the
+//sensor interval and the soil moisture burst (both POWER_SENSOR_PERIOD), POWER_NETWORK_PERIOD and the
+//float switch (water_level.cpp). WiFi stays associated in
+//modem sleep and wakes for the DTIM beacons.
+//Automatic light sleep needs CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE in the sdkconfig,
+//without them powerBegin() falls back to modem sleep at POWER_CPU_MHZ.
+#define POWER_CPU_MHZ 80           //lowest frequency with WiFi, fixed so the cycle counter measures awake time
+#define POWER_NETWORK_PERIOD 1000  //ms, MQTT poll of the network task, status events wake it at once
+#define POWER_SENSOR_PERIOD 30000  //ms, DHT and soil moisture reads, fewer wakeups than the default
+#define POWER_LOG_DRAIN_PERIOD 500 //ms
+#ifndef POWER_MQTT_KEEPALIVE
+#define POWER_MQTT_KEEPALIVE 120 //s, -DPOWER_MQTT_KEEPALIVE=... The broker drops the client after 1.5 times this.
+#endif
+
+//CPU frequency, light sleep, WiFi modem sleep and the GPIO wakeup source. Before the tasks start.
+void powerBegin();
+
+//ms the CPU was not in light sleep since powerBegin(). Call from the core powerBegin() ran on, at least
+//every 50 s: the cycle counter wraps after 53 s at 80 MHz.
+uint32_t powerAwakeMs();
+
+#endif
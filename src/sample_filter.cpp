@@ -0,0 +1,62 @@
+#include "sample_filter.h"
+
+void sampleFilterBegin(sampleFilter *filter, uint8_t medianSize, uint8_t emaShift)
+{
+  if (medianSize < 1)
+  {
+    medianSize = 1;
+  }
+  if (medianSize > SAMPLE_MEDIAN_MAX)
+  {
+    medianSize = SAMPLE_MEDIAN_MAX;
+  }
+  filter->medianSize = medianSize | 1; //odd, the median is a sample
+  if (filter->medianSize > SAMPLE_MEDIAN_MAX)
+  {
+    filter->medianSize -= 2;
+  }
+  filter->emaShift = (emaShift > 16) ? 16 : emaShift;
+  filter->index = 0;
+  filter->filled = 0;
+  filter->ema = 0;
+}
+
+//Median of the samples seen so far, at most medianSize of them
+static uint32_t median(const sampleFilter *filter)
+{
+  uint32_t sorted[SAMPLE_MEDIAN_MAX] = {0};
+
+  for (uint8_t i = 0; i < filter->filled; i++)
+  {
+    uint32_t value = filter->window[i];
+    int j = i - 1;
+    while (j >= 0 && sorted[j] > value)
+    {
+      sorted[j + 1] = sorted[j];
+      j--;
+    }
+    sorted[j + 1] = value;
+  }
+  return sorted[filter->filled / 2];
+}
+
+uint32_t sampleFilterAdd(sampleFilter *filter, uint32_t sample)
+{
+  filter->window[filter->index] = sample;
+  filter->index = (filter->index + 1) % filter->medianSize;
+  if (filter->filled < filter->medianSize)
+  {
+    filter->filled++;
+  }
+  uint32_t value = median(filter);
+
+  if (filter->filled == 1)
+  {
+    filter->ema = value << filter->emaShift;
+  }
+  else
+  {
+    filter->ema = filter->ema + value - (filter->ema >> filter->emaShift);
+  }
+  return filter->ema >> filter->emaShift;
+}
@@ -0,0 +1,26 @@
+#ifndef SAMPLE_FILTER_H
+#define SAMPLE_FILTER_H
+
+#include <stdint.h>
+
+#define SAMPLE_MEDIAN_MAX 7 //largest median window
+
+//Median of the last medianSize samples followed by an exponential moving average with
+//alpha = 1 / 2^emaShift. Fixed work per sample, no allocation.
+typedef struct
+{
+  uint32_t window[SAMPLE_MEDIAN_MAX];
+  uint32_t ema; //average << emaShift
+  uint8_t medianSize;
+  uint8_t emaShift;
+  uint8_t index;
+  uint8_t filled;
+} sampleFilter;
+
+//medianSize 1 (off) .. SAMPLE_MEDIAN_MAX, odd. emaShift 0 (off) .. 16.
+void sampleFilterBegin(sampleFilter *filter, uint8_t medianSize, uint8_t emaShift);
+
+//Adds a sample and returns the filtered value. The first sample primes the average.
+uint32_t sampleFilterAdd(sampleFilter *filter, uint32_t sample);
+
+#endif
@@ -0,0 +1,121 @@
+#include "soil_sensor.h"
+#include "logger.h"
+#include "driver/adc.h"
+#include "esp_adc_cal.h"
+#include "sample_filter.h"
+
+static esp_adc_cal_characteristics_t adcChars; //taken once in soilSensorBegin
+static sampleFilter filters[SOIL_MAX_CHANNELS];
+static volatile uint32_t readings[SOIL_MAX_CHANNELS];
+static int8_t channelIndex[ADC1_CHANNEL_MAX]; //ADC1 channel -> pins[] index, -1 if unused
+static uint8_t channelCount;
+
+//One burst: start the DMA, read a frame, stop. The ADC is idle between bursts.
+static void sampleBurst()
+{
+  static uint8_t frame[SOIL_FRAME_BYTES];
+  uint32_t sum[SOIL_MAX_CHANNELS] = {0};
+  uint16_t samples[SOIL_MAX_CHANNELS] = {0};
+  uint32_t length = 0;
+
+  adc_digi_start();
+  esp_err_t err = adc_digi_read_bytes(frame, sizeof(frame), &length, pdMS_TO_TICKS(100));
+  adc_digi_stop();
+  if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) //INVALID_STATE: the driver buffer overflowed, data is still valid
+  {
+    return;
+  }
+
+  for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= length; i += SOC_ADC_DIGI_RESULT_BYTES)
+  {
+    adc_digi_output_data_t *p = (adc_digi_output_data_t *)&frame[i];
+    if (p->type1.channel >= ADC1_CHANNEL_MAX || channelIndex[p->type1.channel] < 0)
+    {
+      continue;
+    }
+    int8_t index = channelIndex[p->type1.channel];
+    sum[index] += p->type1.data;
+    samples[index]++;
+  }
+
+  for (uint8_t i = 0; i < channelCount; i++)
+  {
+    if (samples[i] > 0)
+    {
+      uint32_t mV = esp_adc_cal_raw_to_voltage(sum[i] / samples[i], &adcChars);
+      readings[i] = sampleFilterAdd(&filters[i], mV);
+    }
+  }
+}
+
+static void soilSensorTask(void *parameter)
+{
+  TickType_t lastWake = xTaskGetTickCount();
+
+  for (;;)
+  {
+    sampleBurst();
+    vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(SOIL_SAMPLE_PERIOD));
+  }
+}
+
+bool soilSensorBegin(const uint8_t *pins, uint8_t count, BaseType_t core)
+{
+  static adc_digi_pattern_config_t pattern[SOIL_MAX_CHANNELS];
+  uint16_t channelMask = 0;
+
+  if (count == 0 || count > SOIL_MAX_CHANNELS)
+  {
+    return false;
+  }
+  memset(channelIndex, -1, sizeof(channelIndex));
+  for (uint8_t i = 0; i < count; i++)
+  {
+    int8_t channel = digitalPinToAnalogChannel(pins[i]);
+    if (channel < 0 || channel >= ADC1_CHANNEL_MAX) //ADC2 is taken by WiFi
+    {
+      LOG_E("Soil sensor pin %d is not on ADC1", pins[i]);
+      return false;
+    }
+    channelIndex[channel] = i;
+    channelMask |= 1 << channel;
+    pattern[i].atten = ADC_ATTEN_DB_11;
+    pattern[i].channel = channel;
+    pattern[i].unit = 0; //ADC1
+    pattern[i].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+    sampleFilterBegin(&filters[i], SOIL_MEDIAN_WINDOW, SOIL_EMA_SHIFT);
+    readings[i] = 0;
+  }
+  channelCount = count;
+
+  esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, 1100, &adcChars);
+
+  adc_digi_init_config_t init = {};
+  init.max_store_buf_size = SOIL_FRAME_BYTES * 2;
+  init.conv_num_each_intr = SOIL_FRAME_BYTES;
+  init.adc1_chan_mask = channelMask;
+  init.adc2_chan_mask = 0;
+
+  adc_digi_configuration_t config = {};
+  config.conv_limit_en = true; //required on the ESP32
+  config.conv_limit_num = 255;
+  config.pattern_num = count;
+  config.adc_pattern = pattern;
+  config.sample_freq_hz = SOIL_SAMPLE_RATE;
+  config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+  config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+
+  if (adc_digi_initialize(&init) != ESP_OK || adc_digi_controller_configure(&config) != ESP_OK)
+  {
+    LOG_E("Soil sensor ADC DMA init failed");
+    return false;
+  }
+
+  xTaskCreatePinnedToCore(soilSensorTask, "soil", SOIL_TASK_STACK, NULL, SOIL_TASK_PRIORITY, NULL, core);
+  return true;
+}
+
+uint32_t soilSensorRead(uint8_t index)
+{
+  return (index < channelCount) ? readings[index] : 0;
+}
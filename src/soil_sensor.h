@@ -0,0 +1,30 @@
+#ifndef SOIL_SENSOR_H
+#define SOIL_SENSOR_H
+
+#include <Arduino.h>
+#ifdef POWER_SAVE
+#include "power.h"
+#endif
+
+#define SOIL_MAX_CHANNELS 4
+#ifdef POWER_SAVE
+#define SOIL_SAMPLE_PERIOD POWER_SENSOR_PERIOD //one burst per sensor read, not a wakeup every second
+#else
+#define SOIL_SAMPLE_PERIOD 1000 //ms between two oversampled readings
+#endif
+#define SOIL_SAMPLE_RATE 20000  //Hz, DMA conversion rate during a burst, lowest the ESP32 supports
+#define SOIL_FRAME_BYTES 512    //one burst, 256 conversions shared by the channels
+#define SOIL_MEDIAN_WINDOW 5    //readings, rejects single spikes
+#define SOIL_EMA_SHIFT 3        //alpha = 1/8
+#define SOIL_TASK_PRIORITY 2
+#define SOIL_TASK_STACK 3072
+
+//Samples the given ADC1 pins in the background. Every SOIL_SAMPLE_PERIOD one DMA burst is read,
+//averaged per channel, calibrated with the characteristics taken once here, then filtered
+//(median of SOIL_MEDIAN_WINDOW, EMA). Returns false if a pin is not on ADC1 or the driver fails.
+bool soilSensorBegin(const uint8_t *pins, uint8_t count, BaseType_t core);
+
+//Latest filtered value of channel index (order of pins), mV. 0 before the first burst.
+uint32_t soilSensorRead(uint8_t index);
+
+#endif
@@ -0,0 +1,285 @@
+#include "telemetry.h"
+#include "controller.h"
+#include "hal.h"
+#include "logger.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *monitorTopics[TOPIC_COUNT]; //doa/<id>/monitor/<name>
+static char *monitorTopicBuffer;
+static const char *const monitorTopicNames[TOPIC_ACTUATOR] = {
+    "waterlevel", "datetime", "version", "humidity", "temperature", "soilmoisture", "snapshot", "diag", "awake", "groups", "ota", "history", "telemetry"};
+static const char *const signalNames[TELEMETRY_SIGNALS] = {"humidity", "temperature", "soilmoisture", "waterlevel",
+                                                           "heartbeat"};
+static const telemetryThreshold defaultThresholds[TELEMETRY_SIGNALS] = {
+    {1.0f, 10, 600}, {0.2f, 10, 600}, {30, 5, 600}, {0, 0, 600}, {0, 0, 600}};
+static const char *version;
+static uint32_t lastAwakeMs; //at the previous heartbeat
+static telemetryThreshold thresholds[TELEMETRY_SIGNALS];
+static float publishedValue[TELEMETRY_SIGNALS]; //waterlevel 1: water ok
+static uint32_t publishedMs[TELEMETRY_SIGNALS];
+static uint8_t publishedOnce; //1 << TELEMETRY_* bits
+
+//Length of topic index without the terminator, topic may be NULL
+static size_t formatTopic(char *topic, size_t size, const char *deviceID, uint8_t index)
+{
+  if (index < TOPIC_ACTUATOR)
+  {
+    return snprintf(topic, size, "doa/%s/monitor/%s", deviceID, monitorTopicNames[index]);
+  }
+  if (index < TOPIC_CALENDAR_VERSION)
+  {
+    return snprintf(topic, size, "doa/%s/monitor/%s", deviceID, actuatorTable[index - TOPIC_ACTUATOR].name);
+  }
+  return snprintf(topic, size, "doa/%s/monitor/%s_calendar_version", deviceID,
+                  actuatorTable[index - TOPIC_CALENDAR_VERSION].name);
+}
+
+void telemetryBegin(const char *deviceID, const char *swVersion)
+{
+  size_t size = 0;
+
+  version = swVersion;
+  for (uint8_t i = 0; i < TOPIC_COUNT; i++)
+  {
+    size += formatTopic(NULL, 0, deviceID, i) + 1;
+  }
+  free(monitorTopicBuffer);
+  monitorTopicBuffer = (char *)malloc(size);
+  char *topic = monitorTopicBuffer;
+  for (uint8_t i = 0; i < TOPIC_COUNT; i++)
+  {
+    monitorTopics[i] = topic;
+    topic += formatTopic(topic, size - (topic - monitorTopicBuffer), deviceID, i) + 1;
+  }
+}
+
+const char *monitorTopic(uint8_t index)
+{
+  return monitorTopics[index];
+}
+
+bool telemetrySample(sensorData *data)
+{
+  bool ok = halReadClimate(&data->humidity, &data->temperature);
+
+  data->soilMoisture = halReadSoilMoisture(0); //Sampled and filtered in the background
+  data->lowWater = halWaterIsLow();
+  data->awakeMs = halAwakeMs();
+  return ok;
+}
+
+static bool validThresholds(const telemetryThreshold *candidate)
+{
+  for (uint8_t i = 0; i < TELEMETRY_SIGNALS; i++)
+  {
+    if (!(candidate[i].deadband >= 0) || isinf(candidate[i].deadband) || candidate[i].maxInterval == 0 ||
+        candidate[i].minInterval > candidate[i].maxInterval)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void telemetryConfigBegin()
+{
+  halNvsOpen();
+  size_t length = halNvsRead(TELEMETRY_NVS_KEY, thresholds, sizeof(thresholds));
+  halNvsClose();
+
+  if (length != sizeof(thresholds) || !validThresholds(thresholds))
+  {
+    memcpy(thresholds, defaultThresholds, sizeof(thresholds));
+  }
+  publishedOnce = 0;
+}
+
+bool telemetrySetConfig(const char *text, size_t length)
+{
+  char config[TELEMETRY_CONFIG_MAX];
+  telemetryThreshold parsed[TELEMETRY_SIGNALS];
+  char *rest;
+
+  if (length >= sizeof(config))
+  {
+    return false;
+  }
+  memcpy(config, text, length);
+  config[length] = '\0';
+  memcpy(parsed, length == 0 ? defaultThresholds : thresholds, sizeof(parsed));
+  for (char *entry = strtok_r(config, ";", &rest); entry != NULL; entry = strtok_r(NULL, ";", &rest))
+  {
+    char name[16];
+    float deadband;
+    unsigned minInterval, maxInterval;
+    int end = 0;
+    uint8_t i = 0;
+
+    if (sscanf(entry, " %15s %f %u %u %n", name, &deadband, &minInterval, &maxInterval, &end) != 4 ||
+        entry[end] != '\0' || maxInterval > 0xFFFF)
+    {
+      return false;
+    }
+    while (i < TELEMETRY_SIGNALS && strcmp(name, signalNames[i]) != 0)
+    {
+      i++;
+    }
+    if (i == TELEMETRY_SIGNALS)
+    {
+      return false;
+    }
+    parsed[i].deadband = deadband;
+    parsed[i].minInterval = minInterval;
+    parsed[i].maxInterval = maxInterval;
+  }
+  if (!validThresholds(parsed))
+  {
+    return false;
+  }
+  if (memcmp(parsed, thresholds, sizeof(parsed)) != 0)
+  {
+    memcpy(thresholds, parsed, sizeof(thresholds));
+    halNvsOpen();
+    halNvsWrite(TELEMETRY_NVS_KEY, thresholds, sizeof(thresholds));
+    halNvsClose();
+    LOG_I("Telemetry thresholds changed");
+  }
+  return true;
+}
+
+size_t telemetryFormatConfig(char *buffer, size_t size)
+{
+  size_t length = 0;
+
+  buffer[0] = '\0';
+  for (uint8_t i = 0; i < TELEMETRY_SIGNALS && length < size; i++)
+  {
+    length += snprintf(buffer + length, size - length, "%s%s %g %u %u", i ? ";" : "", signalNames[i],
+                       thresholds[i].deadband, thresholds[i].minInterval, thresholds[i].maxInterval);
+  }
+  return length < size ? length : size - 1;
+}
+
+const telemetryThreshold *telemetryThresholds()
+{
+  return thresholds;
+}
+
+static bool isDue(uint8_t i, float value, uint32_t nowMs)
+{
+  uint32_t elapsed = nowMs - publishedMs[i];
+  float last = publishedValue[i];
+
+  if (!(publishedOnce & (1 << i)) || elapsed >= thresholds[i].maxInterval * 1000UL)
+  {
+    return true;
+  }
+  if (i == TELEMETRY_HEARTBEAT || elapsed < thresholds[i].minInterval * 1000UL)
+  {
+    return false;
+  }
+  if (isnan(value) || isnan(last))
+  {
+    return isnan(value) != isnan(last);
+  }
+  return value != last && fabsf(value - last) >= thresholds[i].deadband;
+}
+
+//Values are formatted into a stack buffer, the topics are preformatted
+static void publishSignals(const sensorData &data, const char *dateString, uint8_t due)
+{
+#ifdef TELEMETRY_SNAPSHOT
+  char payload[192];
+  uint32_t awakeMs = data.awakeMs - lastAwakeMs;
+
+  lastAwakeMs = data.awakeMs;
+  //One message with every value, NaN (sensor read failed) becomes null
+  int length = snprintf(payload, sizeof(payload), "{\"datetime\":\"%s\",\"version\":\"%s\"", dateString, version);
+  length += snprintf(payload + length, sizeof(payload) - length, isnan(data.humidity) ? ",\"humidity\":null" : ",\"humidity\":%.2f", data.humidity);
+  length += snprintf(payload + length, sizeof(payload) - length, isnan(data.temperature) ? ",\"temperature\":null" : ",\"temperature\":%.2f", data.temperature);
+  snprintf(payload + length, sizeof(payload) - length, ",\"soilmoisture\":%u,\"waterlevel\":%d,\"awake\":%lu}", (unsigned)data.soilMoisture,
+           !data.lowWater, (unsigned long)awakeMs);
+  halMqttPublish(monitorTopics[TOPIC_SNAPSHOT], payload);
+#else
+  char payload[16];
+
+  if (due & (1 << TELEMETRY_HEARTBEAT))
+  {
+    uint32_t awakeMs = data.awakeMs - lastAwakeMs;
+
+    lastAwakeMs = data.awakeMs;
+    halMqttPublish(monitorTopics[TOPIC_DATETIME], dateString);
+    halMqttPublish(monitorTopics[TOPIC_VERSION], version);
+    snprintf(payload, sizeof(payload), "%lu", (unsigned long)awakeMs);
+    halMqttPublish(monitorTopics[TOPIC_AWAKE], payload);
+  }
+  if (due & (1 << TELEMETRY_HUMIDITY))
+  {
+    snprintf(payload, sizeof(payload), "%.2f", data.humidity);
+    halMqttPublish(monitorTopics[TOPIC_HUMIDITY], payload);
+  }
+  if (due & (1 << TELEMETRY_TEMPERATURE))
+  {
+    snprintf(payload, sizeof(payload), "%.2f", data.temperature);
+    halMqttPublish(monitorTopics[TOPIC_TEMPERATURE], payload);
+  }
+  if (due & (1 << TELEMETRY_SOILMOISTURE))
+  {
+    snprintf(payload, sizeof(payload), "%u", (unsigned)data.soilMoisture);
+    halMqttPublish(monitorTopics[TOPIC_SOILMOISTURE], payload);
+  }
+  if (due & (1 << TELEMETRY_WATERLEVEL))
+  {
+    halMqttPublish(monitorTopics[TOPIC_WATERLEVEL], data.lowWater ? "0" : "1");
+  }
+#endif
+}
+
+uint8_t telemetryReport(const sensorData &data, const char *dateString, uint32_t nowMs)
+{
+  const float values[TELEMETRY_SIGNALS] = {data.humidity, data.temperature, (float)data.soilMoisture,
+                                           data.lowWater ? 0.0f : 1.0f, 0};
+  uint8_t due = 0;
+
+  for (uint8_t i = 0; i < TELEMETRY_SIGNALS; i++)
+  {
+    if (isDue(i, values[i], nowMs))
+    {
+      due |= 1 << i;
+    }
+  }
+  if (due == 0)
+  {
+    return 0;
+  }
+#ifdef TELEMETRY_SNAPSHOT
+  due = TELEMETRY_ALL; //The snapshot holds them all
+#endif
+  publishSignals(data, dateString, due);
+  for (uint8_t i = 0; i < TELEMETRY_SIGNALS; i++)
+  {
+    if (due & (1 << i))
+    {
+      publishedValue[i] = values[i];
+      publishedMs[i] = nowMs;
+    }
+  }
+  publishedOnce |= due;
+  return due;
+}
+
+void telemetryPublishStatus(uint8_t type, uint8_t status)
+{
+  if (type == WATERLEVEL)
+  {
+    halMqttPublish(monitorTopics[TOPIC_WATERLEVEL], status ? "1" : "0");
+    publishedValue[TELEMETRY_WATERLEVEL] = status ? 1.0f : 0.0f; //Its max interval runs on
+  }
+  else
+  {
+    halMqttPublish(monitorTopics[TOPIC_ACTUATOR + type - 1], status ? "on" : "off");
+  }
+}
@@ -0,0 +1,88 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "actuators.h"
+
+//#define TELEMETRY_SNAPSHOT //one JSON message on monitor/snapshot with every value instead of one per value
+
+//Monitor topics, preformatted by telemetryBegin(). Two per actuator after the fixed ones.
+#define TOPIC_WATERLEVEL 0
+#define TOPIC_DATETIME 1
+#define TOPIC_VERSION 2
+#define TOPIC_HUMIDITY 3
+#define TOPIC_TEMPERATURE 4
+#define TOPIC_SOILMOISTURE 5
+#define TOPIC_SNAPSHOT 6
+#define TOPIC_DIAG 7
+#define TOPIC_AWAKE 8      //ms the CPU was awake since the previous heartbeat
+#define TOPIC_GROUPS 9     //joined groups, see groups.h
+#define TOPIC_OTA 10       //firmware update status, see ota.h
+#define TOPIC_HISTORY 11   //binary history blocks, see history_store.h
+#define TOPIC_TELEMETRY 12 //thresholds, as given to telemetrySetConfig()
+#define TOPIC_ACTUATOR 13  //+ type - 1, <name>
+#define TOPIC_CALENDAR_VERSION (TOPIC_ACTUATOR + ACTUATOR_COUNT) //+ type - 1, <name>_calendar_version
+#define TOPIC_COUNT (TOPIC_ACTUATOR + 2 * ACTUATOR_COUNT)
+
+//Report by exception. A signal is published when it moved by at least its deadband (and changed at all)
+//since its last published value, but not before minInterval, and after maxInterval at the latest. The
+//heartbeat (datetime, version, awake) only has maxInterval. Values are retained, so a quiet signal
+//still reads its current value. The snapshot build sends the whole snapshot when any signal is due.
+#define TELEMETRY_HUMIDITY 0
+#define TELEMETRY_TEMPERATURE 1
+#define TELEMETRY_SOILMOISTURE 2
+#define TELEMETRY_WATERLEVEL 3
+#define TELEMETRY_HEARTBEAT 4
+#define TELEMETRY_SIGNALS 5
+#define TELEMETRY_ALL ((1 << TELEMETRY_SIGNALS) - 1)
+#define TELEMETRY_CONFIG_MAX 160 //telemetrySetConfig() text with the terminator
+#define TELEMETRY_NVS_KEY "telemetry"
+
+typedef struct
+{
+  float deadband;       //%RH, degC, mV; waterlevel any change
+  uint16_t minInterval; //s
+  uint16_t maxInterval; //s, 1 or more
+} telemetryThreshold;
+
+typedef struct
+{
+  float humidity;
+  float temperature;
+  uint32_t soilMoisture;
+  bool lowWater;
+  uint32_t awakeMs; //halAwakeMs() at the sample
+} sensorData;
+
+//Formats doa/<deviceID>/monitor/<name> for every topic into one allocation sized to the names.
+//swVersion must stay valid.
+void telemetryBegin(const char *deviceID, const char *swVersion);
+
+const char *monitorTopic(uint8_t index);
+
+//Reads every sensor into data. False if the climate reading failed (last good values are kept).
+bool telemetrySample(sensorData *data);
+
+//Loads the thresholds from NVS, the defaults if there are none
+void telemetryConfigBegin();
+
+//Sets the thresholds of the signals listed in text, "<signal> <deadband> <min s> <max s>" separated by
+//';', e.g. "soilmoisture 30 5 900;heartbeat 0 0 1800". Signals: humidity, temperature, soilmoisture,
+//waterlevel, heartbeat. "" restores the defaults. Saved if they changed. False if text is invalid, the
+//thresholds are then unchanged.
+bool telemetrySetConfig(const char *text, size_t length);
+
+//Every signal, as given to telemetrySetConfig()
+size_t telemetryFormatConfig(char *buffer, size_t size);
+
+const telemetryThreshold *telemetryThresholds(); //TELEMETRY_SIGNALS entries
+
+//Publishes the signals due at nowMs (ms, may wrap), returns them as 1 << TELEMETRY_* bits. Call with
+//every new sample, the sample period is the resolution of the intervals.
+uint8_t telemetryReport(const sensorData &data, const char *dateString, uint32_t nowMs);
+
+//Publishes an actuator or water level change, a water level change counts as reported
+void telemetryPublishStatus(uint8_t type, uint8_t status);
+
+#endif
@@ -0,0 +1,248 @@
+#include "time_service.h"
+#include "hal.h"
+#include "logger.h"
+
+typedef struct
+{
+  uint64_t unixMs;  //time at uptimeUs
+  uint64_t floorMs; //a small backward correction holds the clock here until it has caught up
+  int64_t uptimeUs;
+  int32_t driftPpb;
+} timeAnchor;
+
+typedef struct
+{
+  uint64_t unixMs;
+  int64_t uptimeUs; //when it was taken
+} timeSample;
+
+//Sequence lock, only the control task writes the anchor. Odd while a write is in progress.
+static timeAnchor anchor;
+static uint32_t anchorSequence;
+
+//SNTP mailbox, one writer (the SNTP callback) and one reader (timeService)
+static timeSample sntpPending;
+static uint8_t sntpPendingFull;
+
+static int32_t utcOffset; //s, written by the control task, read by the SNTP callback
+
+//Control task only
+static timeSample sntpLast; //start of the drift measurement
+static bool sntpLastValid, driftMeasured, rtcWritePending;
+static int64_t sntpUptimeUs, rtcCheckedUs;
+
+static uint64_t anchorTime(const timeAnchor *a, int64_t uptimeUs)
+{
+  int64_t elapsedUs = uptimeUs - a->uptimeUs;
+  elapsedUs -= elapsedUs * a->driftPpb / 1000000000;
+  uint64_t ms = (uint64_t)((int64_t)a->unixMs + elapsedUs / 1000);
+  return (ms < a->floorMs) ? a->floorMs : ms;
+}
+
+static void readAnchor(timeAnchor *a)
+{
+  uint32_t sequence;
+
+  do
+  {
+    sequence = __atomic_load_n(&anchorSequence, __ATOMIC_ACQUIRE);
+    *a = anchor;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((sequence & 1) || sequence != __atomic_load_n(&anchorSequence, __ATOMIC_RELAXED));
+}
+
+static void writeAnchor(const timeAnchor *a)
+{
+  __atomic_store_n(&anchorSequence, anchorSequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  anchor = *a;
+  __atomic_store_n(&anchorSequence, anchorSequence + 1, __ATOMIC_RELEASE);
+}
+
+//The clock reads unixMs at uptimeUs from now on
+static uint8_t setReference(uint64_t unixMs, int64_t uptimeUs, int32_t driftPpb)
+{
+  timeAnchor next = {unixMs, 0, uptimeUs, driftPpb};
+  int64_t step = (int64_t)(unixMs - anchorTime(&anchor, uptimeUs));
+  uint8_t result = TIME_CORRECTED;
+
+  if (step <= -TIME_STEP_MAX || step >= TIME_STEP_MAX)
+  {
+    result = TIME_STEPPED;
+  }
+  else if (step < 0)
+  {
+    next.floorMs = anchorTime(&anchor, halUptimeUs()); //Never behind what was read already
+  }
+  writeAnchor(&next);
+  return result;
+}
+
+void timeBegin()
+{
+  timeAnchor start = {(uint64_t)halRtcNow() * 1000, 0, halUptimeUs(), 0};
+  int32_t offset;
+
+  halNvsOpen();
+  if (halNvsRead(TIME_NVS_KEY, &offset, sizeof(offset)) != sizeof(offset) || offset < -TIME_UTC_OFFSET_MAX ||
+      offset > TIME_UTC_OFFSET_MAX)
+  {
+    offset = TIME_UTC_OFFSET;
+  }
+  halNvsClose();
+  __atomic_store_n(&utcOffset, offset, __ATOMIC_RELAXED);
+  writeAnchor(&start);
+  rtcCheckedUs = start.uptimeUs;
+  LOG_I("Clock from the RTC: %lu", (unsigned long)(start.unixMs / 1000));
+}
+
+uint64_t timeNowMs()
+{
+  timeAnchor a;
+
+  readAnchor(&a);
+  return anchorTime(&a, halUptimeUs());
+}
+
+uint32_t timeNow()
+{
+  return (uint32_t)(timeNowMs() / 1000);
+}
+
+void timeSet(uint32_t unixtime)
+{
+  setReference((uint64_t)unixtime * 1000, halUptimeUs(), anchor.driftPpb);
+  halRtcAdjust(unixtime);
+  rtcCheckedUs = halUptimeUs();
+  rtcWritePending = false;
+  sntpLastValid = false; //A drift measurement across the jump would be wrong
+}
+
+void timeSntpSample(uint64_t unixMs)
+{
+  if (unixMs / 1000 < TIME_VALID_AFTER || __atomic_load_n(&sntpPendingFull, __ATOMIC_ACQUIRE))
+  {
+    return;
+  }
+  sntpPending.unixMs = unixMs + (int64_t)__atomic_load_n(&utcOffset, __ATOMIC_RELAXED) * 1000;
+  sntpPending.uptimeUs = halUptimeUs();
+  __atomic_store_n(&sntpPendingFull, 1, __ATOMIC_RELEASE);
+}
+
+//Drift from the uptime against SNTP since sntpLast, averaged over the measurements
+static int32_t measureDrift(const timeSample &sample)
+{
+  int64_t spanUs = sample.uptimeUs - sntpLast.uptimeUs;
+  int64_t realUs = (int64_t)(sample.unixMs - sntpLast.unixMs) * 1000;
+
+  if (!sntpLastValid || spanUs < (int64_t)TIME_DRIFT_SPAN * 1000 || realUs <= 0)
+  {
+    if (!sntpLastValid)
+    {
+      sntpLast = sample;
+      sntpLastValid = true;
+    }
+    return anchor.driftPpb;
+  }
+  sntpLast = sample;
+
+  int64_t measured = (spanUs - realUs) * 1000000000 / realUs;
+  if (measured < -TIME_DRIFT_MAX || measured > TIME_DRIFT_MAX)
+  {
+    LOG_W("Clock drift %lld ppb ignored", (long long)measured);
+    return anchor.driftPpb;
+  }
+  int32_t drift = driftMeasured ? (int32_t)((3 * (int64_t)anchor.driftPpb + measured) / 4) : (int32_t)measured;
+  driftMeasured = true;
+  return drift;
+}
+
+uint8_t timeService()
+{
+  int64_t nowUs = halUptimeUs();
+
+  if (__atomic_load_n(&sntpPendingFull, __ATOMIC_ACQUIRE))
+  {
+    timeSample sample = sntpPending;
+    __atomic_store_n(&sntpPendingFull, 0, __ATOMIC_RELEASE);
+
+    int64_t offset = (int64_t)(sample.unixMs - anchorTime(&anchor, sample.uptimeUs));
+    int32_t drift = measureDrift(sample);
+    LOG_I("SNTP: clock %lld ms off, drift %ld ppb", (long long)offset, (long)drift);
+    sntpUptimeUs = sample.uptimeUs;
+    rtcWritePending = true;
+    return setReference(sample.unixMs, sample.uptimeUs, drift);
+  }
+
+  if ((sntpLastValid && nowUs - sntpUptimeUs < (int64_t)TIME_SNTP_VALID * 1000) ||
+      nowUs - rtcCheckedUs < (int64_t)TIME_RTC_PERIOD * 1000)
+  {
+    return TIME_UNCHANGED;
+  }
+
+  //Whole RTC seconds, anything within the second read is no error
+  uint64_t rtcMs = (uint64_t)halRtcNow() * 1000;
+  nowUs = halUptimeUs();
+  rtcCheckedUs = nowUs;
+  uint64_t ms = anchorTime(&anchor, nowUs);
+  if (ms + TIME_RTC_TOLERANCE >= rtcMs && ms < rtcMs + 1000 + TIME_RTC_TOLERANCE)
+  {
+    return TIME_UNCHANGED;
+  }
+  LOG_W("Clock %lld ms off the RTC, corrected", (long long)(int64_t)(rtcMs + 500 - ms));
+  return setReference(rtcMs + 500, nowUs, anchor.driftPpb);
+}
+
+uint8_t timeSetUtcOffset(int32_t seconds)
+{
+  int32_t previous = utcOffset;
+  int64_t nowUs = halUptimeUs();
+
+  if (seconds < -TIME_UTC_OFFSET_MAX || seconds > TIME_UTC_OFFSET_MAX || seconds == previous)
+  {
+    return TIME_UNCHANGED;
+  }
+  __atomic_store_n(&utcOffset, seconds, __ATOMIC_RELAXED);
+  halNvsOpen();
+  halNvsWrite(TIME_NVS_KEY, &seconds, sizeof(seconds));
+  halNvsClose();
+  LOG_I("UTC offset %ld s", (long)seconds);
+
+  if (!sntpLastValid || nowUs - sntpUptimeUs >= (int64_t)TIME_SNTP_VALID * 1000)
+  {
+    return TIME_UNCHANGED;
+  }
+  int64_t shiftMs = (int64_t)(seconds - previous) * 1000;
+  sntpLast.unixMs += shiftMs; //The drift measurement goes on across the shift
+  rtcWritePending = true;
+  return setReference(anchorTime(&anchor, nowUs) + shiftMs, nowUs, anchor.driftPpb);
+}
+
+int32_t timeUtcOffset()
+{
+  return __atomic_load_n(&utcOffset, __ATOMIC_RELAXED);
+}
+
+bool timeRtcWritePending()
+{
+  return rtcWritePending;
+}
+
+void timeWriteRtc()
+{
+  if (!rtcWritePending)
+  {
+    return;
+  }
+  rtcWritePending = false;
+  halRtcAdjust((uint32_t)((timeNowMs() + 500) / 1000));
+  rtcCheckedUs = halUptimeUs();
+}
+
+int32_t timeDriftPpb()
+{
+  timeAnchor a;
+
+  readAnchor(&a);
+  return a.driftPpb;
+}
@@ -0,0 +1,60 @@
+#ifndef TIME_SERVICE_H
+#define TIME_SERVICE_H
+
+#include <stdint.h>
+
+//Wall clock without the I2C bus. The DS1307 is read at boot, then only every TIME_RTC_PERIOD while
+//there is no SNTP. In between the time is the last reference plus the esp_timer uptime, corrected by
+//the crystal drift measured between SNTP samples. SNTP samples are written back to the RTC.
+//The clock, the RTC, datetime messages and the calendars are local wall time counted like unix time.
+//SNTP is UTC, its samples are shifted by the UTC offset (NVS TIME_NVS_KEY, TIME_UTC_OFFSET before it
+//is set). There are no DST rules, a site with DST gets the new offset sent when it changes.
+#define TIME_RTC_PERIOD 21600000ULL   //ms, RTC check while SNTP is missing
+#define TIME_RTC_TOLERANCE 500        //ms beyond the RTC second before the RTC is believed
+#define TIME_SNTP_VALID 10800000ULL   //ms an SNTP sample is trusted over the RTC
+#define TIME_DRIFT_SPAN 1800000ULL    //ms between SNTP samples for a drift measurement
+#define TIME_DRIFT_MAX 200000         //ppb, a larger drift is network delay, not the crystal
+#define TIME_STEP_MAX 2000            //ms, larger corrections step the clock
+#define TIME_VALID_AFTER 1629617400UL //2021-08-22 07:30:00, earlier SNTP results are ignored
+#define TIME_UTC_OFFSET_MAX 50400     //s, UTC+14
+#define TIME_NVS_KEY "utcOffset"
+#ifndef TIME_UTC_OFFSET
+#define TIME_UTC_OFFSET 0 //s local time is ahead of UTC, -DTIME_UTC_OFFSET=10800 for UTC+3
+#endif
+
+//timeService() results
+#define TIME_UNCHANGED 0
+#define TIME_CORRECTED 1 //by less than TIME_STEP_MAX, never backwards: re-arm the calendar deadline
+#define TIME_STEPPED 2   //re-apply the calendar states
+
+//timeBegin, timeSet, timeSetUtcOffset, timeService and timeWriteRtc belong to the control task, which owns the RTC.
+//The rest may be called from any task, not from ISRs.
+
+void timeBegin(); //Reads the RTC and the UTC offset, after halBegin()
+
+uint64_t timeNowMs(); //Unix ms
+uint32_t timeNow();   //Unix seconds
+
+//Manual setting, written to the RTC at once
+void timeSet(uint32_t unixtime);
+
+//SNTP result (UTC), taken over by the next timeService(). Dropped while the previous one is pending.
+void timeSntpSample(uint64_t unixMs);
+
+//New UTC offset in s, saved if it changed. A clock that follows SNTP moves by the difference
+//(TIME_STEPPED, also written to the RTC), one set by hand or from the RTC keeps its local time
+//(TIME_UNCHANGED). Offsets beyond TIME_UTC_OFFSET_MAX are ignored.
+uint8_t timeSetUtcOffset(int32_t seconds);
+int32_t timeUtcOffset();
+
+//Applies a pending SNTP sample, or checks the RTC when that is due. Returns TIME_*.
+uint8_t timeService();
+
+//An SNTP correction waits to be written to the RTC. The RTC counts whole seconds from the moment it
+//is written, timeWriteRtc() belongs just after a second boundary of timeNowMs().
+bool timeRtcWritePending();
+void timeWriteRtc();
+
+int32_t timeDriftPpb(); //measured uptime drift, + for a fast crystal
+
+#endif
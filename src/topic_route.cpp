@@ -0,0 +1,75 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "topic_route.h"
+
+static_assert(TOPIC_ROUTE_COUNT(0) <= 0xF0, "route counts are uint8_t, with room for the fixed routes");
+
+//<name>_calendar and <name>_calendar_bin of every actuator, <name> is the table string itself
+static char calendarSuffixes[ACTUATOR_COUNT][2][ACTUATOR_NAME_MAX + sizeof("_calendar_bin")];
+
+static int compareRoutes(const void *a, const void *b)
+{
+  return strcmp(((const topicRoute *)a)->suffix, ((const topicRoute *)b)->suffix);
+}
+
+const topicRoute *findTopicRoute(const topicRoute *routes, uint8_t count, const char *suffix)
+{
+  int low = 0, high = count - 1;
+
+  while (low <= high)
+  {
+    int mid = (low + high) / 2;
+    int cmp = strcmp(suffix, routes[mid].suffix);
+    if (cmp == 0)
+    {
+      return &routes[mid];
+    }
+    if (cmp < 0)
+    {
+      high = mid - 1;
+    }
+    else
+    {
+      low = mid + 1;
+    }
+  }
+  return NULL;
+}
+
+const topicRoute *routeTopic(const topicRoute *routes, uint8_t count, const char *prefix, size_t prefixLength,
+                             const char *topic)
+{
+  if (strncmp(topic, prefix, prefixLength) != 0)
+  {
+    return NULL;
+  }
+  return findTopicRoute(routes, count, topic + prefixLength);
+}
+
+bool payloadIs(const uint8_t *message, unsigned int length, const char *text)
+{
+  return length == strlen(text) && memcmp(message, text, length) == 0;
+}
+
+uint8_t buildTopicRoutes(topicRoute *routes, const topicRoute *fixed, uint8_t fixedCount,
+                         const actuatorTopicHandlers &handlers)
+{
+  uint8_t count = fixedCount;
+
+  memcpy(routes, fixed, fixedCount * sizeof(topicRoute));
+  for (uint8_t i = 0; i < ACTUATOR_COUNT; i++)
+  {
+    const char *name = actuatorTable[i].name;
+    uint8_t type = i + 1;
+
+    snprintf(calendarSuffixes[i][0], sizeof(calendarSuffixes[i][0]), "%s_calendar", name);
+    snprintf(calendarSuffixes[i][1], sizeof(calendarSuffixes[i][1]), "%s_calendar_bin", name);
+    routes[count++] = {name, handlers.state, type, true};
+    routes[count++] = {calendarSuffixes[i][0], handlers.calendar, type, false};
+    routes[count++] = {calendarSuffixes[i][1], handlers.calendarBinary, type, false};
+  }
+  qsort(routes, count, sizeof(topicRoute), compareRoutes);
+  return count;
+}
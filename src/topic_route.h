@@ -0,0 +1,45 @@
+#ifndef TOPIC_ROUTE_H
+#define TOPIC_ROUTE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "actuators.h"
+
+//Control topic handler, type is the actuator the route was registered for (0 if none)
+typedef void (*topicHandler)(uint8_t type, const uint8_t *message, unsigned int length);
+
+typedef struct
+{
+  const char *suffix; //after doa/<id>/control/
+  topicHandler handler;
+  uint8_t type;
+  bool echo; //print the payload, off for calendar bodies
+} topicRoute;
+
+//Handlers of the routes every actuator gets: <name>, <name>_calendar, <name>_calendar_bin
+typedef struct
+{
+  topicHandler state;
+  topicHandler calendar;
+  topicHandler calendarBinary;
+} actuatorTopicHandlers;
+
+#define ACTUATOR_ROUTES 3
+#define TOPIC_ROUTE_COUNT(fixedCount) ((fixedCount) + ACTUATOR_ROUTES * ACTUATOR_COUNT)
+
+//Fills routes (TOPIC_ROUTE_COUNT(fixedCount) entries) with the fixed routes and the routes of every row
+//of actuatorTable, sorted for findTopicRoute(). Returns the route count.
+uint8_t buildTopicRoutes(topicRoute *routes, const topicRoute *fixed, uint8_t fixedCount,
+                         const actuatorTopicHandlers &handlers);
+
+//Binary search over routes, which must be sorted by suffix (strcmp order). NULL if not found.
+const topicRoute *findTopicRoute(const topicRoute *routes, uint8_t count, const char *suffix);
+
+//Route of a full topic, NULL if it does not start with prefix or the suffix is unknown.
+//Nothing is allocated on the way.
+const topicRoute *routeTopic(const topicRoute *routes, uint8_t count, const char *prefix, size_t prefixLength,
+                             const char *topic);
+
+bool payloadIs(const uint8_t *message, unsigned int length, const char *text);
+
+#endif
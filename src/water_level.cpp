@@ -0,0 +1,124 @@
+#include "water_level.h"
+#include "actuators.h"
+#ifdef POWER_SAVE
+#include <esp_pm.h>
+#include <hal/gpio_ll.h>
+#endif
+
+static uint8_t sensePin;
+static uint8_t pumpPins[ACTUATOR_PUMPS_MAX]; //IRAM ISR, no reads of the table in flash
+static uint8_t pumpCount;
+static waterLevelCallback changeCallback;
+static hw_timer_t *debounceTimer = NULL;
+static volatile bool lowWater = true; //Assume empty until the first debounced sample
+static volatile bool timerArmed = false;
+static portMUX_TYPE pumpMux = portMUX_INITIALIZER_UNLOCKED;
+#ifdef POWER_SAVE
+//The debounce timer stops in light sleep, the window is held awake. NULL without CONFIG_PM_ENABLE.
+static esp_pm_lock_handle_t debounceAwake;
+#endif
+
+//Debounce window elapsed, the level is stable
+static void IRAM_ATTR onDebounceTimer()
+{
+  bool low = (digitalRead(sensePin) == LOW); //LOW: şamandıra boş konumunda
+  bool changed;
+
+  portENTER_CRITICAL_ISR(&pumpMux);
+  timerArmed = false;
+  changed = (low != lowWater);
+  lowWater = low;
+  if (low)
+  {
+    for (uint8_t i = 0; i < pumpCount; i++)
+    {
+      digitalWrite(pumpPins[i], HIGH); //Close the pumps, no task involved
+    }
+  }
+#ifdef POWER_SAVE
+  //Light sleep wakes on the other level, the level interrupt also runs onFloatSwitchEdge.
+  //gpio_ll: inline register access, safe while the flash cache is off.
+  gpio_ll_wakeup_enable(&GPIO, (gpio_num_t)sensePin, low ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL);
+  if (debounceAwake != NULL)
+  {
+    esp_pm_lock_release(debounceAwake);
+  }
+#endif
+  portEXIT_CRITICAL_ISR(&pumpMux);
+
+  if (changed && changeCallback != NULL)
+  {
+    changeCallback(low);
+  }
+}
+
+//Any edge on the float switch starts one debounce window. Edges inside the window are
+//bounces; the level is sampled when the window ends.
+static void IRAM_ATTR onFloatSwitchEdge()
+{
+  portENTER_CRITICAL_ISR(&pumpMux);
+  if (!timerArmed)
+  {
+    timerArmed = true;
+#ifdef POWER_SAVE
+    gpio_ll_set_intr_type(&GPIO, (gpio_num_t)sensePin, GPIO_INTR_ANYEDGE); //Level wakeup fired, back to edges
+    if (debounceAwake != NULL)
+    {
+      esp_pm_lock_acquire(debounceAwake);
+    }
+#endif
+    timerWrite(debounceTimer, 0);
+    timerAlarmEnable(debounceTimer);
+  }
+  portEXIT_CRITICAL_ISR(&pumpMux);
+}
+
+void waterLevelBegin(uint8_t lowWaterPin, uint32_t debounceMs, waterLevelCallback onChange)
+{
+  sensePin = lowWaterPin;
+  changeCallback = onChange;
+  for (uint8_t i = 0; i < ACTUATOR_COUNT; i++)
+  {
+    if (actuatorTable[i].flags & ACTUATOR_PUMP)
+    {
+      pumpPins[pumpCount++] = actuatorTable[i].pin;
+    }
+  }
+
+  debounceTimer = timerBegin(WATER_LEVEL_TIMER, 80, true); //80MHz / 80: 1us tick
+  timerAttachInterrupt(debounceTimer, onDebounceTimer, true);
+  timerAlarmWrite(debounceTimer, debounceMs * 1000, false); //one shot
+
+#ifdef POWER_SAVE
+  if (esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "debounce", &debounceAwake) != ESP_OK)
+  {
+    debounceAwake = NULL;
+  }
+#endif
+  attachInterrupt(digitalPinToInterrupt(sensePin), onFloatSwitchEdge, CHANGE);
+  onFloatSwitchEdge(); //First sample at the end of one debounce window
+}
+
+bool waterLevelIsLow()
+{
+  return lowWater;
+}
+
+bool waterLevelOpenPump(uint8_t pin)
+{
+  bool opened;
+
+  portENTER_CRITICAL(&pumpMux);
+  opened = !lowWater;
+  if (opened)
+  {
+    digitalWrite(pin, LOW); //Open the pump
+  }
+  portEXIT_CRITICAL(&pumpMux);
+  return opened;
+}
+
+void waterLevelClosePump(uint8_t pin)
+{
+  digitalWrite(pin, HIGH);
+}
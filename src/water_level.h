@@ -0,0 +1,23 @@
+#ifndef WATER_LEVEL_H
+#define WATER_LEVEL_H
+
+#include <Arduino.h>
+
+#define WATER_LEVEL_TIMER 0 //Hardware timer group 0, timer 0
+
+//Called from the debounce timer ISR after the float switch settled on a new level.
+//The pumps are already off when lowWater is true.
+typedef void (*waterLevelCallback)(bool lowWater);
+
+//Float switch on lowWaterPin (LOW: tank empty), interlocking the relays (active LOW) of every
+//ACTUATOR_PUMP row. With POWER_SAVE a change of the settled level also wakes the CPU from light sleep.
+void waterLevelBegin(uint8_t lowWaterPin, uint32_t debounceMs, waterLevelCallback onChange);
+
+//Last debounced level, no GPIO access
+bool waterLevelIsLow();
+
+//Opens the pump relay on pin unless the tank is empty. Checked atomically against the ISR.
+bool waterLevelOpenPump(uint8_t pin);
+void waterLevelClosePump(uint8_t pin);
+
+#endif